@@ -35,6 +35,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cassert>
 #include <string>
 #include <chrono>
+#include <thread>
 #ifdef _WIN32
 #include <winsock2.h>
 #pragma comment(lib, "ws2_32.lib")
@@ -43,6 +44,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "fjpeg.h"
 #include "fjpeg_bitstream.h"
 #include "fjpeg_transquant.h"
+#include "fjpeg_optimize.h"
 
 //#include "fjpeg_tables.h"
 
@@ -51,28 +53,33 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 
-// Generate jpeg header
-bool fjpeg_generate_header(fjpeg_bitstream* stream, fjpeg_context* context) {
-    
+// Bytes a table takes in a DHT segment, the class/ID byte, BITS and one byte per symbol
+static uint32_t fjpeg_dht_table_size(const fjpeg_short_huffman_table_t* table) {
+    uint32_t symbols = 0;
+    for (int i = 0; i < 16; i++) {
+        symbols += table->bits[i];
+    }
+    return 17 + symbols;
+}
+
+static void fjpeg_write_dht_table(fjpeg_bitstream* stream, int table_class, int id, const fjpeg_short_huffman_table_t* table) {
+    stream->writeBits(table_class, 4); // 0 DC, 1 AC
+    stream->writeBits(id, 4); // Table ID
+
+    for (int i = 0; i < 16; i++) {
+        stream->writeBits(table->bits[i], 8);
+    }
+
+    for (uint32_t i = 0; i < fjpeg_dht_table_size(table) - 17; i++) {
+        stream->writeBits(table->val[i], 8);
+    }
+}
+
+// DQT segments, in the order of the coefficients as coded
+static void fjpeg_write_dqt(fjpeg_bitstream* stream, fjpeg_context* context) {
+
     uint8_t tmp[64];
-    // SOI
-    stream->writeBits(0xFFD8, 16);
 
-    // APP0
-    stream->writeBits(0xFFE0, 16);
-    stream->writeBits(16, 16);
-    stream->writeBits(0x4A4649, 24); // "JFI"
-    stream->writeBits(0x4600, 16); // "F\0"
-    stream->writeBits(0x0102, 16); // Version
-    stream->writeBits(0x00, 8); // Units
-    stream->writeBits(0x0001, 16); // X density
-    stream->writeBits(0x0001, 16); // Y density
-    stream->writeBits(0x00, 8); // X thumbnail
-    stream->writeBits(0x00, 8); // Y thumbnail
-    // Thumbnail data
-    
-    // DQT
-    
     stream->writeBits(0xFFDB, 16);
     stream->writeBits(67, 16);
     stream->writeBits(0, 4);
@@ -81,8 +88,9 @@ bool fjpeg_generate_header(fjpeg_bitstream* stream, fjpeg_context* context) {
     for(int i = 0; i < 64; i++) {
         tmp[fjpeg_zigzag_8x8[i]] = context->fjpeg_luminance_quantization_table[i];
     }
+    // Oriented blocks are coded with their coefficients moved, the steps move with them
     for (int i = 0; i < 64; i++) {
-        stream->writeBits(tmp[i], 8);
+        stream->writeBits(tmp[context->orient_index[i]], 8);
     }
 
     if(context->channels > 1) {
@@ -96,17 +104,86 @@ bool fjpeg_generate_header(fjpeg_bitstream* stream, fjpeg_context* context) {
             tmp[fjpeg_zigzag_8x8[i]] = context->fjpeg_chrominance_quantization_table[i];
         }
         for (int i = 0; i < 64; i++) {
-            stream->writeBits(tmp[i], 8);
+            stream->writeBits(tmp[context->orient_index[i]], 8);
         }
     }
-    
-   
-    // SOF0
-    stream->writeBits(0xFFC0, 16);
+}
+
+// DHT segments, or DAC for arithmetic coding
+static void fjpeg_write_entropy_tables(fjpeg_bitstream* stream, fjpeg_context* context) {
+
+    if(context->arithmetic) {
+        // DAC, default conditioning for the luma and chroma tables
+        const int tables = context->channels > 1 ? 2 : 1;
+        stream->writeBits(0xFFCC, 16);
+        stream->writeBits(2 + tables * 4, 16); // Length
+        for (int i = 0; i < tables; i++) {
+            stream->writeBits(0, 4); // DC
+            stream->writeBits(i, 4); // Table ID
+            stream->writeBits((FJPEG_ARITH_DC_U << 4) | FJPEG_ARITH_DC_L, 8);
+            stream->writeBits(1, 4); // AC
+            stream->writeBits(i, 4); // Table ID
+            stream->writeBits(FJPEG_ARITH_AC_K, 8);
+        }
+    } else {
+        // DHT, luma and chroma each get a segment with their DC and AC table
+        stream->writeBits(0xFFC4, 16); // Huffman tables
+        stream->writeBits(2 + fjpeg_dht_table_size(&context->fjpeg_short_huffman_luma_dc) + fjpeg_dht_table_size(&context->fjpeg_short_huffman_luma_ac), 16); // Length
+        fjpeg_write_dht_table(stream, 0, 0, &context->fjpeg_short_huffman_luma_dc);
+        fjpeg_write_dht_table(stream, 1, 0, &context->fjpeg_short_huffman_luma_ac);
+
+        if(context->channels > 1) {
+            stream->writeBits(0xFFC4, 16); // Huffman tables
+            stream->writeBits(2 + fjpeg_dht_table_size(&context->fjpeg_short_huffman_chroma_dc) + fjpeg_dht_table_size(&context->fjpeg_short_huffman_chroma_ac), 16); // Length
+            fjpeg_write_dht_table(stream, 0, 1, &context->fjpeg_short_huffman_chroma_dc);
+            fjpeg_write_dht_table(stream, 1, 1, &context->fjpeg_short_huffman_chroma_ac);
+        }
+    }
+}
+
+// Write the markers from SOI up to and including SOS
+bool fjpeg_write_headers(fjpeg_bitstream* stream, fjpeg_context* context) {
+
+    context->row_index.clear();
+
+    // SOI
+    stream->writeBits(0xFFD8, 16);
+
+    if(!context->abbreviated) {
+        // APP0
+        stream->writeBits(0xFFE0, 16);
+        stream->writeBits(16, 16);
+        stream->writeBits(0x4A4649, 24); // "JFI"
+        stream->writeBits(0x4600, 16); // "F\0"
+        stream->writeBits(0x0102, 16); // Version
+        stream->writeBits(0x00, 8); // Units
+        stream->writeBits(0x0001, 16); // X density
+        stream->writeBits(0x0001, 16); // Y density
+        stream->writeBits(0x00, 8); // X thumbnail
+        stream->writeBits(0x00, 8); // Y thumbnail
+        // Thumbnail data
+
+        // APP0 JFXX extension with a JPEG coded thumbnail
+        if(!context->thumbnail.empty() && context->thumbnail.size() <= 65535 - 8) {
+            stream->writeBits(0xFFE0, 16);
+            stream->writeBits((uint32_t)context->thumbnail.size() + 8, 16);
+            stream->writeBits(0x4A4658, 24); // "JFX"
+            stream->writeBits(0x5800, 16); // "X\0"
+            stream->writeBits(0x10, 8); // Thumbnail coded using JPEG
+            for(size_t i = 0; i < context->thumbnail.size(); i++) {
+                stream->writeBits(context->thumbnail[i], 8);
+            }
+        }
+
+        fjpeg_write_dqt(stream, context);
+    }
+
+    // SOF0, or SOF9 for arithmetic coding
+    stream->writeBits(context->arithmetic?0xFFC9:0xFFC0, 16);
     stream->writeBits(context->channels==1?11:17, 16);
     stream->writeBits(8, 8); // 8 bits per sample
-    stream->writeBits(context->height, 16);
-    stream->writeBits(context->width, 16);
+    stream->writeBits(context->frameHeight(), 16);
+    stream->writeBits(context->frameWidth(), 16);
     stream->writeBits(context->channels, 8);
 
     for (int i = 0; i < context->channels; i++) {
@@ -115,134 +192,338 @@ bool fjpeg_generate_header(fjpeg_bitstream* stream, fjpeg_context* context) {
         stream->writeBits(i==0?0:1, 8); // Quant table
     }
 
+    if(!context->abbreviated) {
+        fjpeg_write_entropy_tables(stream, context);
 
-    // DHT
-    stream->writeBits(0xFFC4, 16); // Huffman tables
-    stream->writeBits(31+179, 16); // Length
-    stream->writeBits(0, 4); // DC
-    stream->writeBits(0, 4); // Table ID
+        // COM
+        stream->writeBits(0xFFFE, 16);
+        stream->writeBits((uint32_t)(strlen("FJPEG ")+strlen(FJPEG_VERSION)) + 2, 16);
 
-    for (int i = 0; i < 16; i++) {
-        stream->writeBits(context->fjpeg_short_huffman_luma_dc.bits[i], 8);
+        for(int i = 0; i < strlen("FJPEG "); i++) {
+            stream->writeBits("FJPEG "[i], 8);
+        }
+
+        for(int i = 0; i < strlen(FJPEG_VERSION); i++) {
+            stream->writeBits(FJPEG_VERSION[i], 8);
+        }
     }
 
-    for (int i = 0; i < 12; i++) {
-        stream->writeBits(context->fjpeg_short_huffman_luma_dc.val[i], 8);
+    // DRI
+    if(context->restart_rows > 0) {
+        stream->writeBits(0xFFDD, 16);
+        stream->writeBits(4, 16); // Length
+        stream->writeBits((uint32_t)context->restartInterval(), 16);
     }
 
-    //stream->writeBits(0xFFC4, 16); // Huffman tables
-    //stream->writeBits(181, 16); // Length
-    stream->writeBits(1, 4); // AC
-    stream->writeBits(0, 4); // Table ID
+    // SOS
+    stream->writeBits(0xFFDA, 16);
+    stream->writeBits(context->channels==1?8:12, 16); // Length
+    stream->writeBits(context->channels, 8);
 
-    for (int i = 0; i < 16; i++) {
-        stream->writeBits(context->fjpeg_short_huffman_luma_ac.bits[i], 8);
+    for (int i = 0; i < context->channels; i++) {
+        stream->writeBits(i + 1, 8); // Component ID
+        stream->writeBits(i == 0 ? 0 : 0x11, 8); // Huffman table
     }
 
-    for (int i = 0; i < 162; i++) {
-        stream->writeBits(context->fjpeg_short_huffman_luma_ac.val[i], 8);
+    stream->writeBits(0, 8); // DCT coeff start
+    stream->writeBits(0x3F, 8); // DCT coeff end
+    stream->writeBits(0, 8); // Successive Approximation
+
+    return true;
+}
+
+// Tables-only abbreviated stream (SOI, DQT, DHT or DAC, EOI) for the frames written
+// with context->abbreviated, a decoder reads it once before the first frame
+bool fjpeg_write_tables(fjpeg_bitstream* stream, fjpeg_context* context) {
+
+    stream->writeBits(0xFFD8, 16);
+    fjpeg_write_dqt(stream, context);
+    fjpeg_write_entropy_tables(stream, context);
+    stream->writeBits(0xFFD9, 16);
+
+    stream->flushToFile();
+
+    return !stream->failed;
+}
+
+// Reset the predictors and coder state and start the entropy coded segment after SOS
+void fjpeg_entropy_begin(fjpeg_bitstream* stream, fjpeg_context* context) {
+    memset(context->last_dc_coeff, 0, sizeof(context->last_dc_coeff));
+    if(context->arithmetic) {
+        fjpeg_arith_start(&context->arith_state);
     }
+    stream->alignByte();
+    stream->avoidFF = true;
+}
 
-    if(context->channels > 1) {
-        stream->writeBits(0xFFC4, 16); // Huffman tables
-        stream->writeBits(210, 16); // Length
+// Flush the coder and pad the entropy coded segment to a byte boundary
+void fjpeg_entropy_close_segment(fjpeg_bitstream* stream, fjpeg_context* context) {
+    if(context->arithmetic) {
+        fjpeg_arith_finish(stream, &context->arith_state);
+    }
+    stream->alignByte();
+}
 
-        stream->writeBits(0, 4); // DC
-        stream->writeBits(1, 4); // Table ID
+// End restart interval "interval" (counting from 0) with its RSTn marker and start the next one
+void fjpeg_entropy_restart(fjpeg_bitstream* stream, fjpeg_context* context, int64_t interval) {
+    fjpeg_entropy_close_segment(stream, context);
+    stream->avoidFF = false;
+    stream->writeBits(0xFFD0 + (uint32_t)(interval & 7), 16);
+    fjpeg_entropy_begin(stream, context);
+}
 
-        for (int i = 0; i < 16; i++) {
-            stream->writeBits(context->fjpeg_short_huffman_chroma_dc.bits[i], 8);
-        }
+// Called before MCU row "row" is coded, records where the row starts for the row index.
+// Arithmetic coded rows can only be entered at the start of a restart interval
+void fjpeg_entropy_row_begin(fjpeg_bitstream* stream, fjpeg_context* context, int64_t row) {
+    if(!context->record_row_index) {
+        return;
+    }
+    if(context->arithmetic && row > 0 && (context->restart_rows == 0 || row % context->restart_rows != 0)) {
+        return;
+    }
 
-        for (int i = 0; i < 12; i++) {
-            stream->writeBits(context->fjpeg_short_huffman_chroma_dc.val[i], 8);
-        }
+    stream->flushCompleteBytes();
 
-        stream->writeBits(1, 4); // AC
-        stream->writeBits(1, 4); // Table ID
+    fjpeg_row_index_t entry;
+    entry.row = row;
+    entry.offset = stream->bytePosition();
+    entry.bit = stream->offset;
+    memcpy(entry.dc, context->last_dc_coeff, sizeof(entry.dc));
+    context->row_index.push_back(entry);
+}
 
-        for (int i = 0; i < 16; i++) {
-            stream->writeBits(context->fjpeg_short_huffman_chroma_ac.bits[i], 8);
-        }
+// Called after MCU row "row" is coded, starts a new restart interval when one is complete
+void fjpeg_entropy_row_end(fjpeg_bitstream* stream, fjpeg_context* context, int64_t row) {
+    const int64_t rows = context->paddedFrameHeight() / context->mcuSize();
+    if(context->restart_rows > 0 && (row + 1) % context->restart_rows == 0 && row + 1 < rows) {
+        fjpeg_entropy_restart(stream, context, row / context->restart_rows);
+    }
+}
+
+// Close the entropy coded segment and write EOI
+bool fjpeg_write_trailer(fjpeg_bitstream* stream, fjpeg_context* context) {
+    // Pad the last byte with 1-bits while byte stuffing is still active
+    fjpeg_entropy_close_segment(stream, context);
+    stream->avoidFF = false;
+
+    // EOI
+    stream->writeBits(0xFFD9, 16);
+
+    return true;
+}
+
+// Generate jpeg header
+bool fjpeg_generate_header(fjpeg_bitstream* stream, fjpeg_context* context) {
+
+    if(!context->orientationAligned()) {
+        fprintf(stderr, "Error: Mirrored axes must be a multiple of %d pixels\n", context->mcuSize());
+        return false;
+    }
+
+    // Optimized tables go into DHT, so the effort passes run before any header
+    fjpeg_optimize_frame(context);
 
-        for (int i = 0; i < 162; i++) {
-            stream->writeBits(context->fjpeg_short_huffman_chroma_ac.val[i], 8);
+    fjpeg_write_headers(stream, context);
+
+    // Entropy coded huffman data
+    fjpeg_entropy_begin(stream, context);
+
+    int rows = 0;
+    for(int y = 0; y < context->paddedFrameHeight(); y+=context->mcuSize()) {
+        fjpeg_entropy_row_begin(stream, context, y / context->mcuSize());
+        fjpeg_entropy_encode_mcu_row(stream, context, y);
+        fjpeg_entropy_row_end(stream, context, y / context->mcuSize());
+        if(context->flush_rows > 0 && ++rows % context->flush_rows == 0) {
+            stream->flushBytes();
         }
     }
 
-    // COM
-    stream->writeBits(0xFFFE, 16);
-    stream->writeBits((uint32_t)(strlen("FJPEG ")+strlen(FJPEG_VERSION)) + 2, 16);
+    fjpeg_write_trailer(stream, context);
+
+    stream->flushToFile();
+
+    return !stream->failed;
+}
+
+// Transform and entropy code row by row so the first bytes reach the sink after flush_rows rows
+bool fjpeg_encode_frame(fjpeg_bitstream* stream, fjpeg_context* context) {
 
-    for(int i = 0; i < strlen("FJPEG "); i++) {
-        stream->writeBits("FJPEG "[i], 8);
+    // The effort passes, the fitted quantization tables and the block reordering of an
+    // oriented frame need every coefficient before the first byte is coded
+    if(context->optimize_huffman || context->quant_search > 0 || context->target_psnr > 0.0f ||
+       context->orientation != FJPEG_ORIENT_NORMAL) {
+        fjpeg_transquant_input(context);
+        return fjpeg_generate_header(stream, context);
     }
 
-    for(int i = 0; i < strlen(FJPEG_VERSION); i++) {
-        stream->writeBits(FJPEG_VERSION[i], 8);
+    fjpeg_write_headers(stream, context);
+
+    fjpeg_entropy_begin(stream, context);
+    stream->flushBytes();
+    context->resetDistortion();
+
+    int rows = 0;
+    for(int y = 0; y < context->paddedHeight(); y+=context->mcuSize()) {
+        fjpeg_transquant_mcu_row(context, y);
+        fjpeg_entropy_row_begin(stream, context, y / context->mcuSize());
+        fjpeg_entropy_encode_mcu_row(stream, context, y);
+        fjpeg_entropy_row_end(stream, context, y / context->mcuSize());
+        if(context->flush_rows > 0 && ++rows % context->flush_rows == 0) {
+            stream->flushBytes();
+        }
     }
 
-    // SOS
-    stream->writeBits(0xFFDA, 16);
-    stream->writeBits(context->channels==1?8:12, 16); // Length
-    stream->writeBits(context->channels, 8);
+    fjpeg_write_trailer(stream, context);
 
-    for (int i = 0; i < context->channels; i++) {
-        stream->writeBits(i + 1, 8); // Component ID
-        stream->writeBits(i == 0 ? 0 : 0x11, 8); // Huffman table
+    stream->flushToFile();
+
+    return !stream->failed;
+}
+
+// Encode the frame at several qualities, the DCT runs once and every quality quantizes
+// and entropy codes its own copy of the coefficients on its own thread
+bool fjpeg_encode_ladder(fjpeg_context* context, const int* qualities, int count, fjpeg_output_sink** sinks) {
+
+    for(int y = 0; y < context->paddedHeight(); y+=context->mcuSize()) {
+        fjpeg_dct_mcu_row(context, y);
     }
 
-    stream->writeBits(0, 8); // DCT coeff start
-    stream->writeBits(0x3F, 8); // DCT coeff end
-    stream->writeBits(0, 8); // Successive Approximation
+    std::vector<fjpeg_context*> levels;
+    for(int i = 0; i < count; i++) {
+        fjpeg_context* level = new fjpeg_context();
+        level->channels = context->channels;
+        level->width = context->width;
+        level->height = context->height;
+        level->arithmetic = context->arithmetic;
+        level->restart_rows = context->restart_rows;
+        level->optimize_huffman = context->optimize_huffman;
+        level->quant_search = context->quant_search;
+        levels.push_back(level);
+    }
 
-    // Entropy coded huffman data
-    // Luma from context->fjpeg_ydct
-    // Chroma from context->fjpeg_cbdct and context->fjpeg_crdct
-    int last_dc_coeff[3] = {0, 0, 0};
-    fjpeg_coeff_t dct_block[64];
-    stream->avoidFF = true;
-    const int inc_xy = context->channels==1?8:16;
-    const int max_uv = context->channels==1?1:2;
-    
-    for(int y = 0; y < context->height; y+=inc_xy) {
-        for(int x = 0; x < context->width; x+=inc_xy) {
-
-            for(int v = 0; v < max_uv; v++) {
-                for(int u = 0; u < max_uv; u++) {
-                    #ifdef FJPEG_DEBUG_BLOCK
-                    printf("Encoding block %dx%d + %dx%d\n", x, y, u*8, v*8);
-                    #endif
-                    fjpeg_extract_coeff_8x8(context, dct_block, x+u*8, y+v*8, 0);
-                    // Print out the block
-                    #ifdef FJPEG_DEBUG_BLOCK
-                    for(int i = 0; i < 64; i++) {
-                        printf("%3d ", (int16_t)(dct_block[i]+0.5f));
-                        if((i+1)%8 == 0) printf("\r\n");
-                    }
-                    #endif                    
-                    last_dc_coeff[0] = fjpeg_entropy_encode_block(stream, context, dct_block, 0, last_dc_coeff[0]);
+    std::vector<char> results(count, 0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < count; i++) {
+        threads.push_back(std::thread([&, i] {
+            fjpeg_context* level = levels[i];
+            if(!level->setQuality(qualities[i]) || !level->allocPlanes(level->paddedHeight(), false)) {
+                return;
+            }
+
+            // The effort passes of a preset need the whole level quantized before its headers
+            const bool effort = level->optimize_huffman || level->quant_search > 0;
+            if(effort) {
+                for(int y = 0; y < level->paddedHeight(); y+=level->mcuSize()) {
+                    fjpeg_quant_mcu_row(level, context, y);
                 }
+                fjpeg_optimize_frame(level);
             }
 
-            if(context->channels==3) {
-                fjpeg_extract_coeff_8x8(context, dct_block, x>>1, y>>1, 1);
-                last_dc_coeff[1] = fjpeg_entropy_encode_block(stream, context, dct_block, 1, last_dc_coeff[1]);
+            fjpeg_bitstream stream(sinks[i]);
+            fjpeg_write_headers(&stream, level);
+            fjpeg_entropy_begin(&stream, level);
 
-                fjpeg_extract_coeff_8x8(context, dct_block, x>>1, y>>1, 2);
-                last_dc_coeff[2] = fjpeg_entropy_encode_block(stream, context, dct_block, 2, last_dc_coeff[2]);
+            for(int y = 0; y < level->paddedHeight(); y+=level->mcuSize()) {
+                if(!effort) {
+                    fjpeg_quant_mcu_row(level, context, y);
+                }
+                fjpeg_entropy_encode_mcu_row(&stream, level, y);
+                fjpeg_entropy_row_end(&stream, level, y / level->mcuSize());
             }
+
+            fjpeg_write_trailer(&stream, level);
+            stream.flushToFile();
+            results[i] = !stream.failed;
+        }));
+    }
+
+    bool ok = true;
+    for(int i = 0; i < count; i++) {
+        threads[i].join();
+        ok = ok && results[i];
+        delete levels[i];
+    }
+
+    return ok;
+}
+
+bool fjpeg_stream_begin(fjpeg_bitstream* stream, fjpeg_context* context, int width, int height) {
+    if (width < 1 || height < 1 || width > 65535 || height > 65535) {
+        return false;
+    }
+
+    context->width = width;
+    context->height = height;
+
+    // Planes hold a single MCU row
+    if (!context->allocPlanes(context->mcuSize())) {
+        return false;
+    }
+
+    context->streaming = true;
+    context->stream_lines = 0;
+    context->resetDistortion();
+
+    fjpeg_write_headers(stream, context);
+    fjpeg_entropy_begin(stream, context);
+    stream->flushBytes();
+
+    return true;
+}
+
+// Push one strip of mcuSize() lines (16 for 4:2:0), only the last strip may be shorter
+bool fjpeg_stream_push(fjpeg_bitstream* stream, fjpeg_context* context, const fjpeg_pixel_t* y, const fjpeg_pixel_t* cb, const fjpeg_pixel_t* cr, int lines) {
+    const int mcu = context->mcuSize();
+    const int64_t remaining = context->height - context->stream_lines;
+
+    if (!context->streaming || lines < 1 || lines > mcu || lines > remaining) {
+        return false;
+    }
+    if (lines < mcu && lines != remaining) {
+        return false;
+    }
+
+    // Copy the strip into the padded MCU row, replicating the last line downwards
+    for (int j = 0; j < mcu; j++) {
+        const int src_line = FJPEG_MIN(j, lines - 1);
+        context->storeLine(context->fjpeg_y + j * context->luma_stride, y + (int64_t)src_line * context->width, context->width, context->luma_stride);
+    }
+
+    if (context->channels == 3) {
+        const int chroma_lines = (lines + 1) >> 1;
+        for (int j = 0; j < mcu / 2; j++) {
+            const int64_t src_offset = (int64_t)FJPEG_MIN(j, chroma_lines - 1) * context->chromaWidth();
+            context->storeLine(context->fjpeg_cb + j * context->chroma_stride, cb + src_offset, context->chromaWidth(), context->chroma_stride);
+            context->storeLine(context->fjpeg_cr + j * context->chroma_stride, cr + src_offset, context->chromaWidth(), context->chroma_stride);
         }
     }
-    stream->avoidFF = false;
 
+    fjpeg_transquant_mcu_row(context, 0);
+    fjpeg_entropy_row_begin(stream, context, context->stream_lines / mcu);
+    fjpeg_entropy_encode_mcu_row(stream, context, 0);
+    fjpeg_entropy_row_end(stream, context, context->stream_lines / mcu);
 
-    // EOI
-    stream->writeBits(0xFFD9, 16);
+    context->stream_lines += lines;
+
+    // Completed bytes go out every flush_rows rows, every row when unset
+    const int64_t rows = (context->stream_lines + mcu - 1) / mcu;
+    if(context->flush_rows <= 1 || rows % context->flush_rows == 0) {
+        stream->flushBytes();
+    }
 
+    return !stream->failed;
+}
+
+bool fjpeg_stream_end(fjpeg_bitstream* stream, fjpeg_context* context) {
+    if (!context->streaming || context->stream_lines != context->height) {
+        return false;
+    }
+
+    fjpeg_write_trailer(stream, context);
     stream->flushToFile();
+    context->streaming = false;
 
-    return true;
+    return !stream->failed;
 }
 
 
@@ -250,9 +531,35 @@ void fjpeg_print_usage() {
     printf("Usage: fjpeg [options]\r\n");
     printf("Example: fjpeg -i input.yuv -q 50 -r 1280x720 -o output.jpg\r\n");
     printf("Options:\r\n");
-    printf("  -i <input_filename>  input YUV file\r\n");
-    printf("  -q <quality>  Set quality factor (1-100)\r\n");
+    printf("  -i <input_filename>  input YUV file, a baseline .jpg is transcoded to the new quality\r\n");
+    printf("  -q <quality>  Set quality factor (1-100), a list like 40,60,85 encodes a ladder\r\n");
     printf("  -r <width>x<height>  Set resolution\r\n");
     printf("  -o <output_filename>  Output JPEG file\r\n");
+    printf("  --thumbnail <file>  Write a 1/8 scale thumbnail built from the DC coefficients\r\n");
+    printf("  --pyramid <scales>  Also write 1/2, 1/4 or 1/8 size outputs from the DCT coefficients, e.g. 2,4\r\n");
+    printf("  --preset <name>  Encoder effort: ultrafast, fast, medium, slow or placebo, \"all\" compares them\r\n");
+    printf("  --restart <rows>  Write a restart marker every n MCU rows\r\n");
+    printf("  --index <file>  Write the byte offset and DC predictors of every MCU row to a sidecar index\r\n");
+    printf("  --autotune  Time DCT kernels, thread counts and band heights at -r (on -i or a synthetic frame), save the fastest to -o\r\n");
+    printf("  --target-psnr <dB>  Fit the quantization tables to the frame for this luma PSNR instead of scaling them by -q\r\n");
+    printf("  --crop <WxH+X+Y>  Encode only this region of the -r sized input, X and Y even\r\n");
+    printf("  --orient <op>  Write the frame rotated or mirrored: rot90, rot180, rot270, hflip, vflip, transpose or transverse\r\n");
+    printf("  --reuse  Encode a YUV sequence reusing the coded restart intervals that did not change\r\n");
+    printf("  --arithmetic  Use arithmetic coding (SOF9) instead of Huffman coding\r\n");
+    printf("  --embed-thumbnail  Embed the DC thumbnail as a JFXX APP0 extension\r\n");
+    printf("  --stream  Encode in 16-line strips with bounded memory\r\n");
+    printf("  --flush-rows <n>  Emit output bytes after every n MCU rows\r\n");
+    printf("  --pipeline  Encode a YUV sequence with overlapped read, encode and write\r\n");
+    printf("  --frames <n>  Number of frames to encode from the sequence\r\n");
+    printf("  --tables <file>  Write the DQT and DHT tables once to this file and leave them out of the sequence frames\r\n");
+    printf("  --fps <rate>  Frame rate of an .avi output, e.g. 25 or 30000/1001 (default 25)\r\n");
+    printf("  --batch <manifest>  Encode every \"input WxH quality output\" line of the manifest\r\n");
+    printf("  --threads <n>  Number of encoder threads, batch workers or server contexts\r\n");
+    printf("  --serve <socket>  Run as an encode daemon on a Unix domain socket\r\n");
+    printf("  --max-frame <MB>  Largest frame --serve accepts (default 96)\r\n");
+    printf("  --client <socket>  Encode through a running daemon\r\n");
+    printf("  --cache <dir>  Reuse earlier outputs for identical input and settings, stored in dir\r\n");
+    printf("  --cache-size <MB>  Cache capacity, in memory when no directory is given, files already in dir count (default 1024)\r\n");
+    printf("  --memfd  Pass the frame to the daemon as a memfd instead of inline\r\n");
     printf("  -h  Show help\r\n");
 }
@@ -32,12 +32,25 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstring>
 #include <cmath>
 #include <cstdint>
+#include <vector>
+#include <atomic>
 
 #include "fjpeg_global.h"
 #include "fjpeg_huffman.h"
+#include "fjpeg_arith.h"
 
+class fjpeg_output_sink;
 
 
+
+// Where an MCU row starts in the output, enough to resume entropy decoding there
+typedef struct {
+    int64_t row;
+    int64_t offset;  // Byte holding the first bit of the row, from the start of the output
+    int bit;         // Bits of that byte that belong to the previous row
+    int dc[3];       // DC predictors at the start of the row
+} fjpeg_row_index_t;
+
 class fjpeg_context {
     public:
     FILE* input;
@@ -68,16 +81,71 @@ class fjpeg_context {
     fjpeg_coeff_t* fjpeg_cbdct;
     fjpeg_coeff_t* fjpeg_crdct;
 
-    float precalc_cos[8][8];
+    // Plane strides in pixels, planes are padded to full MCUs
+    int64_t luma_stride;
+    int64_t chroma_stride;
+
+    // Padded luma lines the planes were allocated for, one MCU row while streaming
+    int64_t plane_lines;
+
+    // Caller owned planes the transform reads in place instead of fjpeg_y/cb/cr, set by
+    // setInputPlanes, the pointers are at the crop origin and edges replicate on the fly
+    const fjpeg_pixel_t* input_planes[3];
+    int64_t input_strides[3];
+
+    // JPEG stream embedded as a JFXX thumbnail extension after the JFIF APP0, empty for none
+    std::vector<uint8_t> thumbnail;
+
+    // Hand completed bytes to the output sink after this many MCU rows, 0 flushes only at EOI
+    int flush_rows;
+
+    // Row-push streaming state
+    bool streaming;
+    int64_t stream_lines;
+    int last_dc_coeff[3];
+
+    // MCU rows per restart interval, 0 writes no DRI and no restart markers
+    int restart_rows;
+
+    // Frame headers leave out APP0, DQT, DHT/DAC and COM (ITU T.81 B.5 abbreviated format),
+    // the decoder gets the tables once from fjpeg_write_tables
+    bool abbreviated;
+
+    // Entry points of the MCU rows of the last frame, collected when record_row_index is set
+    bool record_row_index;
+    std::vector<fjpeg_row_index_t> row_index;
+
+    // Orientation the frame is written in, FJPEG_ORIENT_*, applied to the coefficient blocks
+    // while entropy coding so the planes keep the input orientation
+    int orientation;
+    // Per output zigzag position, the source zigzag position and whether its sign flips
+    uint8_t orient_index[64];
+    bool orient_negate[64];
+
+    // Arithmetic coding (SOF9) instead of Huffman coding
+    bool arithmetic;
+    fjpeg_arith_state_t arith_state;
+
+    // Squared quantization error of the current frame per component in 1/256 units, the
+    // DCT is orthonormal so this is also the squared pixel error of the coded blocks,
+    // bands on other threads add their rows concurrently
+    std::atomic<int64_t> distortion[3];
+
+    // Encoder effort, the presets in fjpeg_optimize.h pick these together
+    int dct_method;
+    // Blocks whose pixel range is at most this only get a DC coefficient, -1 disables
+    int flat_threshold;
+    // Huffman tables built from the symbol statistics of the frame, needs the whole frame transformed,
+    // ignored for abbreviated frames which keep the shared tables
+    bool optimize_huffman;
+    // Rate-distortion passes that drop trailing +-1 coefficients, 0 disables
+    int quant_search;
+    // Luma PSNR in dB the quantization tables are fitted to for each frame, 0 keeps the
+    // tables of setQuality, see fjpeg_optimize_quantization
+    float target_psnr;
 
-    void fjpeg_precals_cos() {
-        for (int i = 0; i < 8; i++) {
-            for(int j = 0; j < 8; j++) {
-                precalc_cos[i][j] = cosf((2.f * i + 1.f) * j * M_PI / 16.f);
-            }
-        }
-        
-    }
+    float precalc_cos[8][8];
+    float aan_scale[64];
 
     fjpeg_context() {
         input = nullptr;
@@ -86,25 +154,44 @@ class fjpeg_context {
         height = 0;
         quality = 0;
         channels = 3;
-        memset(fjpeg_luminance_quantization_table, 0, 64);
-        memset(fjpeg_chrominance_quantization_table, 0, 64);
-        memset(fjpeg_huffman_luma_dc, 0, 16 * sizeof(fjpeg_huffman_table_t));
-        memset(fjpeg_huffman_luma_ac, 0, 256 * sizeof(fjpeg_huffman_table_t));
-        memset(fjpeg_huffman_chroma_dc, 0, 16 * sizeof(fjpeg_huffman_table_t));
-        memset(fjpeg_huffman_chroma_ac, 0, 256 * sizeof(fjpeg_huffman_table_t));
         fjpeg_y = nullptr;
         fjpeg_cb = nullptr;
         fjpeg_cr = nullptr;
         fjpeg_ydct = nullptr;
         fjpeg_cbdct = nullptr;
         fjpeg_crdct = nullptr;
+        luma_stride = 0;
+        chroma_stride = 0;
+        plane_lines = 0;
+        input_planes[0] = input_planes[1] = input_planes[2] = nullptr;
+        input_strides[0] = input_strides[1] = input_strides[2] = 0;
+        flush_rows = 0;
+        streaming = false;
+        stream_lines = 0;
+        memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
+        arithmetic = false;
+        restart_rows = 0;
+        abbreviated = false;
+        record_row_index = false;
+        resetDistortion();
+        setOrientation(FJPEG_ORIENT_NORMAL);
+        dct_method = FJPEG_DCT_REFERENCE;
+        flat_threshold = -1;
+        optimize_huffman = false;
+        quant_search = 0;
+        target_psnr = 0.0f;
 
         memcpy(fjpeg_luminance_quantization_table, fjpeg_default_luma_quant_table, 64);
         memcpy(fjpeg_chrominance_quantization_table, fjpeg_default_chroma_quant_table, 64);
 
-        fjpeg_generate_tables(fjpeg_huffman_luma_dc, &fjpeg_default_huffman_luma_dc);
+        // Code tables and the cos table are built once per process and copied from there
+        const fjpeg_default_tables_t* tables = fjpeg_default_tables();
+        memcpy(fjpeg_huffman_luma_dc, tables->huffman_luma_dc, sizeof(fjpeg_huffman_luma_dc));
+        memcpy(fjpeg_huffman_luma_ac, tables->huffman_luma_ac, sizeof(fjpeg_huffman_luma_ac));
+        memcpy(fjpeg_huffman_chroma_dc, tables->huffman_chroma_dc, sizeof(fjpeg_huffman_chroma_dc));
+        memcpy(fjpeg_huffman_chroma_ac, tables->huffman_chroma_ac, sizeof(fjpeg_huffman_chroma_ac));
         #ifdef FJPEG_DEBUG_HUFFMAN
-        for(int i = 0; i < 256; i++) {
+        for(int i = 0; i < 16; i++) {
             if(fjpeg_huffman_luma_dc[i].len == 0) continue;
             printf("%i\t%i\t", i, fjpeg_huffman_luma_dc[i].len);
             for(int ii = fjpeg_huffman_luma_dc[i].len-1; ii >= 0; ii--) {
@@ -114,16 +201,13 @@ class fjpeg_context {
         }
         #endif
 
-        fjpeg_generate_tables(fjpeg_huffman_luma_ac, &fjpeg_default_huffman_luma_ac);
-        fjpeg_generate_tables(fjpeg_huffman_chroma_dc, &fjpeg_default_huffman_chroma_dc);
-        fjpeg_generate_tables(fjpeg_huffman_chroma_ac, &fjpeg_default_huffman_chroma_ac);
-
         memcpy(&fjpeg_short_huffman_chroma_dc, &fjpeg_default_huffman_chroma_dc, sizeof(fjpeg_short_huffman_table_t));
         memcpy(&fjpeg_short_huffman_chroma_ac, &fjpeg_default_huffman_chroma_ac, sizeof(fjpeg_short_huffman_table_t));
         memcpy(&fjpeg_short_huffman_luma_dc, &fjpeg_default_huffman_luma_dc, sizeof(fjpeg_short_huffman_table_t));
         memcpy(&fjpeg_short_huffman_luma_ac, &fjpeg_default_huffman_luma_ac, sizeof(fjpeg_short_huffman_table_t));
 
-        fjpeg_precals_cos();
+        memcpy(precalc_cos, tables->precalc_cos, sizeof(precalc_cos));
+        memcpy(aan_scale, tables->aan_scale, sizeof(aan_scale));
     }
 
     bool setQuality(int quality) {
@@ -144,30 +228,280 @@ class fjpeg_context {
         return true;
     }
 
+    bool setOrientation(int orientation) {
+        if (orientation < FJPEG_ORIENT_NORMAL || orientation > FJPEG_ORIENT_ROTATE_270) {
+            return false;
+        }
+        this->orientation = orientation;
+
+        // Mirroring a block negates its odd horizontal (u) or vertical (v) frequencies,
+        // transposing it swaps u and v
+        const bool negate_u = orientation == FJPEG_ORIENT_FLIP_H || orientation == FJPEG_ORIENT_ROTATE_180 ||
+                              orientation == FJPEG_ORIENT_ROTATE_90 || orientation == FJPEG_ORIENT_TRANSVERSE;
+        const bool negate_v = orientation == FJPEG_ORIENT_FLIP_V || orientation == FJPEG_ORIENT_ROTATE_180 ||
+                              orientation == FJPEG_ORIENT_ROTATE_270 || orientation == FJPEG_ORIENT_TRANSVERSE;
+        for (int v = 0; v < 8; v++) {
+            for (int u = 0; u < 8; u++) {
+                const int out = fjpeg_zigzag_8x8[v * 8 + u];
+                orient_index[out] = fjpeg_zigzag_8x8[transposed() ? u * 8 + v : v * 8 + u];
+                orient_negate[out] = ((negate_u && (u & 1)) != (negate_v && (v & 1)));
+            }
+        }
+        return true;
+    }
+
+    bool transposed() const {
+        return orientation >= FJPEG_ORIENT_TRANSPOSE;
+    }
+
+    // Size of the written frame, width and height swap for the transposing orientations
+    int frameWidth() const {
+        return transposed() ? height : width;
+    }
+
+    int frameHeight() const {
+        return transposed() ? width : height;
+    }
+
+    int paddedFrameWidth() const {
+        return transposed() ? paddedHeight() : paddedWidth();
+    }
+
+    int paddedFrameHeight() const {
+        return transposed() ? paddedWidth() : paddedHeight();
+    }
+
+    // Mirrored axes must be whole MCUs, padding would otherwise end up inside the frame
+    bool orientationAligned() const {
+        const bool mirror_x = orientation == FJPEG_ORIENT_FLIP_H || orientation == FJPEG_ORIENT_ROTATE_180 ||
+                              orientation == FJPEG_ORIENT_TRANSVERSE || orientation == FJPEG_ORIENT_ROTATE_270;
+        const bool mirror_y = orientation == FJPEG_ORIENT_FLIP_V || orientation == FJPEG_ORIENT_ROTATE_180 ||
+                              orientation == FJPEG_ORIENT_TRANSVERSE || orientation == FJPEG_ORIENT_ROTATE_90;
+        return (!mirror_x || width % mcuSize() == 0) && (!mirror_y || height % mcuSize() == 0);
+    }
+
+    // Plane position of the block that lands at (x, y) of the written frame, in pixels of the channel
+    void orientedSource(int channel, int x, int y, int* sx, int* sy) const {
+        const int w = channel == 0 ? paddedWidth() : paddedWidth() >> 1;
+        const int h = channel == 0 ? paddedHeight() : paddedHeight() >> 1;
+        switch (orientation) {
+            case FJPEG_ORIENT_FLIP_H: *sx = w - 8 - x; *sy = y; break;
+            case FJPEG_ORIENT_ROTATE_180: *sx = w - 8 - x; *sy = h - 8 - y; break;
+            case FJPEG_ORIENT_FLIP_V: *sx = x; *sy = h - 8 - y; break;
+            case FJPEG_ORIENT_TRANSPOSE: *sx = y; *sy = x; break;
+            case FJPEG_ORIENT_ROTATE_90: *sx = y; *sy = h - 8 - x; break;
+            case FJPEG_ORIENT_TRANSVERSE: *sx = w - 8 - y; *sy = h - 8 - x; break;
+            case FJPEG_ORIENT_ROTATE_270: *sx = w - 8 - y; *sy = x; break;
+            default: *sx = x; *sy = y; break;
+        }
+    }
+
+    void resetDistortion() {
+        distortion[0] = distortion[1] = distortion[2] = 0;
+    }
+
+    // PSNR of one component estimated from the quantization error over the padded plane,
+    // no decoder involved, 99 for a lossless component
+    double estimatedPsnr(int channel) const {
+        const double pixels = (double)paddedWidth() * paddedHeight() / (channel == 0 ? 1 : 4);
+        const double mse = (double)distortion[channel] / 256.0 / pixels;
+        return mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+    }
+
+    // MCU geometry, 16x16 for 4:2:0 and 8x8 for grayscale
+    int mcuSize() const {
+        return channels==1?8:16;
+    }
+
+    int paddedWidth() const {
+        return (width + mcuSize() - 1) / mcuSize() * mcuSize();
+    }
+
+    int paddedHeight() const {
+        return (height + mcuSize() - 1) / mcuSize() * mcuSize();
+    }
+
+    // Restart interval in MCUs as written to DRI
+    int64_t restartInterval() const {
+        return (int64_t)restart_rows * (paddedFrameWidth() / mcuSize());
+    }
+
+    int chromaWidth() const {
+        return (width + 1) >> 1;
+    }
+
+    int chromaHeight() const {
+        return (height + 1) >> 1;
+    }
+
+    // Offset of the 64 coefficient block covering (x, y) in a coefficient plane,
+    // blocks are stored contiguously in MCU order so a plane is written and
+    // entropy coded linearly, 4:2:0 luma keeps the four blocks of an MCU together
+    int64_t coeffBlockOffset(int channel, int x, int y) const {
+        if (channel == 0 && channels == 3) {
+            const int64_t mcu = (int64_t)(y >> 4) * (luma_stride >> 4) + (x >> 4);
+            return ((mcu << 2) + ((y >> 2) & 2) + ((x >> 3) & 1)) << 6;
+        }
+        const int64_t stride = channel == 0 ? luma_stride : chroma_stride;
+        return ((int64_t)(y >> 3) * (stride >> 3) + (x >> 3)) << 6;
+    }
+
+    // Allocate pixel and coefficient planes for "lines" padded luma lines,
+    // contexts that only quantize and entropy code can skip the pixel planes
+    bool allocPlanes(int64_t lines, bool pixels = true) {
+        freePlanes();
+
+        const int64_t luma_size = (int64_t)paddedWidth() * lines;
+        const int64_t chroma_size = luma_size >> 2;
+
+        luma_stride = paddedWidth();
+        chroma_stride = paddedWidth() >> 1;
+
+        if (pixels) {
+            fjpeg_y = (fjpeg_pixel_t*)malloc((size_t)luma_size * sizeof(fjpeg_pixel_t));
+            fjpeg_cb = (fjpeg_pixel_t*)malloc((size_t)chroma_size * sizeof(fjpeg_pixel_t));
+            fjpeg_cr = (fjpeg_pixel_t*)malloc((size_t)chroma_size * sizeof(fjpeg_pixel_t));
+            if (!fjpeg_y || !fjpeg_cb || !fjpeg_cr) {
+                return false;
+            }
+        }
+
+        fjpeg_ydct = (fjpeg_coeff_t*)malloc((size_t)luma_size * sizeof(fjpeg_coeff_t));
+        fjpeg_cbdct = (fjpeg_coeff_t*)malloc((size_t)chroma_size * sizeof(fjpeg_coeff_t));
+        fjpeg_crdct = (fjpeg_coeff_t*)malloc((size_t)chroma_size * sizeof(fjpeg_coeff_t));
+        if (!fjpeg_ydct || !fjpeg_cbdct || !fjpeg_crdct) {
+            return false;
+        }
+
+        plane_lines = lines;
+        return true;
+    }
+
+    // The planes can take a whole frame of the current size and channels, with or without the
+    // pixel planes, a streaming context holds only one MCU row and has to reallocate
+    bool planesFit(bool pixels) const {
+        return fjpeg_ydct && (fjpeg_y != nullptr) == pixels && luma_stride == paddedWidth() && plane_lines >= paddedHeight();
+    }
+
+    // Copy one input line into a padded plane row, replicating the last pixel to the right edge
+    static void storeLine(fjpeg_pixel_t* dst, const fjpeg_pixel_t* src, int64_t width, int64_t stride) {
+        memcpy(dst, src, (size_t)width);
+        for (int64_t i = width; i < stride; i++) {
+            dst[i] = src[width - 1];
+        }
+    }
+
     bool readInput(const char* filename, int width, int height) {
         input = fopen(filename, "rb");
         if (!input) {
             return false;
         }
 
+        return readFrame(input, width, height);
+    }
+
+    // Read the next planar I420 frame from fp, planes are allocated on first use and then reused
+    bool readFrame(FILE* fp, int width, int height) {
+        input_planes[0] = input_planes[1] = input_planes[2] = nullptr;
+        this->width = width;
+        this->height = height;
+        if (!planesFit(true) && !allocPlanes(paddedHeight())) {
+            return false;
+        }
+
+        // Read line by line into the padded planes and replicate the edges
+        std::vector<fjpeg_pixel_t> line((size_t)width);
+        for (int64_t y = 0; y < paddedHeight(); y++) {
+            if (y < height && fread(line.data(), 1, (size_t)width, fp) != (size_t)width) {
+                return false;
+            }
+            storeLine(fjpeg_y + y * luma_stride, line.data(), width, luma_stride);
+        }
+
+        fjpeg_pixel_t* chroma[2] = { fjpeg_cb, fjpeg_cr };
+        for (int c = 0; c < 2; c++) {
+            for (int64_t y = 0; y < paddedHeight() / 2; y++) {
+                if (y < chromaHeight() && fread(line.data(), 1, (size_t)chromaWidth(), fp) != (size_t)chromaWidth()) {
+                    return false;
+                }
+                storeLine(chroma[c] + y * chroma_stride, line.data(), chromaWidth(), chroma_stride);
+            }
+        }
+
+        return true;
+    }
+
+    // Load a packed planar I420 frame from memory
+    bool loadFrame(const fjpeg_pixel_t* y, const fjpeg_pixel_t* cb, const fjpeg_pixel_t* cr, int width, int height) {
+        input_planes[0] = input_planes[1] = input_planes[2] = nullptr;
         this->width = width;
         this->height = height;
+        if (!planesFit(true) && !allocPlanes(paddedHeight())) {
+            return false;
+        }
 
-        fjpeg_y = (fjpeg_pixel_t*)malloc(width * height * sizeof(fjpeg_pixel_t));
-        fjpeg_cb = (fjpeg_pixel_t*)malloc(width * height * sizeof(fjpeg_pixel_t));
-        fjpeg_cr = (fjpeg_pixel_t*)malloc(width * height * sizeof(fjpeg_pixel_t));
+        for (int64_t j = 0; j < paddedHeight(); j++) {
+            const int64_t src = FJPEG_MIN(j, (int64_t)height - 1);
+            storeLine(fjpeg_y + j * luma_stride, y + src * width, width, luma_stride);
+        }
 
-        fjpeg_ydct = (fjpeg_coeff_t*)malloc(width * height * sizeof(fjpeg_coeff_t));
-        fjpeg_cbdct = (fjpeg_coeff_t*)malloc(width * height * sizeof(fjpeg_coeff_t));
-        fjpeg_crdct = (fjpeg_coeff_t*)malloc(width * height * sizeof(fjpeg_coeff_t));
+        for (int64_t j = 0; j < paddedHeight() / 2; j++) {
+            const int64_t src = FJPEG_MIN(j, (int64_t)chromaHeight() - 1) * chromaWidth();
+            storeLine(fjpeg_cb + j * chroma_stride, cb + src, chromaWidth(), chroma_stride);
+            storeLine(fjpeg_cr + j * chroma_stride, cr + src, chromaWidth(), chroma_stride);
+        }
+
+        return true;
+    }
+
+    // Encode the crop_width x crop_height region at (crop_x, crop_y) of caller owned planes with
+    // any pitch, nothing is copied so the planes must stay valid until the transform is done,
+    // cb and cr are ignored for grayscale and the crop origin must be even for 4:2:0
+    bool setInputPlanes(const fjpeg_pixel_t* y, int64_t y_stride, const fjpeg_pixel_t* cb, const fjpeg_pixel_t* cr, int64_t c_stride,
+                        int crop_x, int crop_y, int crop_width, int crop_height) {
+        if (crop_x < 0 || crop_y < 0 || crop_width < 1 || crop_height < 1 ||
+            (channels == 3 && ((crop_x | crop_y) & 1))) {
+            return false;
+        }
+        this->width = crop_width;
+        this->height = crop_height;
 
-        fread(fjpeg_y, 1, width * height, input);
-        fread(fjpeg_cb, 1, (width * height) >> 2, input);
-        fread(fjpeg_cr, 1, (width * height) >> 2, input);
+        // Only coefficient planes, the pixels stay with the caller
+        if (!planesFit(false) && !allocPlanes(paddedHeight(), false)) {
+            return false;
+        }
 
+        input_planes[0] = y + (int64_t)crop_y * y_stride + crop_x;
+        input_strides[0] = y_stride;
+        if (channels == 3) {
+            input_planes[1] = cb + (int64_t)(crop_y >> 1) * c_stride + (crop_x >> 1);
+            input_planes[2] = cr + (int64_t)(crop_y >> 1) * c_stride + (crop_x >> 1);
+            input_strides[1] = input_strides[2] = c_stride;
+        }
         return true;
     }
 
+    // Size in bytes of a packed I420 frame
+    static int64_t frameSize(int width, int height) {
+        return (int64_t)width * height + 2 * (int64_t)((width + 1) >> 1) * ((height + 1) >> 1);
+    }
+
+    void freePlanes() {
+        free(fjpeg_y);
+        free(fjpeg_cb);
+        free(fjpeg_cr);
+        free(fjpeg_ydct);
+        free(fjpeg_cbdct);
+        free(fjpeg_crdct);
+        fjpeg_y = nullptr;
+        fjpeg_cb = nullptr;
+        fjpeg_cr = nullptr;
+        fjpeg_ydct = nullptr;
+        fjpeg_cbdct = nullptr;
+        fjpeg_crdct = nullptr;
+        plane_lines = 0;
+    }
+
     ~fjpeg_context() {
         if (input) {
             fclose(input);
@@ -211,3 +545,18 @@ static const char *fjpeg_version() {
 
 void fjpeg_print_usage();
 bool fjpeg_generate_header(fjpeg_bitstream* stream, fjpeg_context* context);
+bool fjpeg_write_headers(fjpeg_bitstream* stream, fjpeg_context* context);
+bool fjpeg_write_tables(fjpeg_bitstream* stream, fjpeg_context* context);
+void fjpeg_entropy_begin(fjpeg_bitstream* stream, fjpeg_context* context);
+void fjpeg_entropy_close_segment(fjpeg_bitstream* stream, fjpeg_context* context);
+void fjpeg_entropy_restart(fjpeg_bitstream* stream, fjpeg_context* context, int64_t interval);
+void fjpeg_entropy_row_begin(fjpeg_bitstream* stream, fjpeg_context* context, int64_t row);
+void fjpeg_entropy_row_end(fjpeg_bitstream* stream, fjpeg_context* context, int64_t row);
+bool fjpeg_write_trailer(fjpeg_bitstream* stream, fjpeg_context* context);
+bool fjpeg_encode_frame(fjpeg_bitstream* stream, fjpeg_context* context);
+bool fjpeg_encode_ladder(fjpeg_context* context, const int* qualities, int count, fjpeg_output_sink** sinks);
+
+// Row-push streaming, memory stays at one MCU row of planes regardless of the height
+bool fjpeg_stream_begin(fjpeg_bitstream* stream, fjpeg_context* context, int width, int height);
+bool fjpeg_stream_push(fjpeg_bitstream* stream, fjpeg_context* context, const fjpeg_pixel_t* y, const fjpeg_pixel_t* cb, const fjpeg_pixel_t* cr, int lines);
+bool fjpeg_stream_end(fjpeg_bitstream* stream, fjpeg_context* context);
@@ -0,0 +1,346 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_arith.h"
+
+// Probability estimation state machine, T.81 Table D.2
+typedef struct {
+    uint16_t qe;
+    uint8_t next_lps;
+    uint8_t next_mps;
+    uint8_t switch_mps;
+} fjpeg_arith_qe_t;
+
+static const fjpeg_arith_qe_t fjpeg_arith_qe_table[114] = {
+    { 0x5a1d,   1,   1, 1 }, { 0x2586,  14,   2, 0 }, { 0x1114,  16,   3, 0 }, { 0x080b,  18,   4, 0 },
+    { 0x03d8,  20,   5, 0 }, { 0x01da,  23,   6, 0 }, { 0x00e5,  25,   7, 0 }, { 0x006f,  28,   8, 0 },
+    { 0x0036,  30,   9, 0 }, { 0x001a,  33,  10, 0 }, { 0x000d,  35,  11, 0 }, { 0x0006,   9,  12, 0 },
+    { 0x0003,  10,  13, 0 }, { 0x0001,  12,  13, 0 }, { 0x5a7f,  15,  15, 1 }, { 0x3f25,  36,  16, 0 },
+    { 0x2cf2,  38,  17, 0 }, { 0x207c,  39,  18, 0 }, { 0x17b9,  40,  19, 0 }, { 0x1182,  42,  20, 0 },
+    { 0x0cef,  43,  21, 0 }, { 0x09a1,  45,  22, 0 }, { 0x072f,  46,  23, 0 }, { 0x055c,  48,  24, 0 },
+    { 0x0406,  49,  25, 0 }, { 0x0303,  51,  26, 0 }, { 0x0240,  52,  27, 0 }, { 0x01b1,  54,  28, 0 },
+    { 0x0144,  56,  29, 0 }, { 0x00f5,  57,  30, 0 }, { 0x00b7,  59,  31, 0 }, { 0x008a,  60,  32, 0 },
+    { 0x0068,  62,  33, 0 }, { 0x004e,  63,  34, 0 }, { 0x003b,  32,  35, 0 }, { 0x002c,  33,   9, 0 },
+    { 0x5ae1,  37,  37, 1 }, { 0x484c,  64,  38, 0 }, { 0x3a0d,  65,  39, 0 }, { 0x2ef1,  67,  40, 0 },
+    { 0x261f,  68,  41, 0 }, { 0x1f33,  69,  42, 0 }, { 0x19a8,  70,  43, 0 }, { 0x1518,  72,  44, 0 },
+    { 0x1177,  73,  45, 0 }, { 0x0e74,  74,  46, 0 }, { 0x0bfb,  75,  47, 0 }, { 0x09f8,  77,  48, 0 },
+    { 0x0861,  78,  49, 0 }, { 0x0706,  79,  50, 0 }, { 0x05cd,  48,  51, 0 }, { 0x04de,  50,  52, 0 },
+    { 0x040f,  50,  53, 0 }, { 0x0363,  51,  54, 0 }, { 0x02d4,  52,  55, 0 }, { 0x025c,  53,  56, 0 },
+    { 0x01f8,  54,  57, 0 }, { 0x01a4,  55,  58, 0 }, { 0x0160,  56,  59, 0 }, { 0x0125,  57,  60, 0 },
+    { 0x00f6,  58,  61, 0 }, { 0x00cb,  59,  62, 0 }, { 0x00ab,  61,  63, 0 }, { 0x008f,  61,  32, 0 },
+    { 0x5b12,  65,  65, 1 }, { 0x4d04,  80,  66, 0 }, { 0x412c,  81,  67, 0 }, { 0x37d8,  82,  68, 0 },
+    { 0x2fe8,  83,  69, 0 }, { 0x293c,  84,  70, 0 }, { 0x2379,  86,  71, 0 }, { 0x1edf,  87,  72, 0 },
+    { 0x1aa9,  87,  73, 0 }, { 0x174e,  72,  74, 0 }, { 0x1424,  72,  75, 0 }, { 0x119c,  74,  76, 0 },
+    { 0x0f6b,  74,  77, 0 }, { 0x0d51,  75,  78, 0 }, { 0x0bb6,  77,  79, 0 }, { 0x0a40,  77,  48, 0 },
+    { 0x5832,  80,  81, 1 }, { 0x4d1c,  88,  82, 0 }, { 0x438e,  89,  83, 0 }, { 0x3bdd,  90,  84, 0 },
+    { 0x34ee,  91,  85, 0 }, { 0x2eae,  92,  86, 0 }, { 0x299a,  93,  87, 0 }, { 0x2516,  86,  71, 0 },
+    { 0x5570,  88,  89, 1 }, { 0x4ca9,  95,  90, 0 }, { 0x44d9,  96,  91, 0 }, { 0x3e22,  97,  92, 0 },
+    { 0x3824,  99,  93, 0 }, { 0x32b4,  99,  94, 0 }, { 0x2e17,  93,  86, 0 }, { 0x56a8,  95,  96, 1 },
+    { 0x4f46, 101,  97, 0 }, { 0x47e5, 102,  98, 0 }, { 0x41cf, 103,  99, 0 }, { 0x3c3d, 104, 100, 0 },
+    { 0x375e,  99,  93, 0 }, { 0x5231, 105, 102, 0 }, { 0x4c0f, 106, 103, 0 }, { 0x4639, 107, 104, 0 },
+    { 0x415e, 103,  99, 0 }, { 0x5627, 105, 106, 1 }, { 0x50e7, 108, 107, 0 }, { 0x4b85, 109, 103, 0 },
+    { 0x5597, 110, 109, 0 }, { 0x504f, 111, 107, 0 }, { 0x5a10, 110, 111, 1 }, { 0x5522, 112, 109, 0 },
+    { 0x59eb, 112, 111, 1 },
+    { 0x5a1d, 113, 113, 0 }  // Fixed probability 0.5 for the AC sign
+};
+
+// Statistics bins hold the state index in the low 7 bits and the MPS in bit 7
+#define FJPEG_ARITH_FIXED_BIN 113
+
+void fjpeg_arith_start(fjpeg_arith_state_t* state) {
+    state->a = 0x10000;
+    state->c = 0;
+    state->ct = 11;
+    state->buffer = -1;
+    state->sc = 0;
+    state->zc = 0;
+    memset(state->dc_context, 0, sizeof(state->dc_context));
+    memset(state->dc_stats, 0, sizeof(state->dc_stats));
+    memset(state->ac_stats, 0, sizeof(state->ac_stats));
+    state->fixed_bin = FJPEG_ARITH_FIXED_BIN;
+}
+
+// The coder does its own 0xFF stuffing, so bytes bypass the bitstream stuffing
+static inline void fjpeg_arith_emit(fjpeg_bitstream* stream, int value) {
+    stream->writeRawByte((uint8_t)value);
+}
+
+static inline void fjpeg_arith_emit_zeros(fjpeg_bitstream* stream, fjpeg_arith_state_t* state) {
+    for (; state->zc > 0; state->zc--) {
+        fjpeg_arith_emit(stream, 0x00);
+    }
+}
+
+// Output the buffered byte plus the stacked 0xFF bytes, with or without a carry into them
+static void fjpeg_arith_output(fjpeg_bitstream* stream, fjpeg_arith_state_t* state, bool carry) {
+    if (carry) {
+        if (state->buffer >= 0) {
+            fjpeg_arith_emit_zeros(stream, state);
+            fjpeg_arith_emit(stream, state->buffer + 1);
+            if (state->buffer + 1 == 0xFF) {
+                fjpeg_arith_emit(stream, 0x00);
+            }
+        }
+        // The carry turns the stacked 0xFF bytes into 0x00
+        state->zc += state->sc;
+        state->sc = 0;
+        return;
+    }
+
+    // Zero bytes are held back so trailing ones can be dropped at the end
+    if (state->buffer == 0) {
+        state->zc++;
+    } else if (state->buffer >= 0) {
+        fjpeg_arith_emit_zeros(stream, state);
+        fjpeg_arith_emit(stream, state->buffer);
+    }
+    if (state->sc) {
+        fjpeg_arith_emit_zeros(stream, state);
+        for (; state->sc > 0; state->sc--) {
+            fjpeg_arith_emit(stream, 0xFF);
+            fjpeg_arith_emit(stream, 0x00);
+        }
+    }
+}
+
+// Encode one binary decision with the adaptive estimate in *st, T.81 D.1.4 to D.1.6
+static void fjpeg_arith_encode(fjpeg_bitstream* stream, fjpeg_arith_state_t* state, uint8_t* st, int value) {
+    const int sv = *st;
+    const fjpeg_arith_qe_t& entry = fjpeg_arith_qe_table[sv & 0x7F];
+    const int32_t qe = entry.qe;
+
+    state->a -= qe;
+    if (value != (sv >> 7)) {
+        // Less probable symbol, the intervals are exchanged when the MPS one got smaller
+        if (state->a >= qe) {
+            state->c += state->a;
+            state->a = qe;
+        }
+        *st = (uint8_t)((sv & 0x80) ^ (entry.switch_mps << 7) ^ entry.next_lps);
+    } else {
+        if (state->a >= 0x8000) {
+            return;
+        }
+        if (state->a < qe) {
+            state->c += state->a;
+            state->a = qe;
+        }
+        *st = (uint8_t)((sv & 0x80) ^ entry.next_mps);
+    }
+
+    // Renormalize and output a byte every 8 shifts
+    do {
+        state->a <<= 1;
+        state->c <<= 1;
+        if (--state->ct == 0) {
+            const int32_t temp = state->c >> 19;
+            if (temp > 0xFF) {
+                fjpeg_arith_output(stream, state, true);
+                state->buffer = temp & 0xFF;
+            } else if (temp == 0xFF) {
+                state->sc++;
+            } else {
+                fjpeg_arith_output(stream, state, false);
+                state->buffer = temp;
+            }
+            state->c &= 0x7FFFF;
+            state->ct += 8;
+        }
+    } while (state->a < 0x8000);
+}
+
+// Magnitude category m is terminated at st, the bits below the leading one follow at st + 14,
+// T.81 Figures F.8 and F.9
+static inline void fjpeg_arith_encode_bits(fjpeg_bitstream* stream, fjpeg_arith_state_t* state, uint8_t* st, int m, int v) {
+    fjpeg_arith_encode(stream, state, st, 0);
+    st += 14;
+    while (m >>= 1) {
+        fjpeg_arith_encode(stream, state, st, (m & v) ? 1 : 0);
+    }
+}
+
+// Arithmetic counterpart of fjpeg_entropy_encode_block, block is quantized and zigzagged
+template <int TABLE>
+static inline int fjpeg_arith_encode_block_t(fjpeg_bitstream* stream, fjpeg_arith_state_t* state, const fjpeg_coeff_t* block, int component, int last_dc) {
+    // DC difference, T.81 F.1.4.1 with the conditioning of F.1.4.4.1
+    const int coeff = (int)(block[0]+0.5f);
+    int v = coeff - last_dc;
+    uint8_t* st = state->dc_stats[TABLE] + state->dc_context[component];
+
+    if (v == 0) {
+        fjpeg_arith_encode(stream, state, st, 0);
+        state->dc_context[component] = 0;
+    } else {
+        fjpeg_arith_encode(stream, state, st, 1);
+        if (v > 0) {
+            fjpeg_arith_encode(stream, state, st + 1, 0);
+            st += 2;
+            state->dc_context[component] = 4;
+        } else {
+            v = -v;
+            fjpeg_arith_encode(stream, state, st + 1, 1);
+            st += 3;
+            state->dc_context[component] = 8;
+        }
+
+        int m = 0;
+        if (v -= 1) {
+            fjpeg_arith_encode(stream, state, st, 1);
+            m = 1;
+            int v2 = v;
+            st = state->dc_stats[TABLE] + 20;
+            while (v2 >>= 1) {
+                fjpeg_arith_encode(stream, state, st, 1);
+                m <<= 1;
+                st++;
+            }
+        }
+
+        if (m < ((1 << FJPEG_ARITH_DC_L) >> 1)) {
+            state->dc_context[component] = 0;
+        } else if (m > ((1 << FJPEG_ARITH_DC_U) >> 1)) {
+            state->dc_context[component] += 8;
+        }
+        fjpeg_arith_encode_bits(stream, state, st, m, v);
+    }
+
+    // AC coefficients, T.81 F.1.4.2
+    int end = 0;
+    for (int k = 63; k > 0; k--) {
+        if ((int)(block[k]+0.5f) != 0) {
+            end = k;
+            break;
+        }
+    }
+
+    int k;
+    for (k = 1; k <= end; k++) {
+        st = state->ac_stats[TABLE] + 3 * (k - 1);
+        fjpeg_arith_encode(stream, state, st, 0);  // Not the end of block
+        while ((v = (int)(block[k]+0.5f)) == 0) {
+            fjpeg_arith_encode(stream, state, st + 1, 0);
+            st += 3;
+            k++;
+        }
+        fjpeg_arith_encode(stream, state, st + 1, 1);
+
+        if (v > 0) {
+            fjpeg_arith_encode(stream, state, &state->fixed_bin, 0);
+        } else {
+            v = -v;
+            fjpeg_arith_encode(stream, state, &state->fixed_bin, 1);
+        }
+        st += 2;
+
+        int m = 0;
+        if (v -= 1) {
+            fjpeg_arith_encode(stream, state, st, 1);
+            m = 1;
+            int v2 = v;
+            if (v2 >>= 1) {
+                fjpeg_arith_encode(stream, state, st, 1);
+                m <<= 1;
+                st = state->ac_stats[TABLE] + (k <= FJPEG_ARITH_AC_K ? 189 : 217);
+                while (v2 >>= 1) {
+                    fjpeg_arith_encode(stream, state, st, 1);
+                    m <<= 1;
+                    st++;
+                }
+            }
+        }
+        fjpeg_arith_encode_bits(stream, state, st, m, v);
+    }
+
+    if (k <= 63) {
+        fjpeg_arith_encode(stream, state, state->ac_stats[TABLE] + 3 * (k - 1), 1);  // End of block
+    }
+
+    return coeff;
+}
+
+template <int CHANNELS>
+static void fjpeg_arith_encode_mcu_row_t(fjpeg_bitstream* stream, fjpeg_context* context, int y) {
+    fjpeg_arith_state_t* state = &context->arith_state;
+    int* last_dc_coeff = context->last_dc_coeff;
+    const int inc_xy = CHANNELS==1?8:16;
+    const int max_uv = CHANNELS==1?1:2;
+    const int width = context->paddedFrameWidth();
+    fjpeg_coeff_t tmp[64];
+
+    for(int x = 0; x < width; x+=inc_xy) {
+        for(int v = 0; v < max_uv; v++) {
+            for(int u = 0; u < max_uv; u++) {
+                last_dc_coeff[0] = fjpeg_arith_encode_block_t<0>(stream, state, fjpeg_oriented_block_t<0>(context, x+u*8, y+v*8, tmp), 0, last_dc_coeff[0]);
+            }
+        }
+
+        if(CHANNELS==3) {
+            last_dc_coeff[1] = fjpeg_arith_encode_block_t<1>(stream, state, fjpeg_oriented_block_t<1>(context, x>>1, y>>1, tmp), 1, last_dc_coeff[1]);
+            last_dc_coeff[2] = fjpeg_arith_encode_block_t<1>(stream, state, fjpeg_oriented_block_t<2>(context, x>>1, y>>1, tmp), 2, last_dc_coeff[2]);
+        }
+    }
+}
+
+void fjpeg_arith_encode_mcu_row(fjpeg_bitstream* stream, fjpeg_context* context, int y) {
+    if(context->channels == 1) fjpeg_arith_encode_mcu_row_t<1>(stream, context, y);
+    else fjpeg_arith_encode_mcu_row_t<3>(stream, context, y);
+}
+
+// Flush the code register, T.81 D.1.8, trailing zero bytes are dropped
+void fjpeg_arith_finish(fjpeg_bitstream* stream, fjpeg_arith_state_t* state) {
+    // Pick the value in the final interval with the most trailing zero bits
+    int32_t temp = (state->a - 1 + state->c) & 0xFFFF0000;
+    if (temp < state->c) {
+        state->c = temp + 0x8000;
+    } else {
+        state->c = temp;
+    }
+
+    state->c <<= state->ct;
+    fjpeg_arith_output(stream, state, (state->c & 0xF8000000) != 0);
+
+    if (state->c & 0x7FFF800) {
+        fjpeg_arith_emit_zeros(stream, state);
+        fjpeg_arith_emit(stream, (state->c >> 19) & 0xFF);
+        if (((state->c >> 19) & 0xFF) == 0xFF) {
+            fjpeg_arith_emit(stream, 0x00);
+        }
+        if (state->c & 0x7F800) {
+            fjpeg_arith_emit(stream, (state->c >> 11) & 0xFF);
+            if (((state->c >> 11) & 0xFF) == 0xFF) {
+                fjpeg_arith_emit(stream, 0x00);
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+
+#include "fjpeg_global.h"
+
+class fjpeg_context;
+class fjpeg_bitstream;
+
+// QM coder register and statistics state for one scan, ITU T.81 Annex D and F.1.4
+struct fjpeg_arith_state_t {
+    int32_t a;
+    int32_t c;
+    int32_t ct;
+    int32_t buffer;  // Byte waiting for a possible carry, -1 before the first one
+    int32_t sc;      // Stacked 0xFF bytes
+    int32_t zc;      // Pending 0x00 bytes
+    int dc_context[3];
+    uint8_t dc_stats[2][64];
+    uint8_t ac_stats[2][256];
+    uint8_t fixed_bin;
+};
+
+// Conditioning parameters written to DAC, these are the T.81 defaults
+#define FJPEG_ARITH_DC_L 0
+#define FJPEG_ARITH_DC_U 1
+#define FJPEG_ARITH_AC_K 5
+
+void fjpeg_arith_start(fjpeg_arith_state_t* state);
+void fjpeg_arith_encode_mcu_row(fjpeg_bitstream* stream, fjpeg_context* context, int y);
+void fjpeg_arith_finish(fjpeg_bitstream* stream, fjpeg_arith_state_t* state);
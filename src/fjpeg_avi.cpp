@@ -0,0 +1,312 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "fjpeg_global.h"
+#include "fjpeg_avi.h"
+
+// Little-endian field writers for the RIFF structures
+static void fjpeg_avi_put16(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(value & 0xff);
+    out.push_back((value >> 8) & 0xff);
+}
+
+static void fjpeg_avi_put32(std::vector<uint8_t>& out, uint32_t value) {
+    fjpeg_avi_put16(out, value & 0xffff);
+    fjpeg_avi_put16(out, value >> 16);
+}
+
+static void fjpeg_avi_put64(std::vector<uint8_t>& out, uint64_t value) {
+    fjpeg_avi_put32(out, (uint32_t)value);
+    fjpeg_avi_put32(out, (uint32_t)(value >> 32));
+}
+
+static void fjpeg_avi_fourcc(std::vector<uint8_t>& out, const char* fourcc) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back((uint8_t)fourcc[i]);
+    }
+}
+
+static void fjpeg_avi_chunk(std::vector<uint8_t>& out, const char* fourcc, uint32_t size) {
+    fjpeg_avi_fourcc(out, fourcc);
+    fjpeg_avi_put32(out, size);
+}
+
+// hdrl list and the start of the first movi list, written with placeholders on open
+// and again with the final counts on close, the size never changes
+void fjpeg_avi_writer::header(std::vector<uint8_t>& out) {
+    const uint32_t super_size = 24 + 16 * FJPEG_AVI_MAX_SEGMENTS;
+    const uint32_t strl_size = 4 + (8 + 56) + (8 + 40) + (8 + super_size);
+    const uint32_t hdrl_size = 4 + (8 + 56) + (8 + strl_size) + (8 + 4 + 8 + 248);
+    const uint32_t frame_us = (uint32_t)((int64_t)1000000 * fps_den / fps_num);
+    const uint32_t bytes_per_second = (uint32_t)FJPEG_MIN((int64_t)max_frame_size * fps_num / fps_den, (int64_t)0xffffffff);
+
+    out.clear();
+    fjpeg_avi_chunk(out, "RIFF", first_riff_size);
+    fjpeg_avi_fourcc(out, "AVI ");
+
+    fjpeg_avi_chunk(out, "LIST", hdrl_size);
+    fjpeg_avi_fourcc(out, "hdrl");
+
+    fjpeg_avi_chunk(out, "avih", 56);
+    fjpeg_avi_put32(out, frame_us);
+    fjpeg_avi_put32(out, bytes_per_second);
+    fjpeg_avi_put32(out, 0); // Padding granularity
+    fjpeg_avi_put32(out, 0x10); // AVIF_HASINDEX
+    fjpeg_avi_put32(out, (uint32_t)first_riff_frames);
+    fjpeg_avi_put32(out, 0); // Initial frames
+    fjpeg_avi_put32(out, 1); // Streams
+    fjpeg_avi_put32(out, max_frame_size);
+    fjpeg_avi_put32(out, width);
+    fjpeg_avi_put32(out, height);
+    for (int i = 0; i < 4; i++) {
+        fjpeg_avi_put32(out, 0);
+    }
+
+    fjpeg_avi_chunk(out, "LIST", strl_size);
+    fjpeg_avi_fourcc(out, "strl");
+
+    fjpeg_avi_chunk(out, "strh", 56);
+    fjpeg_avi_fourcc(out, "vids");
+    fjpeg_avi_fourcc(out, "MJPG");
+    fjpeg_avi_put32(out, 0); // Flags
+    fjpeg_avi_put16(out, 0); // Priority
+    fjpeg_avi_put16(out, 0); // Language
+    fjpeg_avi_put32(out, 0); // Initial frames
+    fjpeg_avi_put32(out, fps_den); // Scale
+    fjpeg_avi_put32(out, fps_num); // Rate
+    fjpeg_avi_put32(out, 0); // Start
+    fjpeg_avi_put32(out, (uint32_t)frames); // Length
+    fjpeg_avi_put32(out, max_frame_size);
+    fjpeg_avi_put32(out, 0xffffffff); // Quality
+    fjpeg_avi_put32(out, 0); // Sample size
+    fjpeg_avi_put16(out, 0);
+    fjpeg_avi_put16(out, 0);
+    fjpeg_avi_put16(out, width);
+    fjpeg_avi_put16(out, height);
+
+    // BITMAPINFOHEADER
+    fjpeg_avi_chunk(out, "strf", 40);
+    fjpeg_avi_put32(out, 40);
+    fjpeg_avi_put32(out, width);
+    fjpeg_avi_put32(out, height);
+    fjpeg_avi_put16(out, 1); // Planes
+    fjpeg_avi_put16(out, 24); // Bit count
+    fjpeg_avi_fourcc(out, "MJPG");
+    fjpeg_avi_put32(out, (uint32_t)width * height * 3);
+    for (int i = 0; i < 4; i++) {
+        fjpeg_avi_put32(out, 0);
+    }
+
+    // OpenDML super index, one entry per ix00 chunk
+    fjpeg_avi_chunk(out, "indx", super_size);
+    fjpeg_avi_put16(out, 4); // Longs per entry
+    out.push_back(0); // Sub type
+    out.push_back(0); // AVI_INDEX_OF_INDEXES
+    fjpeg_avi_put32(out, (uint32_t)super_index.size());
+    fjpeg_avi_fourcc(out, "00dc");
+    for (int i = 0; i < 3; i++) {
+        fjpeg_avi_put32(out, 0);
+    }
+    for (int i = 0; i < FJPEG_AVI_MAX_SEGMENTS; i++) {
+        const bool used = i < (int)super_index.size();
+        fjpeg_avi_put64(out, used ? super_index[i].offset : 0);
+        fjpeg_avi_put32(out, used ? super_index[i].size + 8 : 0);
+        fjpeg_avi_put32(out, used ? (uint32_t)super_duration[i] : 0);
+    }
+
+    fjpeg_avi_chunk(out, "LIST", 4 + 8 + 248);
+    fjpeg_avi_fourcc(out, "odml");
+    fjpeg_avi_chunk(out, "dmlh", 248);
+    fjpeg_avi_put32(out, (uint32_t)frames);
+    out.resize(out.size() + 244, 0);
+
+    fjpeg_avi_chunk(out, "LIST", first_movi_size);
+    fjpeg_avi_fourcc(out, "movi");
+}
+
+bool fjpeg_avi_writer::write(const std::vector<uint8_t>& data) {
+    if (!failed && fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+        failed = true;
+    }
+    position += (int64_t)data.size();
+    return !failed;
+}
+
+bool fjpeg_avi_writer::open(const char* filename, int width, int height, int fps_num, int fps_den) {
+    if (width < 1 || height < 1 || fps_num < 1 || fps_den < 1) {
+        return false;
+    }
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Unable to open output file %s\n", filename);
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    this->fps_num = fps_num;
+    this->fps_den = fps_den;
+
+    std::vector<uint8_t> out;
+    header(out);
+    riff_start = 0;
+    movi_start = (int64_t)out.size() - 12;
+    return write(out);
+}
+
+// The frame goes out as a 00dc chunk right away, only its position is kept for the indexes
+bool fjpeg_avi_writer::writeFrame(const uint8_t* data, size_t size) {
+    if (!fp || failed || size > 0x7fffffff) {
+        return false;
+    }
+
+    // Leave room for this segment's ix00 and idx1 before the RIFF size limit
+    const int64_t index_room = 32 + 8 * ((int64_t)segment_index.size() + 1) + (super_index.empty() ? 8 + 16 * ((int64_t)first_index.size() + 1) : 0);
+    if (!segment_index.empty() && position + 8 + (int64_t)size + 1 + index_room - riff_start > FJPEG_AVI_RIFF_LIMIT) {
+        if ((int)super_index.size() + 1 >= FJPEG_AVI_MAX_SEGMENTS) {
+            fprintf(stderr, "Error: AVI output exceeds %d segments\n", FJPEG_AVI_MAX_SEGMENTS);
+            failed = true;
+            return false;
+        }
+        if (!finishSegment() || !startSegment()) {
+            return false;
+        }
+    }
+
+    fjpeg_avi_chunk_t chunk = { position, (uint32_t)size };
+    std::vector<uint8_t> head;
+    fjpeg_avi_chunk(head, "00dc", (uint32_t)size);
+    write(head);
+    if (!failed && fwrite(data, 1, size, fp) != size) {
+        failed = true;
+    }
+    position += (int64_t)size;
+    if (size & 1) {
+        write(std::vector<uint8_t>(1, 0));
+    }
+
+    segment_index.push_back(chunk);
+    if (super_index.empty()) {
+        first_index.push_back(chunk);
+    }
+    max_frame_size = FJPEG_MAX(max_frame_size, (uint32_t)size);
+    frames++;
+    return !failed;
+}
+
+// Close the current movi list with its ix00 chunk, the first RIFF also gets idx1
+bool fjpeg_avi_writer::finishSegment() {
+    std::vector<uint8_t> out;
+    const int64_t base = movi_start;
+
+    fjpeg_avi_chunk_t ix = { position, (uint32_t)(24 + 8 * segment_index.size()) };
+    fjpeg_avi_chunk(out, "ix00", ix.size);
+    fjpeg_avi_put16(out, 2); // Longs per entry
+    out.push_back(0); // Sub type
+    out.push_back(1); // AVI_INDEX_OF_CHUNKS
+    fjpeg_avi_put32(out, (uint32_t)segment_index.size());
+    fjpeg_avi_fourcc(out, "00dc");
+    fjpeg_avi_put64(out, (uint64_t)base);
+    fjpeg_avi_put32(out, 0);
+    for (size_t i = 0; i < segment_index.size(); i++) {
+        // Offsets point at the data, every MJPEG frame is a key frame
+        fjpeg_avi_put32(out, (uint32_t)(segment_index[i].offset + 8 - base));
+        fjpeg_avi_put32(out, segment_index[i].size);
+    }
+    write(out);
+
+    super_index.push_back(ix);
+    super_duration.push_back((int64_t)segment_index.size());
+    segment_index.clear();
+
+    const uint32_t movi_size = (uint32_t)(position - movi_start - 8);
+
+    if (super_index.size() == 1) {
+        // Legacy index, offsets are relative to the movi fourcc
+        out.clear();
+        fjpeg_avi_chunk(out, "idx1", (uint32_t)(16 * first_index.size()));
+        for (size_t i = 0; i < first_index.size(); i++) {
+            fjpeg_avi_fourcc(out, "00dc");
+            fjpeg_avi_put32(out, 0x10); // AVIIF_KEYFRAME
+            fjpeg_avi_put32(out, (uint32_t)(first_index[i].offset - (movi_start + 8)));
+            fjpeg_avi_put32(out, first_index[i].size);
+        }
+        write(out);
+        first_riff_frames = (int64_t)first_index.size();
+        first_riff_size = (uint32_t)(position - 8);
+        first_movi_size = movi_size;
+        return !failed;
+    }
+
+    // AVIX sizes are patched in place, the first RIFF header is rewritten on close
+    std::vector<uint8_t> size;
+    fjpeg_avi_put32(size, (uint32_t)(position - riff_start - 8));
+    FJPEG_FSEEK(fp, riff_start + 4, SEEK_SET);
+    fwrite(size.data(), 1, 4, fp);
+    size.clear();
+    fjpeg_avi_put32(size, movi_size);
+    FJPEG_FSEEK(fp, movi_start + 4, SEEK_SET);
+    fwrite(size.data(), 1, 4, fp);
+    if (FJPEG_FSEEK(fp, position, SEEK_SET) != 0) {
+        failed = true;
+    }
+    return !failed;
+}
+
+bool fjpeg_avi_writer::startSegment() {
+    std::vector<uint8_t> out;
+    riff_start = position;
+    fjpeg_avi_chunk(out, "RIFF", 0);
+    fjpeg_avi_fourcc(out, "AVIX");
+    movi_start = position + (int64_t)out.size();
+    fjpeg_avi_chunk(out, "LIST", 0);
+    fjpeg_avi_fourcc(out, "movi");
+    return write(out);
+}
+
+bool fjpeg_avi_writer::close() {
+    if (!fp) {
+        return false;
+    }
+
+    finishSegment();
+
+    std::vector<uint8_t> out;
+    header(out);
+    if (FJPEG_FSEEK(fp, 0, SEEK_SET) != 0 || fwrite(out.data(), 1, out.size(), fp) != out.size()) {
+        failed = true;
+    }
+    if (fclose(fp) != 0) {
+        failed = true;
+    }
+    fp = nullptr;
+    return !failed;
+}
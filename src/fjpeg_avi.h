@@ -0,0 +1,85 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+// RIFF segments are closed before they reach this size, later ones are OpenDML AVIX segments
+#ifndef FJPEG_AVI_RIFF_LIMIT
+#define FJPEG_AVI_RIFF_LIMIT ((int64_t)1 << 30)
+#endif
+// Room for this many segment entries in the OpenDML super index
+#define FJPEG_AVI_MAX_SEGMENTS 256
+
+struct fjpeg_avi_chunk_t {
+    int64_t offset;  // Absolute file position of the chunk header
+    uint32_t size;   // Payload size without header and padding
+};
+
+// Motion JPEG AVI writer, frames are appended to the movi list as they arrive and
+// the idx1 and OpenDML (indx / ix00) indexes are built along the way
+class fjpeg_avi_writer {
+    public:
+    FILE* fp;
+    int width;
+    int height;
+    int fps_num;
+    int fps_den;
+    int64_t position;
+    int64_t riff_start;
+    int64_t movi_start;
+    int64_t frames;
+    int64_t first_riff_frames;
+    uint32_t first_riff_size;
+    uint32_t first_movi_size;
+    uint32_t max_frame_size;
+    bool failed;
+
+    std::vector<fjpeg_avi_chunk_t> first_index;
+    std::vector<fjpeg_avi_chunk_t> segment_index;
+    std::vector<fjpeg_avi_chunk_t> super_index;
+    std::vector<int64_t> super_duration;
+
+    fjpeg_avi_writer() : fp(nullptr), width(0), height(0), fps_num(25), fps_den(1), position(0), riff_start(0), movi_start(0),
+        frames(0), first_riff_frames(0), first_riff_size(0), first_movi_size(0), max_frame_size(0), failed(false) {}
+    ~fjpeg_avi_writer() {
+        if (fp) {
+            fclose(fp);
+        }
+    }
+
+    bool open(const char* filename, int width, int height, int fps_num, int fps_den);
+    bool writeFrame(const uint8_t* data, size_t size);
+    bool close();
+
+    void header(std::vector<uint8_t>& out);
+    bool write(const std::vector<uint8_t>& data);
+    bool finishSegment();
+    bool startSegment();
+};
@@ -0,0 +1,296 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_thread.h"
+#include "fjpeg_batch.h"
+
+// Bands of one frame that are not finished yet, the owner sleeps until they are
+struct fjpeg_batch_frame_t {
+    std::mutex mutex;
+    std::condition_variable done;
+    int remaining;
+};
+
+// A whole file, or one band of MCU rows of a file another worker is encoding
+struct fjpeg_batch_task_t {
+    int job;
+    fjpeg_context* context;
+    int y_start;
+    int y_end;
+    fjpeg_batch_frame_t* frame;
+};
+
+// Idle workers sleep here, woken when tasks are pushed or the last file is done
+struct fjpeg_batch_signal_t {
+    std::mutex mutex;
+    std::condition_variable wake;
+    uint64_t pushed;
+};
+
+static void fjpeg_batch_notify(fjpeg_batch_signal_t* signal) {
+    std::lock_guard<std::mutex> lock(signal->mutex);
+    signal->pushed++;
+    signal->wake.notify_all();
+}
+
+typedef fjpeg_steal_deque<fjpeg_batch_task_t> fjpeg_batch_deque;
+
+bool fjpeg_batch::load(const char* manifest) {
+    FILE* fp = fopen(manifest, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Unable to open manifest %s\n", manifest);
+        return false;
+    }
+
+    char line[4096];
+    char input[4096];
+    char output[4096];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        const char* p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '#' || *p == '\r' || *p == '\n' || *p == 0) {
+            continue;
+        }
+
+        fjpeg_batch_job_t job;
+        if (sscanf(p, "%4095s %dx%d %d %4095s", input, &job.width, &job.height, &job.quality, output) != 5 ||
+            job.width < 1 || job.height < 1 || job.quality < 1 || job.quality > 100) {
+            fprintf(stderr, "Error: Invalid manifest line %d, expected \"input WxH quality output\"\n", line_number);
+            fclose(fp);
+            return false;
+        }
+        job.input = input;
+        job.output = output;
+        job.line = line_number;
+        jobs.push_back(job);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// Own deque first, then steal the oldest task of the other workers
+static bool fjpeg_batch_next(std::vector<fjpeg_batch_deque*>& deques, int self, fjpeg_batch_task_t& task, std::atomic<int64_t>& steals) {
+    if (deques[self]->pop_back(task)) {
+        return true;
+    }
+    const int count = (int)deques.size();
+    for (int i = 1; i < count; i++) {
+        if (deques[(self + i) % count]->steal(task)) {
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void fjpeg_batch_run_band(const fjpeg_batch_task_t& task) {
+    for (int y = task.y_start; y < task.y_end; y += task.context->mcuSize()) {
+        fjpeg_transquant_mcu_row(task.context, y);
+    }
+    std::lock_guard<std::mutex> lock(task.frame->mutex);
+    if (--task.frame->remaining == 0) {
+        task.frame->done.notify_all();
+    }
+}
+
+// Transform a large frame in bands that idle workers can steal, the owner
+// works through its own bands and waits for the stolen ones to finish
+static void fjpeg_batch_transquant_bands(fjpeg_batch_deque* own, fjpeg_batch_signal_t* signal, fjpeg_context* context, int band_rows) {
+    fjpeg_batch_frame_t frame;
+    const int band_lines = band_rows * context->mcuSize();
+    context->resetDistortion();
+    std::vector<fjpeg_batch_task_t> bands;
+    for (int y = 0; y < context->paddedHeight(); y += band_lines) {
+        fjpeg_batch_task_t band = { -1, context, y, FJPEG_MIN(y + band_lines, context->paddedHeight()), &frame };
+        bands.push_back(band);
+    }
+    frame.remaining = (int)bands.size();
+
+    // Bands go to the steal end so they are taken before queued files
+    for (size_t i = bands.size(); i > 0; i--) {
+        own->push_front(bands[i - 1]);
+    }
+    fjpeg_batch_notify(signal);
+
+    // The bands sit in front of the queued files, a file at the steal end means the
+    // rest were stolen and it goes back for the thieves
+    fjpeg_batch_task_t task;
+    while (own->steal(task)) {
+        if (task.frame != &frame) {
+            own->push_front(task);
+            fjpeg_batch_notify(signal);
+            break;
+        }
+        fjpeg_batch_run_band(task);
+    }
+
+    std::unique_lock<std::mutex> lock(frame.mutex);
+    frame.done.wait(lock, [&] { return frame.remaining == 0; });
+}
+
+bool fjpeg_batch::run() {
+    std::vector<fjpeg_batch_deque*> deques;
+    for (int i = 0; i < workers; i++) {
+        deques.push_back(new fjpeg_batch_deque());
+    }
+
+    // Deal the files round robin, owners pop from the back so push in reverse
+    for (size_t i = jobs.size(); i > 0; i--) {
+        fjpeg_batch_task_t task = { (int)(i - 1), nullptr, 0, 0, nullptr };
+        deques[(i - 1) % workers]->push_back(task);
+    }
+
+    std::atomic<int64_t> files_left((int64_t)jobs.size());
+    std::atomic<int64_t> files_done(0);
+    std::atomic<int64_t> total_in(0);
+    std::atomic<int64_t> total_out(0);
+    std::atomic<int64_t> total_steals(0);
+    fjpeg_batch_signal_t signal;
+    signal.pushed = 0;
+    std::mutex failure_mutex;
+    std::vector<std::pair<int, std::string> > failed;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; w++) {
+        threads.push_back(std::thread([&, w] {
+            fjpeg_context context;
+            fjpeg_batch_task_t task;
+
+            while (files_left > 0) {
+                // Read the push count before looking, a push after that wakes the wait
+                uint64_t pushed;
+                {
+                    std::lock_guard<std::mutex> lock(signal.mutex);
+                    pushed = signal.pushed;
+                }
+                if (!fjpeg_batch_next(deques, w, task, total_steals)) {
+                    std::unique_lock<std::mutex> lock(signal.mutex);
+                    signal.wake.wait(lock, [&] { return files_left == 0 || signal.pushed != pushed; });
+                    continue;
+                }
+                if (task.job < 0) {
+                    fjpeg_batch_run_band(task);
+                    continue;
+                }
+
+                const fjpeg_batch_job_t& job = jobs[task.job];
+                const char* error = nullptr;
+                int64_t written = 0;
+
+                FILE* in = fopen(job.input.c_str(), "rb");
+                if (!in) {
+                    error = "unable to open input";
+                } else {
+                    if (!context.setQuality(job.quality)) {
+                        error = "invalid quality";
+                    } else if (!context.readFrame(in, job.width, job.height)) {
+                        error = "unable to read frame";
+                    }
+                    fclose(in);
+                }
+
+                if (!error) {
+                    FILE* out = fopen(job.output.c_str(), "wb");
+                    if (!out) {
+                        error = "unable to open output";
+                    } else {
+                        fjpeg_bitstream stream(out);
+                        bool ok;
+                        if (workers > 1 && (int64_t)job.width * job.height >= band_pixels) {
+                            fjpeg_batch_transquant_bands(deques[w], &signal, &context, band_rows);
+                            ok = fjpeg_generate_header(&stream, &context);
+                        } else {
+                            ok = fjpeg_encode_frame(&stream, &context);
+                        }
+                        written = (int64_t)stream.bytes_written;
+                        if (fclose(out) != 0 || !ok) {
+                            error = "unable to write output";
+                            remove(job.output.c_str());
+                        }
+                    }
+                }
+
+                if (error) {
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    failed.push_back(std::make_pair(job.line, job.input + ": " + error));
+                } else {
+                    files_done++;
+                    total_in += fjpeg_context::frameSize(job.width, job.height);
+                    total_out += written;
+                }
+                if (--files_left == 0) {
+                    fjpeg_batch_notify(&signal);
+                }
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    for (size_t i = 0; i < deques.size(); i++) {
+        delete deques[i];
+    }
+
+    time_total_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    files = files_done;
+    bytes_in = total_in;
+    bytes_out = total_out;
+    steals = total_steals;
+
+    std::sort(failed.begin(), failed.end());
+    failures.clear();
+    for (size_t i = 0; i < failed.size(); i++) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "line %d: ", failed[i].first);
+        failures.push_back(prefix + failed[i].second);
+    }
+
+    return failures.empty();
+}
@@ -0,0 +1,67 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fjpeg_tune.h"
+
+// One manifest line: "input WIDTHxHEIGHT quality output"
+struct fjpeg_batch_job_t {
+    std::string input;
+    std::string output;
+    int width;
+    int height;
+    int quality;
+    int line;
+};
+
+// Encodes many files on a work-stealing pool, each worker reuses one context
+// and frames of at least band_pixels are split into MCU row bands
+class fjpeg_batch {
+    public:
+    std::vector<fjpeg_batch_job_t> jobs;
+    int workers;
+    int64_t band_pixels;
+    int band_rows;
+
+    // Results of run()
+    int64_t files;
+    int64_t bytes_in;
+    int64_t bytes_out;
+    int64_t time_total_us;
+    int64_t steals;
+    std::vector<std::string> failures;
+
+    fjpeg_batch(int workers) : workers(workers), band_pixels(4 << 20), band_rows(fjpeg_tuning()->band_rows > 0 ? fjpeg_tuning()->band_rows : 16),
+        files(0), bytes_in(0), bytes_out(0), time_total_us(0), steals(0) {}
+
+    bool load(const char* manifest);
+    bool run();
+};
@@ -33,6 +33,49 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cassert>
 #include <vector>
 
+// Destination for the encoded bytes, receives completed byte ranges in order
+class fjpeg_output_sink {
+    public:
+    virtual ~fjpeg_output_sink() {}
+    virtual bool write(const uint8_t* data, size_t size) = 0;
+};
+
+class fjpeg_file_sink : public fjpeg_output_sink {
+    public:
+    FILE *fp;
+
+    fjpeg_file_sink(FILE *fp) : fp(fp) {}
+
+    bool write(const uint8_t* data, size_t size) {
+        return fwrite(data, 1, size, fp) == size;
+    }
+};
+
+class fjpeg_memory_sink : public fjpeg_output_sink {
+    public:
+    std::vector<uint8_t> data;
+
+    bool write(const uint8_t* bytes, size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+        return true;
+    }
+};
+
+// Plain callback, return false to abort
+typedef bool (*fjpeg_sink_callback_t)(void* user, const uint8_t* data, size_t size);
+
+class fjpeg_callback_sink : public fjpeg_output_sink {
+    public:
+    fjpeg_sink_callback_t callback;
+    void* user;
+
+    fjpeg_callback_sink(fjpeg_sink_callback_t callback, void* user) : callback(callback), user(user) {}
+
+    bool write(const uint8_t* data, size_t size) {
+        return callback(user, data, size);
+    }
+};
+
 // Bitstream handling
 class fjpeg_bitstream {
     public:
@@ -43,7 +86,13 @@ class fjpeg_bitstream {
     std::vector<uint8_t> buffer;
     bool avoidFF;
 
-    fjpeg_bitstream(FILE *fp) : current(0), offset(0), fp(fp), avoidFF(false) {}
+    fjpeg_file_sink file_sink;
+    fjpeg_output_sink* sink;
+    int64_t bytes_written;
+    bool failed;
+
+    fjpeg_bitstream(FILE *fp) : current(0), offset(0), fp(fp), avoidFF(false), file_sink(fp), sink(&file_sink), bytes_written(0), failed(false) {}
+    fjpeg_bitstream(fjpeg_output_sink* sink) : current(0), offset(0), fp(nullptr), avoidFF(false), file_sink(nullptr), sink(sink), bytes_written(0), failed(false) {}
 
     void writeBits(uint32_t input, int bits) {
         assert(bits > 0 && bits <= 24);
@@ -67,6 +116,65 @@ class fjpeg_bitstream {
         offset += bits;
     }
 
+    // Pad the last partial byte with 1-bits and move all complete bytes to the buffer
+    void alignByte() {
+        if(offset&7) {
+            int pad = 8-(offset&7);
+            current = (current << pad) | ((1u << pad) - 1);
+            offset += pad;
+        }
+        while(offset >= 8) {
+            uint8_t val = (current >> (offset-8)) & 0xff;
+            buffer.push_back(val);
+            if(avoidFF && val == 0xff) {
+                buffer.push_back(0);
+            }
+            offset -= 8;
+        }
+        current = 0;
+    }
+
+    // Append a byte that the caller has already stuffed, only valid on a byte boundary
+    void writeRawByte(uint8_t val) {
+        assert(offset == 0);
+        buffer.push_back(val);
+    }
+
+    // Move the complete bytes in current to the buffer, at most 7 bits stay pending
+    void flushCompleteBytes() {
+        while(offset >= 8) {
+            uint8_t val = (current >> (offset-8)) & 0xff;
+            buffer.push_back(val);
+            if(avoidFF && val == 0xff) {
+                buffer.push_back(0);
+            }
+            offset -= 8;
+        }
+        current = offset ? (current & (FJPEG_UINT32_MAX >> (32-offset))) : 0;
+    }
+
+    // Append already entropy coded and stuffed bytes, only valid on a byte boundary
+    void writeRawBytes(const uint8_t* data, size_t size) {
+        assert(offset == 0);
+        buffer.insert(buffer.end(), data, data + size);
+    }
+
+    // Bytes produced so far, including those still in the buffer, exact on a byte boundary
+    int64_t bytePosition() const {
+        return bytes_written + (int64_t)buffer.size();
+    }
+
+    // Hand the complete bytes collected so far to the sink, partial bits stay in current
+    void flushBytes() {
+        if(!buffer.empty()) {
+            if(!failed && !sink->write(buffer.data(), buffer.size())) {
+                failed = true;
+            }
+            bytes_written += buffer.size();
+            buffer.clear();
+        }
+    }
+
     void flushToFile() {
         if (offset > 0) {
             if(offset&7) current <<= (8-(offset&7));
@@ -80,8 +188,7 @@ class fjpeg_bitstream {
             }
             current &= ((~0) >> (32-offset));
         }
-        fwrite(buffer.data(), 1, buffer.size(), fp);
-        buffer.clear();
+        flushBytes();
     }
 
     ~fjpeg_bitstream() {
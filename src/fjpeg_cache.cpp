@@ -0,0 +1,202 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "fjpeg.h"
+#include "fjpeg_hash.h"
+#include "fjpeg_cache.h"
+
+uint64_t fjpeg_cache_key(fjpeg_context* context, uint64_t options) {
+    const int64_t luma_size = context->luma_stride * context->paddedHeight();
+    const int64_t chroma_size = context->chroma_stride * (context->paddedHeight() / 2);
+    uint64_t h = fjpeg_xxh64(context->fjpeg_y, (size_t)luma_size, 0);
+    if (context->channels == 3) {
+        h = fjpeg_xxh64(context->fjpeg_cb, (size_t)chroma_size, h);
+        h = fjpeg_xxh64(context->fjpeg_cr, (size_t)chroma_size, h);
+    }
+
+    int32_t settings[4] = { context->width, context->height, context->channels, context->quality };
+    h = fjpeg_xxh64(settings, sizeof(settings), h);
+    h = fjpeg_xxh64(context->fjpeg_luminance_quantization_table, 64, h);
+    h = fjpeg_xxh64(context->fjpeg_chrominance_quantization_table, 64, h);
+    h = fjpeg_xxh64(&context->fjpeg_short_huffman_luma_dc, sizeof(fjpeg_short_huffman_table_t), h);
+    h = fjpeg_xxh64(&context->fjpeg_short_huffman_luma_ac, sizeof(fjpeg_short_huffman_table_t), h);
+    h = fjpeg_xxh64(&context->fjpeg_short_huffman_chroma_dc, sizeof(fjpeg_short_huffman_table_t), h);
+    h = fjpeg_xxh64(&context->fjpeg_short_huffman_chroma_ac, sizeof(fjpeg_short_huffman_table_t), h);
+    h = fjpeg_xxh64(&options, sizeof(options), h);
+
+    return h;
+}
+
+std::string fjpeg_cache::filename(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.jpg", (unsigned long long)key);
+    return directory + name;
+}
+
+// Evict from the back until the entries fit, the newest one always stays
+void fjpeg_cache::trim() {
+    while (used > capacity && lru.size() > 1) {
+        fjpeg_cache_entry& victim = lru.back();
+        if (!directory.empty()) {
+            remove(filename(victim.key).c_str());
+        }
+        used -= victim.size;
+        index.erase(victim.key);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+// Files left by earlier runs count against the capacity too, seed the list with them,
+// the most recently written at the front, and trim to the capacity right away
+void fjpeg_cache::scan() {
+#ifndef _WIN32
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        return;
+    }
+    std::vector<std::pair<int64_t, fjpeg_cache_entry> > found;
+    struct dirent* item;
+    while ((item = readdir(dir)) != nullptr) {
+        const char* name = item->d_name;
+        if (strlen(name) != 20 || strcmp(name + 16, ".jpg") != 0 || strspn(name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        struct stat st;
+        if (stat((directory + "/" + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        fjpeg_cache_entry entry;
+        entry.key = strtoull(name, nullptr, 16);
+        entry.size = (int64_t)st.st_size;
+        found.push_back(std::make_pair((int64_t)st.st_mtime, entry));
+    }
+    closedir(dir);
+
+    std::stable_sort(found.begin(), found.end(),
+                     [](const std::pair<int64_t, fjpeg_cache_entry>& a, const std::pair<int64_t, fjpeg_cache_entry>& b) { return a.first > b.first; });
+    for (size_t i = 0; i < found.size(); i++) {
+        lru.push_back(found[i].second);
+        index[found[i].second.key] = --lru.end();
+        used += found[i].second.size;
+    }
+    trim();
+#endif
+}
+
+// Add a new entry at the front and evict from the back until it fits
+void fjpeg_cache::insert(uint64_t key, int64_t size, const std::vector<uint8_t>* data) {
+    fjpeg_cache_entry entry;
+    entry.key = key;
+    entry.size = size;
+    if (data) {
+        entry.data = *data;
+    }
+    lru.push_front(entry);
+    index[key] = lru.begin();
+    used += size;
+    trim();
+}
+
+bool fjpeg_cache::lookup(uint64_t key, std::vector<uint8_t>* data) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::unordered_map<uint64_t, std::list<fjpeg_cache_entry>::iterator>::iterator it = index.find(key);
+    if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        if (directory.empty()) {
+            *data = it->second->data;
+            hits++;
+            return true;
+        }
+    }
+
+    // On disk entries are read back, also the ones stored by earlier runs
+    if (!directory.empty()) {
+        FILE* fp = fopen(filename(key).c_str(), "rb");
+        if (fp) {
+            FJPEG_FSEEK(fp, 0, SEEK_END);
+            int64_t size = FJPEG_FTELL(fp);
+            FJPEG_FSEEK(fp, 0, SEEK_SET);
+            data->resize((size_t)size);
+            bool ok = size > 0 && fread(data->data(), 1, (size_t)size, fp) == (size_t)size;
+            fclose(fp);
+            if (ok) {
+                if (it == index.end()) {
+                    insert(key, size, nullptr);
+                }
+                hits++;
+                return true;
+            }
+        }
+
+        // File removed behind our back, forget the entry
+        if (it != index.end()) {
+            used -= it->second->size;
+            lru.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    misses++;
+    return false;
+}
+
+void fjpeg_cache::store(uint64_t key, const std::vector<uint8_t>& data) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (index.find(key) != index.end()) {
+        return;
+    }
+
+    if (!directory.empty()) {
+        FILE* fp = fopen(filename(key).c_str(), "wb");
+        if (!fp) {
+            return;
+        }
+        bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+        if (fclose(fp) != 0 || !ok) {
+            remove(filename(key).c_str());
+            return;
+        }
+        insert(key, (int64_t)data.size(), nullptr);
+    } else {
+        insert(key, (int64_t)data.size(), &data);
+    }
+}
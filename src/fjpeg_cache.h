@@ -0,0 +1,79 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+#include "fjpeg.h"
+
+class fjpeg_cache_entry {
+    public:
+    uint64_t key;
+    int64_t size;
+    std::vector<uint8_t> data; // Empty when the entry lives on disk
+};
+
+// LRU cache of encoded JPEGs keyed by the input planes and every encode setting,
+// entries are kept in memory or, with a directory set, as <key>.jpg files
+class fjpeg_cache {
+    public:
+    int64_t capacity;
+    std::string directory;
+
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int64_t used;
+
+    std::list<fjpeg_cache_entry> lru;
+    std::unordered_map<uint64_t, std::list<fjpeg_cache_entry>::iterator> index;
+    std::mutex mutex;
+
+    fjpeg_cache(int64_t capacity, const std::string& directory) : capacity(capacity), directory(directory), hits(0), misses(0), evictions(0), used(0) {
+        if (!directory.empty()) {
+            scan();
+        }
+    }
+
+    bool lookup(uint64_t key, std::vector<uint8_t>* data);
+    void store(uint64_t key, const std::vector<uint8_t>& data);
+
+    private:
+    std::string filename(uint64_t key);
+    void scan();
+    void trim();
+    void insert(uint64_t key, int64_t size, const std::vector<uint8_t>* data);
+};
+
+// Hash of the loaded planes, dimensions, quality, quant and Huffman tables,
+// "options" covers caller side settings that change the output
+uint64_t fjpeg_cache_key(fjpeg_context* context, uint64_t options);
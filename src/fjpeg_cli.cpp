@@ -40,6 +40,661 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "fjpeg.h"
 #include "fjpeg_bitstream.h"
 #include "fjpeg_transquant.h"
+#include "fjpeg_pipeline.h"
+#include "fjpeg_server.h"
+#include "fjpeg_scale.h"
+#include "fjpeg_cache.h"
+#include "fjpeg_batch.h"
+#include "fjpeg_avi.h"
+#include "fjpeg_optimize.h"
+#include "fjpeg_sequence.h"
+#include "fjpeg_index.h"
+#include "fjpeg_transcode.h"
+#include "fjpeg_tune.h"
+
+// File sink that records when the first byte leaves the encoder
+class fjpeg_cli_timed_sink : public fjpeg_file_sink {
+    public:
+    bool written;
+    std::chrono::high_resolution_clock::time_point first_write;
+
+    fjpeg_cli_timed_sink(FILE *fp) : fjpeg_file_sink(fp), written(false) {}
+
+    bool write(const uint8_t* data, size_t size) {
+        if(!written) {
+            first_write = std::chrono::high_resolution_clock::now();
+            written = true;
+        }
+        return fjpeg_file_sink::write(data, size);
+    }
+};
+
+// Encode strip by strip with the row-push API, memory use does not depend on the height
+// Quality from the quantization error collected while transforming, no decode needed
+static void fjpeg_cli_print_psnr(const fjpeg_context* context) {
+    if(context->channels == 1) {
+        printf("PSNR estimate: Y %.2f dB\r\n", context->estimatedPsnr(0));
+    } else {
+        printf("PSNR estimate: Y %.2f dB, Cb %.2f dB, Cr %.2f dB\r\n", context->estimatedPsnr(0), context->estimatedPsnr(1), context->estimatedPsnr(2));
+    }
+}
+
+static int fjpeg_cli_encode_streaming(const std::string& input_filename, const std::string& output_filename, int width, int height, int quality, int flush_rows, bool arithmetic, int restart_rows, const std::string& index_filename) {
+    FILE* in = fopen(input_filename.c_str(), "rb");
+    if(!in) {
+        fprintf(stderr, "Error: Unable to open input file\n");
+        return 1;
+    }
+    FILE *fp = fopen(output_filename.c_str(), "wb");
+    if(!fp) {
+        fprintf(stderr, "Error: Unable to open output file\n");
+        fclose(in);
+        return 1;
+    }
+
+    fjpeg_context* context = new fjpeg_context();
+    context->setQuality(quality);
+    context->flush_rows = flush_rows;
+    context->arithmetic = arithmetic;
+    context->restart_rows = restart_rows;
+    context->record_row_index = !index_filename.empty();
+    fjpeg_cli_timed_sink sink(fp);
+    fjpeg_bitstream* stream = new fjpeg_bitstream(&sink);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    bool ok = fjpeg_stream_begin(stream, context, width, height);
+
+    // Planar I420 input, chroma planes follow the full luma plane
+    const int mcu = context->mcuSize();
+    const int64_t chroma_width = context->chromaWidth();
+    const int64_t luma_plane = (int64_t)width * height;
+    const int64_t chroma_plane = chroma_width * context->chromaHeight();
+    std::vector<fjpeg_pixel_t> strip_y((size_t)width * mcu);
+    std::vector<fjpeg_pixel_t> strip_cb((size_t)chroma_width * mcu / 2);
+    std::vector<fjpeg_pixel_t> strip_cr((size_t)chroma_width * mcu / 2);
+
+    for(int64_t y = 0; ok && y < height; y += mcu) {
+        const int lines = (int)FJPEG_MIN((int64_t)mcu, height - y);
+        const int chroma_lines = (lines + 1) >> 1;
+        const int64_t chroma_offset = (y >> 1) * chroma_width;
+
+        ok = FJPEG_FSEEK(in, (y * width), SEEK_SET) == 0 &&
+             fread(strip_y.data(), 1, (size_t)(lines * (int64_t)width), in) == (size_t)(lines * (int64_t)width) &&
+             FJPEG_FSEEK(in, (luma_plane + chroma_offset), SEEK_SET) == 0 &&
+             fread(strip_cb.data(), 1, (size_t)(chroma_lines * chroma_width), in) == (size_t)(chroma_lines * chroma_width) &&
+             FJPEG_FSEEK(in, (luma_plane + chroma_plane + chroma_offset), SEEK_SET) == 0 &&
+             fread(strip_cr.data(), 1, (size_t)(chroma_lines * chroma_width), in) == (size_t)(chroma_lines * chroma_width);
+
+        ok = ok && fjpeg_stream_push(stream, context, strip_y.data(), strip_cb.data(), strip_cr.data(), lines);
+    }
+
+    ok = ok && fjpeg_stream_end(stream, context);
+    auto end = std::chrono::high_resolution_clock::now();
+    ok = ok && (index_filename.empty() || fjpeg_write_row_index(index_filename.c_str(), context));
+    int64_t time_encode_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    int64_t file_size = FJPEG_FTELL(fp);
+
+    delete stream;
+    fclose(fp);
+    fclose(in);
+
+    if(!ok) {
+        fprintf(stderr, "Error: Streaming encode failed\n");
+        delete context;
+        return 1;
+    }
+
+    printf("Time: Streaming encode %d ms, first byte after %d ms\r\n", (int)time_encode_ms,
+           (int)std::chrono::duration_cast<std::chrono::milliseconds>(sink.first_write - start).count());
+    printf("Input size: %lld bytes\r\n", (long long)(luma_plane + 2 * chroma_plane));
+    printf("Output size: %lld bytes\r\n", (long long)file_size);
+    fjpeg_cli_print_psnr(context);
+    delete context;
+
+    return 0;
+}
+
+// Output name for frame "index", a printf style pattern like out_%04d.jpg is used as is,
+// otherwise the index is inserted before the extension
+static std::string fjpeg_cli_frame_filename(const std::string& pattern, int64_t index) {
+    char name[512];
+    if(pattern.find('%') != std::string::npos) {
+        snprintf(name, sizeof(name), pattern.c_str(), (int)index);
+        return name;
+    }
+    size_t dot = pattern.rfind('.');
+    if(dot == std::string::npos) dot = pattern.size();
+    snprintf(name, sizeof(name), "%s_%05d%s", pattern.substr(0, dot).c_str(), (int)index, pattern.substr(dot).c_str());
+    return name;
+}
+
+struct fjpeg_cli_sequence {
+    FILE* in;
+    std::string output_pattern;
+    int width;
+    int height;
+    int64_t max_frames;
+    int64_t frames_read;
+    fjpeg_avi_writer* avi;
+};
+
+// Sequences written to a .avi name go into one MJPEG AVI instead of numbered files
+static bool fjpeg_cli_is_avi(const std::string& filename) {
+    if(filename.size() < 4) {
+        return false;
+    }
+    std::string ext = filename.substr(filename.size() - 4);
+    for(size_t i = 0; i < ext.size(); i++) {
+        ext[i] = (char)tolower(ext[i]);
+    }
+    return ext == ".avi";
+}
+
+// JPEG input is transcoded in the coefficient domain instead of read as YUV
+static bool fjpeg_cli_is_jpeg(const std::string& filename) {
+    size_t dot = filename.rfind('.');
+    if(dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = filename.substr(dot);
+    for(size_t i = 0; i < ext.size(); i++) {
+        ext[i] = (char)tolower(ext[i]);
+    }
+    return ext == ".jpg" || ext == ".jpeg";
+}
+
+// Orientation for an --orient operation name, 0 when unknown
+static int fjpeg_cli_orientation(const char* name) {
+    static const struct { const char* name; int orientation; } ops[] = {
+        { "hflip", FJPEG_ORIENT_FLIP_H }, { "rot180", FJPEG_ORIENT_ROTATE_180 }, { "vflip", FJPEG_ORIENT_FLIP_V },
+        { "transpose", FJPEG_ORIENT_TRANSPOSE }, { "rot90", FJPEG_ORIENT_ROTATE_90 }, { "transverse", FJPEG_ORIENT_TRANSVERSE },
+        { "rot270", FJPEG_ORIENT_ROTATE_270 },
+    };
+    for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if(strcmp(name, ops[i].name) == 0) {
+            return ops[i].orientation;
+        }
+    }
+    return 0;
+}
+
+static bool fjpeg_cli_sequence_read(void* user, fjpeg_frame* frame) {
+    fjpeg_cli_sequence* seq = (fjpeg_cli_sequence*)user;
+    if(seq->max_frames > 0 && seq->frames_read >= seq->max_frames) {
+        return false;
+    }
+    if(!frame->context.readFrame(seq->in, seq->width, seq->height)) {
+        return false;
+    }
+    seq->frames_read++;
+    return true;
+}
+
+static bool fjpeg_cli_sequence_write(void* user, fjpeg_frame* frame) {
+    fjpeg_cli_sequence* seq = (fjpeg_cli_sequence*)user;
+    if(seq->avi) {
+        return seq->avi->writeFrame(frame->jpeg.data.data(), frame->jpeg.data.size());
+    }
+    std::string name = fjpeg_cli_frame_filename(seq->output_pattern, frame->index);
+    FILE* fp = fopen(name.c_str(), "wb");
+    if(!fp) {
+        fprintf(stderr, "Error: Unable to open output file %s\n", name.c_str());
+        return false;
+    }
+    bool ok = fwrite(frame->jpeg.data.data(), 1, frame->jpeg.data.size(), fp) == frame->jpeg.data.size();
+    return fclose(fp) == 0 && ok;
+}
+
+// Tables-only stream shared by the abbreviated frames of a sequence, empty name writes none
+static bool fjpeg_cli_write_tables(const std::string& tables_filename, int quality, bool arithmetic) {
+    if(tables_filename.empty()) {
+        return true;
+    }
+    FILE* fp = fopen(tables_filename.c_str(), "wb");
+    if(!fp) {
+        fprintf(stderr, "Error: Unable to open tables file %s\n", tables_filename.c_str());
+        return false;
+    }
+    fjpeg_context context;
+    context.setQuality(quality);
+    context.arithmetic = arithmetic;
+    bool ok;
+    int64_t bytes;
+    {
+        fjpeg_bitstream stream(fp);
+        ok = fjpeg_write_tables(&stream, &context);
+        bytes = stream.bytes_written;
+    }
+    printf("Tables: %lld bytes written to %s\r\n", (long long)bytes, tables_filename.c_str());
+    return (fclose(fp) == 0) && ok;
+}
+
+static void fjpeg_cli_print_preset(const fjpeg_preset_t* preset) {
+    printf("Preset: %s, %s DCT, flat block skip %s, %s Huffman tables, %d quantization search passes\r\n", preset->name,
+           fjpeg_dct_method_name(preset->dct_method), preset->flat_threshold < 0 ? "off" : "on",
+           preset->optimize_huffman ? "optimized" : "default", preset->quant_search);
+}
+
+// Read, encode and write a YUV sequence with the stages overlapping
+static int fjpeg_cli_encode_pipeline(const std::string& input_filename, const std::string& output_filename, int width, int height, int quality, int64_t frames, int threads, int fps_num, int fps_den,
+                                     bool arithmetic, int restart_rows, const fjpeg_preset_t* preset, const std::string& tables_filename) {
+    fjpeg_cli_sequence seq;
+    seq.in = fopen(input_filename.c_str(), "rb");
+    if(!seq.in) {
+        fprintf(stderr, "Error: Unable to open input file\n");
+        return 1;
+    }
+    seq.output_pattern = output_filename;
+    seq.width = width;
+    seq.height = height;
+    seq.max_frames = frames;
+    seq.frames_read = 0;
+    seq.avi = nullptr;
+
+    fjpeg_avi_writer avi;
+    if(fjpeg_cli_is_avi(output_filename)) {
+        if(!avi.open(output_filename.c_str(), width, height, fps_num, fps_den)) {
+            fclose(seq.in);
+            return 1;
+        }
+        seq.avi = &avi;
+    }
+
+    if(!fjpeg_cli_write_tables(tables_filename, quality, arithmetic)) {
+        fclose(seq.in);
+        return 1;
+    }
+
+    fjpeg_pipeline pipeline(quality, 3, threads);
+    pipeline.abbreviated = !tables_filename.empty();
+    pipeline.arithmetic = arithmetic;
+    pipeline.restart_rows = restart_rows;
+    pipeline.preset = preset;
+    if(preset) {
+        fjpeg_cli_print_preset(preset);
+    }
+    bool ok = pipeline.run(fjpeg_cli_sequence_read, fjpeg_cli_sequence_write, &seq);
+    fclose(seq.in);
+    if(seq.avi && !avi.close()) {
+        fprintf(stderr, "Error: Unable to finish AVI file\n");
+        ok = false;
+    }
+
+    if(!ok) {
+        fprintf(stderr, "Error: Pipelined encode failed\n");
+        return 1;
+    }
+
+    const double seconds = pipeline.time_total_us / 1e6;
+    printf("Frames: %lld in %.3f s, %.2f frames/s\r\n", (long long)pipeline.frames, seconds, seconds > 0 ? pipeline.frames / seconds : 0.0);
+    printf("Stage busy time: read %d ms, encode %d ms, write %d ms\r\n", (int)(pipeline.time_read_us / 1000),
+           (int)(pipeline.time_encode_us / 1000), (int)(pipeline.time_write_us / 1000));
+    printf("Output size: %lld bytes\r\n", (long long)pipeline.bytes);
+
+    return 0;
+}
+
+// Encode a YUV sequence frame by frame, restart intervals that did not change since the
+// previous frame reuse its coded bytes
+static int fjpeg_cli_encode_reuse(const std::string& input_filename, const std::string& output_filename, int width, int height, int quality,
+                                  int64_t frames, int restart_rows, bool arithmetic, int fps_num, int fps_den, const std::string& tables_filename) {
+    FILE* in = fopen(input_filename.c_str(), "rb");
+    if(!in) {
+        fprintf(stderr, "Error: Unable to open input file\n");
+        return 1;
+    }
+
+    fjpeg_avi_writer avi;
+    const bool to_avi = fjpeg_cli_is_avi(output_filename);
+    if(to_avi && !avi.open(output_filename.c_str(), width, height, fps_num, fps_den)) {
+        fclose(in);
+        return 1;
+    }
+
+    if(!fjpeg_cli_write_tables(tables_filename, quality, arithmetic)) {
+        fclose(in);
+        return 1;
+    }
+
+    fjpeg_context context;
+    context.setQuality(quality);
+    context.arithmetic = arithmetic;
+    context.abbreviated = !tables_filename.empty();
+    context.restart_rows = restart_rows > 0 ? restart_rows : 1;
+    fjpeg_sequence_encoder encoder(&context);
+
+    bool ok = true;
+    int64_t index = 0;
+    int64_t bytes = 0;
+    int64_t time_encode_us = 0;
+    while(ok && (frames <= 0 || index < frames) && context.readFrame(in, width, height)) {
+        fjpeg_memory_sink sink;
+        fjpeg_bitstream stream(&sink);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        ok = encoder.encodeFrame(&stream);
+        auto end = std::chrono::high_resolution_clock::now();
+        time_encode_us += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+        if(ok && to_avi) {
+            ok = avi.writeFrame(sink.data.data(), sink.data.size());
+        } else if(ok) {
+            std::string name = fjpeg_cli_frame_filename(output_filename, index);
+            FILE* fp = fopen(name.c_str(), "wb");
+            ok = fp && fwrite(sink.data.data(), 1, sink.data.size(), fp) == sink.data.size();
+            if(fp) fclose(fp);
+        }
+        bytes += (int64_t)sink.data.size();
+        index++;
+    }
+    fclose(in);
+
+    if(to_avi && !avi.close()) {
+        ok = false;
+    }
+    if(!ok) {
+        fprintf(stderr, "Error: Sequence encode failed\n");
+        return 1;
+    }
+
+    const int64_t segments = encoder.segments_reused + encoder.segments_coded;
+    printf("Frames: %lld, encode %d ms, %.2f frames/s\r\n", (long long)index, (int)(time_encode_us / 1000),
+           time_encode_us > 0 ? index * 1e6 / time_encode_us : 0.0);
+    printf("Restart intervals: %lld coded, %lld reused (%.1f%%)\r\n", (long long)encoder.segments_coded, (long long)encoder.segments_reused,
+           segments > 0 ? 100.0 * encoder.segments_reused / segments : 0.0);
+    printf("Output size: %lld bytes\r\n", (long long)bytes);
+
+    return 0;
+}
+
+// Requantize an existing baseline JPEG to the new quality without going back to pixels,
+// quality 0 keeps the source tables for a lossless rotation
+static int fjpeg_cli_transcode(const std::string& input_filename, const std::string& output_filename, int quality, bool arithmetic,
+                               int restart_rows, const fjpeg_preset_t* preset, int orientation) {
+    FILE* in = fopen(input_filename.c_str(), "rb");
+    if(!in) {
+        fprintf(stderr, "Error: Unable to open input file\n");
+        return 1;
+    }
+    FJPEG_FSEEK(in, 0, SEEK_END);
+    std::vector<uint8_t> data((size_t)FJPEG_FTELL(in));
+    FJPEG_FSEEK(in, 0, SEEK_SET);
+    bool ok = fread(data.data(), 1, data.size(), in) == data.size();
+    fclose(in);
+    if(!ok) {
+        fprintf(stderr, "Error: Unable to read input file\n");
+        return 1;
+    }
+
+    fjpeg_context context;
+    if(quality > 0) {
+        context.setQuality(quality);
+    }
+    context.arithmetic = arithmetic;
+    context.restart_rows = restart_rows;
+    context.setOrientation(orientation);
+    if(preset) {
+        fjpeg_apply_preset(&context, preset);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    if(!fjpeg_transcode_load(&context, data.data(), data.size(), quality == 0)) {
+        return 1;
+    }
+    if(context.restartInterval() > 65535) {
+        fprintf(stderr, "Error: Restart interval longer than 65535 MCUs\n");
+        return 1;
+    }
+    auto mid = std::chrono::high_resolution_clock::now();
+
+    FILE* fp = fopen(output_filename.c_str(), "wb");
+    if(!fp) {
+        fprintf(stderr, "Error: Unable to open output file\n");
+        return 1;
+    }
+    fjpeg_bitstream* stream = new fjpeg_bitstream(fp);
+    ok = fjpeg_generate_header(stream, &context);
+    auto end = std::chrono::high_resolution_clock::now();
+    delete stream;
+    int64_t file_size = FJPEG_FTELL(fp);
+    fclose(fp);
+
+    if(!ok) {
+        fprintf(stderr, "Error: Unable to write output file\n");
+        return 1;
+    }
+
+    printf("Transcode: %dx%d, decode and requantize %d ms, encode %d ms\r\n", context.width, context.height,
+           (int)std::chrono::duration_cast<std::chrono::milliseconds>(mid - start).count(),
+           (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - mid).count());
+    printf("Input size: %lld bytes\r\n", (long long)data.size());
+    printf("Output size: %lld bytes\r\n", (long long)file_size);
+    return 0;
+}
+
+// Send one frame to a running --serve instance
+static int fjpeg_cli_encode_client(const std::string& socket_path, const std::string& input_filename, const std::string& output_filename, int width, int height, int quality, bool use_fd) {
+    FILE* in = fopen(input_filename.c_str(), "rb");
+    if(!in) {
+        fprintf(stderr, "Error: Unable to open input file\n");
+        return 1;
+    }
+    std::vector<uint8_t> frame((size_t)fjpeg_context::frameSize(width, height));
+    bool ok = fread(frame.data(), 1, frame.size(), in) == frame.size();
+    fclose(in);
+    if(!ok) {
+        fprintf(stderr, "Error: Unable to read input frame\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> jpeg;
+    uint64_t latency_us = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    if(!fjpeg_client_encode(socket_path.c_str(), frame.data(), frame.size(), width, height, quality, use_fd, &jpeg, &latency_us)) {
+        fprintf(stderr, "Error: Encode request to %s failed\n", socket_path.c_str());
+        return 1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    FILE *fp = fopen(output_filename.c_str(), "wb");
+    if(!fp) {
+        fprintf(stderr, "Error: Unable to open output file\n");
+        return 1;
+    }
+    ok = fwrite(jpeg.data(), 1, jpeg.size(), fp) == jpeg.size();
+    fclose(fp);
+
+    printf("Time: Server %d us, round trip %d us\r\n", (int)latency_us,
+           (int)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    printf("Output size: %lld bytes\r\n", (long long)jpeg.size());
+
+    return ok ? 0 : 1;
+}
+
+// Output name for one ladder level, a printf style pattern gets the quality,
+// otherwise _q<quality> is inserted before the extension
+static std::string fjpeg_cli_quality_filename(const std::string& pattern, int quality) {
+    char name[512];
+    if(pattern.find('%') != std::string::npos) {
+        snprintf(name, sizeof(name), pattern.c_str(), quality);
+        return name;
+    }
+    size_t dot = pattern.rfind('.');
+    if(dot == std::string::npos) dot = pattern.size();
+    snprintf(name, sizeof(name), "%s_q%d%s", pattern.substr(0, dot).c_str(), quality, pattern.substr(dot).c_str());
+    return name;
+}
+
+// One DCT pass, one quantizer, entropy stream and output file per quality
+static int fjpeg_cli_encode_ladder(fjpeg_context* context, const std::string& output_filename, const std::vector<int>& qualities) {
+    std::vector<FILE*> files;
+    std::vector<fjpeg_file_sink*> file_sinks;
+    std::vector<fjpeg_output_sink*> sinks;
+    bool ok = true;
+
+    for(size_t i = 0; i < qualities.size(); i++) {
+        std::string name = fjpeg_cli_quality_filename(output_filename, qualities[i]);
+        FILE* fp = fopen(name.c_str(), "wb");
+        if(!fp) {
+            fprintf(stderr, "Error: Unable to open output file %s\n", name.c_str());
+            ok = false;
+            break;
+        }
+        files.push_back(fp);
+        file_sinks.push_back(new fjpeg_file_sink(fp));
+        sinks.push_back(file_sinks.back());
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    ok = ok && fjpeg_encode_ladder(context, qualities.data(), (int)qualities.size(), sinks.data());
+    auto end = std::chrono::high_resolution_clock::now();
+
+    for(size_t i = 0; i < files.size(); i++) {
+        if(ok) {
+            printf("Quality %d: %lld bytes\r\n", qualities[i], (long long)FJPEG_FTELL(files[i]));
+        }
+        fclose(files[i]);
+        delete file_sinks[i];
+    }
+
+    if(!ok) {
+        fprintf(stderr, "Error: Ladder encode failed\n");
+        return 1;
+    }
+
+    printf("Time: Ladder encode %d ms\r\n", (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+    return 0;
+}
+
+// Encode all files of a manifest on a work-stealing pool
+static int fjpeg_cli_encode_batch(const std::string& manifest, int threads) {
+    fjpeg_batch batch(threads);
+    if(!batch.load(manifest.c_str())) {
+        return 1;
+    }
+
+    bool ok = batch.run();
+
+    const double seconds = batch.time_total_us / 1e6;
+    printf("Batch: %lld of %lld files in %.3f s with %d workers, %lld steals\r\n", (long long)batch.files, (long long)batch.jobs.size(),
+           seconds, threads, (long long)batch.steals);
+    printf("Throughput: %.2f files/s, %.2f MB/s in, %.2f MB/s out\r\n", seconds > 0 ? batch.files / seconds : 0.0,
+           seconds > 0 ? batch.bytes_in / seconds / (1 << 20) : 0.0, seconds > 0 ? batch.bytes_out / seconds / (1 << 20) : 0.0);
+    if(!ok) {
+        printf("Failures: %d\r\n", (int)batch.failures.size());
+        for(size_t i = 0; i < batch.failures.size(); i++) {
+            printf("  %s\r\n", batch.failures[i].c_str());
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Encode the input once per preset and print what each one costs in time and bytes,
+// outputs are written next to the output name with the preset name inserted
+static int fjpeg_cli_compare_presets(const std::string& input_filename, const std::string& output_filename, int width, int height, int quality, bool arithmetic) {
+    printf("%-10s %-10s %5s %8s %7s %10s %10s %10s %10s\r\n", "Preset", "DCT", "Flat", "Huffman", "Search", "DCT ms", "Entropy ms", "Total ms", "Bytes");
+
+    for(int i = 0; i < fjpeg_preset_count(); i++) {
+        const fjpeg_preset_t* preset = fjpeg_preset(i);
+        fjpeg_context context;
+        context.setQuality(quality);
+        context.arithmetic = arithmetic;
+        fjpeg_apply_preset(&context, preset);
+        if(!context.readInput(input_filename.c_str(), width, height)) {
+            fprintf(stderr, "Error: Unable to read input file\n");
+            return 1;
+        }
+
+        fjpeg_memory_sink sink;
+        fjpeg_bitstream stream(&sink);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        fjpeg_transquant_input(&context);
+        auto mid = std::chrono::high_resolution_clock::now();
+        bool ok = fjpeg_generate_header(&stream, &context);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        size_t dot = output_filename.rfind('.');
+        if(dot == std::string::npos) dot = output_filename.size();
+        std::string name = output_filename.substr(0, dot) + "_" + preset->name + output_filename.substr(dot);
+        FILE* fp = fopen(name.c_str(), "wb");
+        if(!ok || !fp || fwrite(sink.data.data(), 1, sink.data.size(), fp) != sink.data.size()) {
+            fprintf(stderr, "Error: Unable to write output file %s\n", name.c_str());
+            if(fp) fclose(fp);
+            return 1;
+        }
+        fclose(fp);
+
+        char flat[16];
+        snprintf(flat, sizeof(flat), preset->flat_threshold < 0 ? "off" : "%d", preset->flat_threshold);
+        printf("%-10s %-10s %5s %8s %7d %10.1f %10.1f %10.1f %10lld\r\n", preset->name, fjpeg_dct_method_name(preset->dct_method), flat,
+               preset->optimize_huffman ? "optimal" : "default", preset->quant_search,
+               std::chrono::duration_cast<std::chrono::microseconds>(mid - start).count() / 1000.0,
+               std::chrono::duration_cast<std::chrono::microseconds>(end - mid).count() / 1000.0,
+               std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0,
+               (long long)sink.data.size());
+    }
+
+    return 0;
+}
+
+// Time the encoder configurations on a sample frame, or a synthetic one without -i,
+// and save the fastest as a profile
+static int fjpeg_cli_autotune(const std::string& input_filename, const std::string& profile_filename, int width, int height, int quality) {
+    if(width == 0 || height == 0) {
+        fprintf(stderr, "Error: Missing resolution\n");
+        return 1;
+    }
+
+    std::vector<fjpeg_pixel_t> frame;
+    if(!input_filename.empty()) {
+        frame.resize((size_t)fjpeg_context::frameSize(width, height));
+        FILE* in = fopen(input_filename.c_str(), "rb");
+        const bool read = in && fread(frame.data(), 1, frame.size(), in) == frame.size();
+        if(in) {
+            fclose(in);
+        }
+        if(!read) {
+            fprintf(stderr, "Error: Unable to read input file\n");
+            return 1;
+        }
+    }
+
+    fjpeg_tuning_t tuning;
+    std::vector<fjpeg_tune_trial_t> trials;
+    if(!fjpeg_autotune(width, height, frame.empty() ? nullptr : frame.data(), quality, profile_filename.c_str(), &tuning, &trials)) {
+        fprintf(stderr, "Error: Autotune trial failed\n");
+        return 1;
+    }
+
+    printf("%-12s %-10s %10s\r\n", "setting", "value", "ms");
+    const fjpeg_tune_trial_t* fastest_dct = nullptr;
+    for(size_t i = 0; i < trials.size(); i++) {
+        const fjpeg_tune_trial_t& trial = trials[i];
+        if(trial.setting == "dct_method") {
+            if(!fastest_dct || trial.ms < fastest_dct->ms) {
+                fastest_dct = &trial;
+            }
+            printf("%-12s %-10s %10.2f\r\n", trial.setting.c_str(), fjpeg_dct_method_name(trial.value), trial.ms);
+        } else {
+            printf("%-12s %-10d %10.2f\r\n", trial.setting.c_str(), trial.value, trial.ms);
+        }
+    }
+
+    if(!fjpeg_save_tuning(profile_filename.c_str(), &tuning)) {
+        fprintf(stderr, "Error: Unable to write profile %s\n", profile_filename.c_str());
+        return 1;
+    }
+    printf("Profile: %s, %d threads, %d row bands, set FJPEG_PROFILE to use it\r\n", profile_filename.c_str(),
+           tuning.threads, tuning.band_rows);
+    if(fastest_dct) {
+        // The DCT changes the coded bytes, so it stays an explicit choice
+        printf("Fastest DCT: %s, not saved since it changes the output, the presets select it\r\n",
+               fjpeg_dct_method_name(fastest_dct->value));
+    }
+    return 0;
+}
 
 int main(int argc, char** argv) {
     printf("FJPEG %s\n", fjpeg_version());
@@ -47,18 +702,54 @@ int main(int argc, char** argv) {
     std::string input_filename;
     std::string output_filename;
     int quality = 50;
+    std::vector<int> qualities;
     int width = 0;
     int height = 0;
+    bool streaming = false;
+    bool pipelined = false;
+    int flush_rows = 0;
+    int64_t frames = 0;
+    int threads = fjpeg_tuning()->threads > 0 ? fjpeg_tuning()->threads : 1;
+    std::string serve_socket;
+    std::string client_socket;
+    bool use_memfd = false;
+    std::string thumbnail_filename;
+    bool embed_thumbnail = false;
+    bool arithmetic = false;
+    std::vector<int> pyramid;
+    std::string cache_directory;
+    int64_t cache_size_mb = 0;
+    int64_t max_frame_mb = 0;
+    std::string batch_manifest;
+    int fps_num = 25;
+    int fps_den = 1;
+    std::string preset_name;
+    int restart_rows = 0;
+    bool reuse = false;
+    int orientation = FJPEG_ORIENT_NORMAL;
+    bool quality_given = false;
+    bool autotune = false;
+    int crop[4] = { 0, 0, 0, 0 }; // width, height, x, y
+    float target_psnr = 0.0f;
+    std::string tables_filename;
+    std::string index_filename;
 
     // Parse filename, quality and resolution
     for(int i = 1; i < argc; i++) {
         if(strcmp(argv[i], "-q") == 0) {
             if(i+1 < argc) {
-                quality = atoi(argv[i+1]);
-                if(quality < 1 || quality > 100) {
-                    fprintf(stderr, "Error: Invalid quality value\n");
-                    return 1;
+                // Comma separated list for a quality ladder
+                qualities.clear();
+                for(const char* q = argv[i+1]; q; q = strchr(q, ',') ? strchr(q, ',') + 1 : nullptr) {
+                    quality = atoi(q);
+                    if(quality < 1 || quality > 100) {
+                        fprintf(stderr, "Error: Invalid quality value\n");
+                        return 1;
+                    }
+                    qualities.push_back(quality);
                 }
+                quality = qualities[0];
+                quality_given = true;
             } else {
                 fprintf(stderr, "Error: Missing quality value\n");
                 return 1;
@@ -107,12 +798,270 @@ int main(int argc, char** argv) {
             }
             i++;
         }
+        else if(strcmp(argv[i], "--stream") == 0) {
+            streaming = true;
+        }
+        else if(strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = true;
+        }
+        else if(strcmp(argv[i], "--frames") == 0) {
+            if(i+1 < argc) {
+                frames = atoll(argv[i+1]);
+                if(frames < 1) {
+                    fprintf(stderr, "Error: Invalid frame count\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing frame count\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--autotune") == 0) {
+            autotune = true;
+        }
+        else if(strcmp(argv[i], "--batch") == 0) {
+            if(i+1 < argc) {
+                batch_manifest = argv[i+1];
+            } else {
+                fprintf(stderr, "Error: Missing manifest filename\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--fps") == 0) {
+            if(i+1 < argc) {
+                // Integer rate or a fraction like 30000/1001
+                fps_den = 1;
+                if(sscanf(argv[i+1], "%d/%d", &fps_num, &fps_den) < 1 || fps_num < 1 || fps_den < 1) {
+                    fprintf(stderr, "Error: Invalid frame rate\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing frame rate\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--threads") == 0) {
+            if(i+1 < argc) {
+                threads = atoi(argv[i+1]);
+                if(threads < 1) {
+                    fprintf(stderr, "Error: Invalid thread count\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing thread count\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--serve") == 0 || strcmp(argv[i], "--client") == 0) {
+            if(i+1 < argc) {
+                (strcmp(argv[i], "--serve") == 0 ? serve_socket : client_socket) = argv[i+1];
+            } else {
+                fprintf(stderr, "Error: Missing socket path\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--thumbnail") == 0) {
+            if(i+1 < argc) {
+                thumbnail_filename = argv[i+1];
+            } else {
+                fprintf(stderr, "Error: Missing thumbnail filename\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--pyramid") == 0) {
+            if(i+1 < argc) {
+                for(const char* p = argv[i+1]; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : nullptr) {
+                    int scale = atoi(p);
+                    if(scale != 2 && scale != 4 && scale != 8) {
+                        fprintf(stderr, "Error: Invalid pyramid scale, use 2, 4 or 8\n");
+                        return 1;
+                    }
+                    pyramid.push_back(scale);
+                }
+            } else {
+                fprintf(stderr, "Error: Missing pyramid scales\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--preset") == 0) {
+            if(i+1 < argc) {
+                preset_name = argv[i+1];
+                if(preset_name != "all" && !fjpeg_find_preset(preset_name.c_str())) {
+                    fprintf(stderr, "Error: Unknown preset %s\n", argv[i+1]);
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing preset\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--restart") == 0) {
+            if(i+1 < argc) {
+                restart_rows = atoi(argv[i+1]);
+                if(restart_rows < 1) {
+                    fprintf(stderr, "Error: Invalid restart interval\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing restart interval\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--index") == 0) {
+            if(i+1 < argc) {
+                index_filename = argv[i+1];
+            } else {
+                fprintf(stderr, "Error: Missing index filename\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--crop") == 0) {
+            if(i+1 < argc) {
+                if(sscanf(argv[i+1], "%dx%d+%d+%d", &crop[0], &crop[1], &crop[2], &crop[3]) != 4 ||
+                   crop[0] < 1 || crop[1] < 1 || crop[2] < 0 || crop[3] < 0 || ((crop[2] | crop[3]) & 1)) {
+                    fprintf(stderr, "Error: Invalid crop, use WxH+X+Y with an even X and Y\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing crop\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--tables") == 0) {
+            if(i+1 < argc) {
+                tables_filename = argv[i+1];
+            } else {
+                fprintf(stderr, "Error: Missing tables filename\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--target-psnr") == 0) {
+            if(i+1 < argc) {
+                target_psnr = (float)atof(argv[i+1]);
+                if(target_psnr <= 0.0f || target_psnr > 99.0f) {
+                    fprintf(stderr, "Error: Invalid target PSNR\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing target PSNR\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--orient") == 0) {
+            if(i+1 < argc) {
+                orientation = fjpeg_cli_orientation(argv[i+1]);
+                if(orientation == 0) {
+                    fprintf(stderr, "Error: Unknown orientation %s\n", argv[i+1]);
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing orientation\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--reuse") == 0) {
+            reuse = true;
+        }
+        else if(strcmp(argv[i], "--arithmetic") == 0) {
+            arithmetic = true;
+        }
+        else if(strcmp(argv[i], "--embed-thumbnail") == 0) {
+            embed_thumbnail = true;
+        }
+        else if(strcmp(argv[i], "--cache") == 0) {
+            if(i+1 < argc) {
+                cache_directory = argv[i+1];
+            } else {
+                fprintf(stderr, "Error: Missing cache directory\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--max-frame") == 0) {
+            if(i+1 < argc) {
+                max_frame_mb = atoll(argv[i+1]);
+                if(max_frame_mb < 1) {
+                    fprintf(stderr, "Error: Invalid maximum frame size\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing maximum frame size\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--cache-size") == 0) {
+            if(i+1 < argc) {
+                cache_size_mb = atoll(argv[i+1]);
+                if(cache_size_mb < 1) {
+                    fprintf(stderr, "Error: Invalid cache size\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing cache size\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--memfd") == 0) {
+            use_memfd = true;
+        }
+        else if(strcmp(argv[i], "--flush-rows") == 0) {
+            if(i+1 < argc) {
+                flush_rows = atoi(argv[i+1]);
+                if(flush_rows < 1) {
+                    fprintf(stderr, "Error: Invalid flush row count\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Error: Missing flush row count\n");
+                return 1;
+            }
+            i++;
+        }
         else if(strcmp(argv[i], "-h") == 0) {
             fjpeg_print_usage();
             return 0;
         }
     }
 
+    // Cache in memory when only a size is given, on disk with a directory
+    fjpeg_cache* cache = nullptr;
+    if(!cache_directory.empty() || cache_size_mb > 0) {
+        cache = new fjpeg_cache((cache_size_mb > 0 ? cache_size_mb : 1024) << 20, cache_directory);
+    }
+
+    if(!serve_socket.empty()) {
+        bool served = fjpeg_server_run(serve_socket.c_str(), threads, cache,
+                                       max_frame_mb > 0 ? (uint64_t)max_frame_mb << 20 : FJPEG_SERVER_MAX_FRAME_DEFAULT);
+        delete cache;
+        return served ? 0 : 1;
+    }
+
+    if(!batch_manifest.empty()) {
+        delete cache;
+        return fjpeg_cli_encode_batch(batch_manifest, threads);
+    }
+
+    if(autotune) {
+        delete cache;
+        return fjpeg_cli_autotune(input_filename, output_filename.empty() ? "fjpeg.profile" : output_filename, width, height, quality);
+    }
+
     if(input_filename.empty()) {
         fprintf(stderr, "Error: Missing input filename\n");
         fjpeg_print_usage();
@@ -123,11 +1072,96 @@ int main(int argc, char** argv) {
         fjpeg_print_usage();
         return 1;
     }
+    if(target_psnr > 0.0f && fjpeg_cli_is_jpeg(input_filename)) {
+        fprintf(stderr, "Error: --target-psnr needs YUV input\n");
+        delete cache;
+        return 1;
+    }
+    if(fjpeg_cli_is_jpeg(input_filename)) {
+        delete cache;
+        // Rotating without a new quality keeps the coefficients as they are
+        const bool lossless = orientation != FJPEG_ORIENT_NORMAL && !quality_given;
+        return fjpeg_cli_transcode(input_filename, output_filename, lossless ? 0 : quality, arithmetic, restart_rows,
+                                   preset_name.empty() ? nullptr : fjpeg_find_preset(preset_name.c_str()), orientation);
+    }
     if(width == 0 || height == 0) {
         fprintf(stderr, "Error: Missing resolution\n");
         fjpeg_print_usage();
         return 1;
     }
+    const int encode_width = crop[0] > 0 ? crop[0] : width;
+    const int encode_height = crop[0] > 0 ? crop[1] : height;
+    if(crop[0] > 0 && ((int64_t)crop[2] + crop[0] > width || (int64_t)crop[3] + crop[1] > height)) {
+        fprintf(stderr, "Error: Crop outside of the frame\n");
+        return 1;
+    }
+    if((int64_t)restart_rows * (((orientation >= FJPEG_ORIENT_TRANSPOSE ? encode_height : encode_width) + 15) / 16) > 65535) {
+        fprintf(stderr, "Error: Restart interval longer than 65535 MCUs\n");
+        return 1;
+    }
+    // Only the single frame encode reorders blocks, the other paths code the planes as stored
+    if(orientation != FJPEG_ORIENT_NORMAL && (!client_socket.empty() || reuse || pipelined || fjpeg_cli_is_avi(output_filename) || streaming ||
+                                               preset_name == "all" || qualities.size() > 1 || !pyramid.empty() ||
+                                               !thumbnail_filename.empty() || embed_thumbnail)) {
+        fprintf(stderr, "Error: --orient only applies to single frame encodes\n");
+        return 1;
+    }
+    if(crop[0] > 0 && (!client_socket.empty() || reuse || pipelined || fjpeg_cli_is_avi(output_filename) || streaming || preset_name == "all")) {
+        fprintf(stderr, "Error: --crop only applies to single frame encodes\n");
+        return 1;
+    }
+    // AVI players expect every frame to carry its own tables
+    if(!tables_filename.empty() && (!(reuse || pipelined) || fjpeg_cli_is_avi(output_filename) || !client_socket.empty())) {
+        fprintf(stderr, "Error: --tables only applies to --pipeline and --reuse sequences written as numbered files\n");
+        return 1;
+    }
+    if(target_psnr > 0.0f && (!client_socket.empty() || reuse || pipelined || fjpeg_cli_is_avi(output_filename) || streaming ||
+                              preset_name == "all" || qualities.size() > 1)) {
+        fprintf(stderr, "Error: --target-psnr only applies to single frame encodes\n");
+        return 1;
+    }
+
+    // The thumbnail is made from the coefficients of the single frame encode, before its header
+    if((!thumbnail_filename.empty() || embed_thumbnail) && (!client_socket.empty() || reuse || pipelined || fjpeg_cli_is_avi(output_filename) ||
+                                                             streaming || preset_name == "all" || qualities.size() > 1 || flush_rows > 0)) {
+        fprintf(stderr, "Error: --thumbnail and --embed-thumbnail only apply to single frame encodes without --flush-rows\n");
+        return 1;
+    }
+    if(!pyramid.empty() && (!client_socket.empty() || reuse || pipelined || fjpeg_cli_is_avi(output_filename) ||
+                            streaming || preset_name == "all" || qualities.size() > 1 || flush_rows > 0)) {
+        fprintf(stderr, "Error: --pyramid only applies to single frame encodes without --flush-rows\n");
+        return 1;
+    }
+    // The server, the reused restart intervals and the row strips code without the preset
+    if(!preset_name.empty() && (!client_socket.empty() || reuse || streaming)) {
+        fprintf(stderr, "Error: --preset does not apply to --client, --reuse or --stream encodes\n");
+        return 1;
+    }
+    if(preset_name == "all" && (pipelined || fjpeg_cli_is_avi(output_filename) || qualities.size() > 1)) {
+        fprintf(stderr, "Error: --preset all only applies to single frame encodes\n");
+        return 1;
+    }
+
+    if(!client_socket.empty()) {
+        return fjpeg_cli_encode_client(client_socket, input_filename, output_filename, width, height, quality, use_memfd);
+    }
+
+    if(reuse) {
+        return fjpeg_cli_encode_reuse(input_filename, output_filename, width, height, quality, frames, restart_rows, arithmetic, fps_num, fps_den, tables_filename);
+    }
+
+    if(pipelined || fjpeg_cli_is_avi(output_filename)) {
+        return fjpeg_cli_encode_pipeline(input_filename, output_filename, width, height, quality, frames, threads, fps_num, fps_den, arithmetic, restart_rows,
+                                         preset_name.empty() ? nullptr : fjpeg_find_preset(preset_name.c_str()), tables_filename);
+    }
+
+    if(streaming) {
+        return fjpeg_cli_encode_streaming(input_filename, output_filename, width, height, quality, flush_rows, arithmetic, restart_rows, index_filename);
+    }
+
+    if(preset_name == "all") {
+        return fjpeg_cli_compare_presets(input_filename, output_filename, width, height, quality, arithmetic);
+    }
 
     // Time measurement
     int64_t time_input_read_ms = 0;
@@ -138,15 +1172,123 @@ int main(int argc, char** argv) {
     fjpeg_context* context = new fjpeg_context();
 
     context->setQuality(quality);
+    context->arithmetic = arithmetic;
+    context->restart_rows = restart_rows;
+    context->record_row_index = !index_filename.empty();
+    context->setOrientation(orientation);
+    context->target_psnr = target_psnr;
+
+    const fjpeg_preset_t* preset = preset_name.empty() ? nullptr : fjpeg_find_preset(preset_name.c_str());
+    if(preset) {
+        fjpeg_apply_preset(context, preset);
+        fjpeg_cli_print_preset(preset);
+    }
 
     // Calculate time
+    // A crop reads the whole frame once and the transform picks the region out of it in place
+    std::vector<fjpeg_pixel_t> frame;
     auto start = std::chrono::high_resolution_clock::now();
-    context->readInput(input_filename.c_str(), width, height);
+    if(crop[0] > 0) {
+        frame.resize((size_t)fjpeg_context::frameSize(width, height));
+        FILE* in = fopen(input_filename.c_str(), "rb");
+        const bool read = in && fread(frame.data(), 1, frame.size(), in) == frame.size();
+        if(in) {
+            fclose(in);
+        }
+        const int64_t luma = (int64_t)width * height;
+        const int64_t chroma_stride = (width + 1) >> 1;
+        const int64_t chroma = chroma_stride * ((height + 1) >> 1);
+        if(!read || !context->setInputPlanes(frame.data(), width, frame.data() + luma, frame.data() + luma + chroma, chroma_stride,
+                                             crop[2], crop[3], crop[0], crop[1])) {
+            fprintf(stderr, "Error: Unable to read input file\n");
+            delete context;
+            return 1;
+        }
+    } else {
+        context->readInput(input_filename.c_str(), width, height);
+    }
     auto end = std::chrono::high_resolution_clock::now();
     time_input_read_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
 
     context->channels = 3;
 
+    if(!context->orientationAligned()) {
+        fprintf(stderr, "Error: --orient needs the mirrored dimension to be a multiple of %d pixels\n", context->mcuSize());
+        delete context;
+        return 1;
+    }
+
+    // Side outputs need the coefficients, so they always take the full encode
+    if(cache && (!thumbnail_filename.empty() || !pyramid.empty() || qualities.size() > 1 || flush_rows > 0 || !index_filename.empty() || crop[0] > 0 || target_psnr > 0.0f)) {
+        printf("Cache: disabled for this combination of options\r\n");
+        delete cache;
+        cache = nullptr;
+    }
+
+    uint64_t cache_key = 0;
+    if(cache) {
+        std::vector<uint8_t> cached;
+        cache_key = fjpeg_cache_key(context, (embed_thumbnail ? 1 : 0) | (arithmetic ? 2 : 0) | (preset ? (int)(preset - fjpeg_preset(0) + 1) << 2 : 0) | (orientation << 5) | (restart_rows << 8));
+        if(cache->lookup(cache_key, &cached)) {
+            FILE *fp = fopen(output_filename.c_str(), "wb");
+            bool written = fp && fwrite(cached.data(), 1, cached.size(), fp) == cached.size();
+            if(fp) {
+                written = fclose(fp) == 0 && written;
+            }
+            if(!written) {
+                fprintf(stderr, "Error: Unable to write output file\n");
+                delete cache;
+                delete context;
+                return 1;
+            }
+            printf("Cache: hit, %lld bytes\r\n", (long long)cached.size());
+            delete cache;
+            delete context;
+            return 0;
+        }
+        printf("Cache: miss\r\n");
+    }
+
+    if(qualities.size() > 1) {
+        int result = fjpeg_cli_encode_ladder(context, output_filename, qualities);
+        delete context;
+        return result;
+    }
+
+    if(flush_rows > 0) {
+        // Interleave transform and entropy coding per MCU row so bytes leave early
+        FILE *fp = fopen(output_filename.c_str(), "wb");
+        if(!fp) {
+            fprintf(stderr, "Error: Unable to open output file\n");
+            return 1;
+        }
+        context->flush_rows = flush_rows;
+        fjpeg_cli_timed_sink sink(fp);
+        fjpeg_bitstream* stream = new fjpeg_bitstream(&sink);
+
+        start = std::chrono::high_resolution_clock::now();
+        bool ok = fjpeg_encode_frame(stream, context);
+        end = std::chrono::high_resolution_clock::now();
+
+        int64_t file_size = stream->bytes_written;
+        delete stream;
+        fclose(fp);
+
+        ok = ok && (index_filename.empty() || fjpeg_write_row_index(index_filename.c_str(), context));
+        if(!ok) {
+            fprintf(stderr, "Error: Unable to write output file\n");
+            return 1;
+        }
+
+        printf("Time: Input read %d ms, Encode %d ms, first byte after %d ms\r\n", (int)time_input_read_ms,
+               (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count(),
+               (int)std::chrono::duration_cast<std::chrono::milliseconds>(sink.first_write - start).count());
+        printf("Input size: %lld bytes\r\n", (long long)context->width*context->height*3/2);
+        printf("Output size: %lld bytes\r\n", (long long)file_size);
+        fjpeg_cli_print_psnr(context);
+        delete context;
+        return 0;
+    }
 
     #ifdef FJPEG_DEBUG_DCT_BLOCK
     fjpeg_pixel_t* image = new fjpeg_pixel_t[1280*720];
@@ -158,11 +1300,61 @@ int main(int argc, char** argv) {
     end = std::chrono::high_resolution_clock::now();
     time_dct_quant_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
 
+    for(size_t i = 0; i < pyramid.size(); i++) {
+        // Reduced resolution outputs straight from the coefficients, no second DCT
+        size_t dot = output_filename.rfind('.');
+        if(dot == std::string::npos) dot = output_filename.size();
+        std::string name = output_filename.substr(0, dot) + "_div" + std::to_string(pyramid[i]) + output_filename.substr(dot);
+        FILE* level_fp = fopen(name.c_str(), "wb");
+        if(!level_fp) {
+            fprintf(stderr, "Error: Unable to open output file %s\n", name.c_str());
+            return 1;
+        }
+        fjpeg_file_sink level_sink(level_fp);
+        start = std::chrono::high_resolution_clock::now();
+        bool level_ok = fjpeg_generate_downscaled(context, pyramid[i], quality, &level_sink);
+        end = std::chrono::high_resolution_clock::now();
+        printf("Time: 1/%d level %d ms, %lld bytes\r\n", pyramid[i], (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count(), (long long)FJPEG_FTELL(level_fp));
+        fclose(level_fp);
+        if(!level_ok) {
+            fprintf(stderr, "Error: Unable to write output file %s\n", name.c_str());
+            return 1;
+        }
+    }
+
+    if(!thumbnail_filename.empty() || embed_thumbnail) {
+        // Thumbnail from the DC coefficients, only costs a 1/64 size encode
+        std::vector<uint8_t> thumbnail;
+        start = std::chrono::high_resolution_clock::now();
+        if(!fjpeg_generate_thumbnail(context, quality, &thumbnail)) {
+            fprintf(stderr, "Error: Unable to generate thumbnail\n");
+            return 1;
+        }
+        end = std::chrono::high_resolution_clock::now();
+        printf("Time: Thumbnail %d us, %lld bytes\r\n", (int)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), (long long)thumbnail.size());
+
+        if(!thumbnail_filename.empty()) {
+            FILE* thumb_fp = fopen(thumbnail_filename.c_str(), "wb");
+            if(!thumb_fp || fwrite(thumbnail.data(), 1, thumbnail.size(), thumb_fp) != thumbnail.size()) {
+                fprintf(stderr, "Error: Unable to write thumbnail file\n");
+                return 1;
+            }
+            fclose(thumb_fp);
+        }
+        if(embed_thumbnail) {
+            if(thumbnail.size() > 65535 - 8) {
+                fprintf(stderr, "Warning: Thumbnail too large for APP0, not embedded\n");
+            } else {
+                context->thumbnail.swap(thumbnail);
+            }
+        }
+    }
+
 #ifdef FJPEG_DEBUG_DCT_BLOCK
     FILE* dct_out = fopen("dct.yuv", "wb");
     for(int y = 0; y < 720; y++) {
         for(int x = 0; x < 1280; x++) {
-            uint8_t val = FJPEG_CLAMP(128+context->fjpeg_ydct[y*1280+x], 0, 255);
+            uint8_t val = FJPEG_CLAMP(128+context->fjpeg_ydct[context->coeffBlockOffset(0, x, y) + (y&7)*8 + (x&7)], 0, 255);
             fwrite(&val, 1,1, dct_out);
         }
     }
@@ -206,22 +1398,45 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Error: Unable to open output file\n");
         return 1;
     }
-    fjpeg_bitstream* stream = new fjpeg_bitstream(fp);
+    fjpeg_memory_sink cache_sink;
+    fjpeg_bitstream* stream = cache ? new fjpeg_bitstream(&cache_sink) : new fjpeg_bitstream(fp);
 
     start = std::chrono::high_resolution_clock::now();
-    fjpeg_generate_header(stream, context);
+    bool ok = fjpeg_generate_header(stream, context);
     end = std::chrono::high_resolution_clock::now();
     time_header_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
 
-    int file_size = ftell(fp);
+    if(cache) {
+        ok = ok && fwrite(cache_sink.data.data(), 1, cache_sink.data.size(), fp) == cache_sink.data.size();
+        if(ok) {
+            cache->store(cache_key, cache_sink.data);
+        }
+        printf("Cache: %lld hits, %lld misses, %lld evictions\r\n", (long long)cache->hits, (long long)cache->misses, (long long)cache->evictions);
+        delete cache;
+    }
 
-    fclose(fp);
+    int64_t file_size = ftell(fp);
+
+    ok = fclose(fp) == 0 && ok;
+    delete stream;
+    if(!ok) {
+        fprintf(stderr, "Error: Unable to write output file\n");
+        delete context;
+        return 1;
+    }
+
+    if(!index_filename.empty()) {
+        if(!fjpeg_write_row_index(index_filename.c_str(), context)) {
+            return 1;
+        }
+        printf("Index: %d row entry points\r\n", (int)context->row_index.size());
+    }
     
     printf("Time: Input read %d ms, DCT/Quant %d ms, Header %d ms\r\n", (int)time_input_read_ms, (int)time_dct_quant_ms, (int)time_header_ms);
-    printf("Input size: %d bytes\r\n", context->width*context->height*3/2);
-    printf("Output size: %d bytes\r\n", file_size);
+    printf("Input size: %lld bytes\r\n", (long long)context->width*context->height*3/2);
+    printf("Output size: %lld bytes\r\n", (long long)file_size);
+    fjpeg_cli_print_psnr(context);
 
-    delete stream;
     #ifdef FJPEG_DEBUG_DCT_BLOCK
     delete [] image;
     #endif
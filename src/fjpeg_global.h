@@ -46,12 +46,94 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define FJPEG_CLAMP(x, min, max) FJPEG_MIN(FJPEG_MAX((x), (min)), (max))
 
+// 64-bit file offsets
+#ifdef _WIN32
+#define FJPEG_FSEEK _fseeki64
+#define FJPEG_FTELL _ftelli64
+#else
+#define FJPEG_FSEEK fseeko
+#define FJPEG_FTELL ftello
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Index of the lowest set bit, value must not be zero
+static inline int fjpeg_ctz64(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (int)index;
+#else
+    int index = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+// Number of leading zero bits, value must not be zero
+static inline int fjpeg_clz64(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return 63 - (int)index;
+#else
+    int count = 0;
+    while (!(value & ((uint64_t)1 << 63))) {
+        value <<= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Number of bits needed for a non-negative value, the JPEG magnitude category
+static inline int fjpeg_bit_length(uint32_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return value ? 32 - __builtin_clz(value) : 0;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse(&index, value) ? (int)index + 1 : 0;
+#else
+    int bits = 0;
+    while (value) {
+        value >>= 1;
+        bits++;
+    }
+    return bits;
+#endif
+}
+
 typedef uint8_t fjpeg_pixel_t;
 typedef float fjpeg_coeff_t;
 
 #define FJPEG_UINT32_MAX 0xFFFFFFFF
 #define FJPEG_BLOCK_SIZE 8
 
+// Forward DCT kernels, the reference one is the direct 2-D sum, the fast one is
+// the AAN factorization with the output scaling applied after the column pass
+#define FJPEG_DCT_REFERENCE 0
+#define FJPEG_DCT_SEPARABLE 1
+#define FJPEG_DCT_FAST 2
+
+// Output orientation with the EXIF numbering, 5 to 8 swap width and height
+#define FJPEG_ORIENT_NORMAL 1
+#define FJPEG_ORIENT_FLIP_H 2
+#define FJPEG_ORIENT_ROTATE_180 3
+#define FJPEG_ORIENT_FLIP_V 4
+#define FJPEG_ORIENT_TRANSPOSE 5
+#define FJPEG_ORIENT_ROTATE_90 6
+#define FJPEG_ORIENT_TRANSVERSE 7
+#define FJPEG_ORIENT_ROTATE_270 8
+
 
 #define FJPEG_Q_FACTOR_SCALE 50
 
@@ -79,6 +161,19 @@ const uint8_t fjpeg_default_luma_quant_table[64] = {
   72, 92, 95, 98, 112, 100, 103, 199,
 };
 
+// Luma table of ITU T.81 Annex K, the default above departs from it in the high frequencies,
+// the default chroma table is the Annex K one
+const uint8_t fjpeg_annexk_luma_quant_table[64] = {
+  16, 11, 10, 16,  24,  40,  51,  61,
+  12, 12, 14, 19,  26,  58,  60,  55,
+  14, 13, 16, 24,  40,  57,  69,  56,
+  14, 17, 22, 29,  51,  87,  80,  62,
+  18, 22, 37, 56,  68, 109, 103,  77,
+  24, 35, 55, 64,  81, 104, 113,  92,
+  49, 64, 78, 87, 103, 121, 120, 101,
+  72, 92, 95, 98, 112, 100, 103,  99,
+};
+
 const uint8_t fjpeg_default_chroma_quant_table[64] = {
   17, 18, 24, 47, 99, 99, 99, 99,
   18, 21, 26, 66, 99, 99, 99, 99,
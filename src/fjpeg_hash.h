@@ -0,0 +1,119 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// XXH64, fast non-cryptographic hash used for cache keys
+#define FJPEG_XXH_PRIME1 11400714785074694791ULL
+#define FJPEG_XXH_PRIME2 14029467366897019727ULL
+#define FJPEG_XXH_PRIME3 1609587929392839161ULL
+#define FJPEG_XXH_PRIME4 9650029242287828579ULL
+#define FJPEG_XXH_PRIME5 2870177450012600261ULL
+
+static inline uint64_t fjpeg_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fjpeg_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t fjpeg_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t fjpeg_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * FJPEG_XXH_PRIME2;
+    acc = fjpeg_rotl64(acc, 31);
+    return acc * FJPEG_XXH_PRIME1;
+}
+
+static inline uint64_t fjpeg_xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= fjpeg_xxh64_round(0, val);
+    return acc * FJPEG_XXH_PRIME1 + FJPEG_XXH_PRIME4;
+}
+
+static inline uint64_t fjpeg_xxh64(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + FJPEG_XXH_PRIME1 + FJPEG_XXH_PRIME2;
+        uint64_t v2 = seed + FJPEG_XXH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - FJPEG_XXH_PRIME1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = fjpeg_xxh64_round(v1, fjpeg_read64(p));
+            v2 = fjpeg_xxh64_round(v2, fjpeg_read64(p + 8));
+            v3 = fjpeg_xxh64_round(v3, fjpeg_read64(p + 16));
+            v4 = fjpeg_xxh64_round(v4, fjpeg_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = fjpeg_rotl64(v1, 1) + fjpeg_rotl64(v2, 7) + fjpeg_rotl64(v3, 12) + fjpeg_rotl64(v4, 18);
+        h = fjpeg_xxh64_merge(h, v1);
+        h = fjpeg_xxh64_merge(h, v2);
+        h = fjpeg_xxh64_merge(h, v3);
+        h = fjpeg_xxh64_merge(h, v4);
+    } else {
+        h = seed + FJPEG_XXH_PRIME5;
+    }
+
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= fjpeg_xxh64_round(0, fjpeg_read64(p));
+        h = fjpeg_rotl64(h, 27) * FJPEG_XXH_PRIME1 + FJPEG_XXH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)fjpeg_read32(p) * FJPEG_XXH_PRIME1;
+        h = fjpeg_rotl64(h, 23) * FJPEG_XXH_PRIME2 + FJPEG_XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * FJPEG_XXH_PRIME5;
+        h = fjpeg_rotl64(h, 11) * FJPEG_XXH_PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= FJPEG_XXH_PRIME2;
+    h ^= h >> 29;
+    h *= FJPEG_XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -34,6 +34,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "fjpeg.h"
 #include "fjpeg_bitstream.h"
+#include "fjpeg_transquant.h"
 
 uint8_t fjpeg_generate_tables(fjpeg_huffman_table_t* output_table, const fjpeg_short_huffman_table_t* data) {
     // Size table
@@ -90,38 +91,64 @@ uint8_t fjpeg_generate_tables(fjpeg_huffman_table_t* output_table, const fjpeg_s
     return table_len;
 }
 
-// Function to encode a single block of quantized DCT coefficients
-int fjpeg_entropy_encode_block(fjpeg_bitstream* stream, fjpeg_context* context, fjpeg_coeff_t* block, int channel, int last_dc) {
-    int last_dc_coeff = last_dc;  // For DC coefficient prediction
+static fjpeg_default_tables_t fjpeg_build_default_tables() {
+    fjpeg_default_tables_t tables;
+    fjpeg_huffman_table_t table[256];
 
-    fjpeg_huffman_table_t* huff_dc = channel==0?context->fjpeg_huffman_luma_dc:context->fjpeg_huffman_chroma_dc;
-    fjpeg_huffman_table_t* huff_ac = channel==0?context->fjpeg_huffman_luma_ac:context->fjpeg_huffman_chroma_ac;
+    // DC tables only have 12 symbols, generate into a full table and keep the front
+    fjpeg_generate_tables(table, &fjpeg_default_huffman_luma_dc);
+    memcpy(tables.huffman_luma_dc, table, sizeof(tables.huffman_luma_dc));
+    fjpeg_generate_tables(tables.huffman_luma_ac, &fjpeg_default_huffman_luma_ac);
+    fjpeg_generate_tables(table, &fjpeg_default_huffman_chroma_dc);
+    memcpy(tables.huffman_chroma_dc, table, sizeof(tables.huffman_chroma_dc));
+    fjpeg_generate_tables(tables.huffman_chroma_ac, &fjpeg_default_huffman_chroma_ac);
+
+    for (int i = 0; i < 8; i++) {
+        for(int j = 0; j < 8; j++) {
+            tables.precalc_cos[i][j] = cosf((2.f * i + 1.f) * j * M_PI / 16.f);
+        }
+    }
 
-    // Check for last coeff
-    int last_coeff = 0;
-    for(int i = FJPEG_BLOCK_SIZE*FJPEG_BLOCK_SIZE-1; i >= 0; i--) {
-        if((int)(block[i]+0.5f) != 0) {
-            last_coeff = i;
-            break;
-        }        
+    // Descaling of the AAN DCT output, 1/(8 a(u) a(v)) with a(0) = 1 and a(k) = sqrt(2) cos(k pi/16)
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            const double av = v == 0 ? 1.0 : sqrt(2.0) * cos(v * M_PI / 16.0);
+            const double au = u == 0 ? 1.0 : sqrt(2.0) * cos(u * M_PI / 16.0);
+            tables.aan_scale[v * 8 + u] = (float)(1.0 / (8.0 * av * au));
+        }
     }
 
+    return tables;
+}
+
+const fjpeg_default_tables_t* fjpeg_default_tables() {
+    // Thread-safe one time initialization
+    static const fjpeg_default_tables_t tables = fjpeg_build_default_tables();
+    return &tables;
+}
+
+// Function to encode a single block of quantized DCT coefficients,
+// the table selection is resolved at compile time, TABLE 0 is luma
+template <int TABLE>
+static inline int fjpeg_entropy_encode_block_t(fjpeg_bitstream* stream, fjpeg_context* context, const fjpeg_coeff_t* block, int last_dc) {
+    int last_dc_coeff = last_dc;  // For DC coefficient prediction
+
+    const fjpeg_huffman_table_t* huff_dc = TABLE==0?context->fjpeg_huffman_luma_dc:context->fjpeg_huffman_chroma_dc;
+    const fjpeg_huffman_table_t* huff_ac = TABLE==0?context->fjpeg_huffman_luma_ac:context->fjpeg_huffman_chroma_ac;
+
+    // Rounded coefficients and their nonzero mask, the AC loop only visits set bits
+    int32_t values[64];
+    const uint64_t nonzero = fjpeg_nonzero_mask(block, values);
+
     // Code DC coefficient
-    int coeff = (int)(block[0]+0.5f); // Quantized DCT coefficients
+    int coeff = values[0]; // Quantized DCT coefficients
     #ifdef FJPEG_DEBUG_COEFF
     printf("Coeff %d\r\n", coeff);
     #endif
     int diff = coeff - last_dc_coeff;
     last_dc_coeff = coeff;
-    int orig_diff = diff;
-    int sign = (diff < 0) ? 1 : 0;
-    int size = 0;
     // VLI encoding for DC coefficients
-    if (sign) diff = -diff;
-    while (diff != 0) {
-        diff >>= 1;
-        size++;
-    }
+    int size = fjpeg_bit_length(diff < 0 ? -diff : diff);
     // Check for overflow
     if (size > 11) {
         // Handle error or clamp the size
@@ -129,87 +156,55 @@ int fjpeg_entropy_encode_block(fjpeg_bitstream* stream, fjpeg_context* context,
         exit(1);
     }
     #ifdef FJPEG_DEBUG_COEFF
-    printf("Writing DC coeff %d size %d huff len %d %d\n", orig_diff, size, huff_dc[size].len, huff_dc[size].code);
+    printf("Writing DC coeff %d size %d huff len %d %d\n", diff, size, huff_dc[size].len, huff_dc[size].code);
     #endif
     stream->writeBits(huff_dc[size].code, huff_dc[size].len); // Write size code
     if(size != 0) {
-        diff = orig_diff;
-        if(sign) {
+        if(diff < 0) {
             diff = (1 << size) + diff - 1;
         }
-        #ifdef FJPEG_DEBUG_COEFF
-        printf("Writing DC coeff %d size %d\n", diff, size);
-        #endif
         stream->writeBits(diff, size); // Write diff value
     }
 
-    if(last_coeff == 0) {
-        // All zero block
-        stream->writeBits(huff_ac[0x00].code, huff_ac[0x00].len); // EOB
-        return last_dc_coeff;
-    }
-    int i;
-    for (i = 1; i < FJPEG_BLOCK_SIZE*FJPEG_BLOCK_SIZE; i++) {
-        
-        int run_length = 0;
-        coeff = (int)(block[i]+0.5f);
-
-        // Run-length coding for AC coefficients
-        while (coeff == 0 && i < FJPEG_BLOCK_SIZE*FJPEG_BLOCK_SIZE - 1) {
-            run_length++;
-            i++;
-            coeff = (int)(block[i]+0.5f);
-            if(i > last_coeff) {
-                break;
-            }
-            if(run_length == 16) {
-                // ZRL
-                #ifdef FJPEG_DEBUG_COEFF
-                printf("ZRL\r\n");
-                #endif
-                stream->writeBits(huff_ac[0xF0].code, huff_ac[0xF0].len); // ZRL
-                run_length = 0;
-            }
-        }
-        #ifdef FJPEG_DEBUG_COEFF
-        printf("Run length %d\r\n", run_length);
-        #endif
-        // Check for EOB after encoding each coefficient
-        if (i > last_coeff || coeff == 0) {
-            break;
-        }
+    // AC coefficients, jump from one nonzero coefficient to the next
+    uint64_t ac = nonzero & ~(uint64_t)1;
+    int last = 0;
+    while (ac) {
+        const int i = fjpeg_ctz64(ac);
+        ac &= ac - 1;
 
-         // Encode the AC coefficient
-        int sign = (coeff < 0) ? 1 : 0;
-        int size = 0;
-        // VLI encoding for AC coefficients
-        int orig_coeff = coeff;
-        if(sign) coeff = -coeff;
-        while (coeff != 0) {
-            coeff >>= 1;
-            size++;                
+        int run_length = i - last - 1;
+        while (run_length >= 16) {
+            #ifdef FJPEG_DEBUG_COEFF
+            printf("ZRL\r\n");
+            #endif
+            stream->writeBits(huff_ac[0xF0].code, huff_ac[0xF0].len); // ZRL
+            run_length -= 16;
         }
-            // Check for overflow
+        last = i;
+
+        // Encode the AC coefficient
+        coeff = values[i];
+        size = fjpeg_bit_length(coeff < 0 ? -coeff : coeff);
+        // Check for overflow
         if (size > 10) {
             // Handle error or clamp the size
             fprintf(stderr, "Error: DC coefficient size overflow 2\n");
             exit(1);
         }
         #ifdef FJPEG_DEBUG_COEFF
-        printf("Writing AC coeff %d size %d huff len %d %d\n", orig_coeff, size, huff_ac[(run_length << 4) + size].len, huff_ac[(run_length << 4) + size].code);
+        printf("Writing AC coeff %d size %d huff len %d %d\n", coeff, size, huff_ac[(run_length << 4) + size].len, huff_ac[(run_length << 4) + size].code);
         #endif
         stream->writeBits(huff_ac[(run_length << 4) + size].code,
                             huff_ac[(run_length << 4) + size].len); // Write run-length/size code
-        if (size > 0) {
-            coeff = orig_coeff;
-            if(sign) {
-                coeff = (1 << size) + coeff - 1;
-            }
-            stream->writeBits(coeff, size); // Write the remaining bits
+        if(coeff < 0) {
+            coeff = (1 << size) + coeff - 1;
         }
+        stream->writeBits(coeff, size); // Write the remaining bits
     }
-    // Don't write EOB if we are at the end of the block already
-    if(i < FJPEG_BLOCK_SIZE*FJPEG_BLOCK_SIZE) {
+
+    // Don't write EOB if the last coefficient was coded
+    if(last != FJPEG_BLOCK_SIZE*FJPEG_BLOCK_SIZE - 1) {
         // EOB
         #ifdef FJPEG_DEBUG_COEFF
         printf("EOB\r\n");
@@ -218,4 +213,55 @@ int fjpeg_entropy_encode_block(fjpeg_bitstream* stream, fjpeg_context* context,
     }
 
     return last_dc_coeff;
-}
\ No newline at end of file
+}
+
+int fjpeg_entropy_encode_block(fjpeg_bitstream* stream, fjpeg_context* context, fjpeg_coeff_t* block, int channel, int last_dc) {
+    return channel==0?fjpeg_entropy_encode_block_t<0>(stream, context, block, last_dc):
+                      fjpeg_entropy_encode_block_t<1>(stream, context, block, last_dc);
+}
+
+// MCU loop specialized on the component count, 3 is 4:2:0 and 1 is grayscale
+template <int CHANNELS>
+static void fjpeg_entropy_encode_mcu_row_t(fjpeg_bitstream* stream, fjpeg_context* context, int y) {
+    // Luma from context->fjpeg_ydct
+    // Chroma from context->fjpeg_cbdct and context->fjpeg_crdct
+    // The coefficient planes are block contiguous in MCU order, so this walks them linearly
+    int* last_dc_coeff = context->last_dc_coeff;
+    const int inc_xy = CHANNELS==1?8:16;
+    const int max_uv = CHANNELS==1?1:2;
+    const int width = context->paddedFrameWidth();
+    fjpeg_coeff_t tmp[64];
+
+    for(int x = 0; x < width; x+=inc_xy) {
+
+        for(int v = 0; v < max_uv; v++) {
+            for(int u = 0; u < max_uv; u++) {
+                const fjpeg_coeff_t* dct_block = fjpeg_oriented_block_t<0>(context, x+u*8, y+v*8, tmp);
+                #ifdef FJPEG_DEBUG_BLOCK
+                printf("Encoding block %dx%d + %dx%d\n", x, y, u*8, v*8);
+                // Print out the block
+                for(int i = 0; i < 64; i++) {
+                    printf("%3d ", (int16_t)(dct_block[i]+0.5f));
+                    if((i+1)%8 == 0) printf("\r\n");
+                }
+                #endif
+                last_dc_coeff[0] = fjpeg_entropy_encode_block_t<0>(stream, context, dct_block, last_dc_coeff[0]);
+            }
+        }
+
+        if(CHANNELS==3) {
+            last_dc_coeff[1] = fjpeg_entropy_encode_block_t<1>(stream, context, fjpeg_oriented_block_t<1>(context, x>>1, y>>1, tmp), last_dc_coeff[1]);
+            last_dc_coeff[2] = fjpeg_entropy_encode_block_t<1>(stream, context, fjpeg_oriented_block_t<2>(context, x>>1, y>>1, tmp), last_dc_coeff[2]);
+        }
+    }
+}
+
+// Entropy code one MCU row, y is the top luma line of the row in the coefficient planes
+void fjpeg_entropy_encode_mcu_row(fjpeg_bitstream* stream, fjpeg_context* context, int y) {
+    if(context->arithmetic) {
+        fjpeg_arith_encode_mcu_row(stream, context, y);
+        return;
+    }
+    if(context->channels == 1) fjpeg_entropy_encode_mcu_row_t<1>(stream, context, y);
+    else fjpeg_entropy_encode_mcu_row_t<3>(stream, context, y);
+}
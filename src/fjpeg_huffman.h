@@ -35,6 +35,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "fjpeg_global.h"
 
+// FJPEG_NO_SIMD builds the scalar paths, fjpeg-verify checks both against the same golden hashes
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(FJPEG_NO_SIMD)
+#include <emmintrin.h>
+#define FJPEG_SSE2 1
+#endif
+
 
 
 const fjpeg_short_huffman_table_t fjpeg_default_huffman_luma_dc = { 
@@ -80,5 +86,49 @@ const fjpeg_short_huffman_table_t fjpeg_default_huffman_chroma_ac = {
 class fjpeg_bitstream;
 class fjpeg_context;
 
+// Tables every context starts from, built once on first use
+typedef struct {
+    fjpeg_huffman_table_t huffman_luma_dc[16];
+    fjpeg_huffman_table_t huffman_luma_ac[256];
+    fjpeg_huffman_table_t huffman_chroma_dc[16];
+    fjpeg_huffman_table_t huffman_chroma_ac[256];
+    float precalc_cos[8][8];
+    float aan_scale[64];
+} fjpeg_default_tables_t;
+
+const fjpeg_default_tables_t* fjpeg_default_tables();
+
+// Round a quantized block to the integers the entropy coders emit and return
+// a mask with bit i set for every nonzero coefficient i
+static inline uint64_t fjpeg_nonzero_mask(const fjpeg_coeff_t* block, int32_t* values) {
+    uint64_t mask = 0;
+#ifdef FJPEG_SSE2
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v0 = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(block + i), half));
+        __m128i v1 = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(block + i + 4), half));
+        __m128i v2 = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(block + i + 8), half));
+        __m128i v3 = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(block + i + 12), half));
+        _mm_storeu_si128((__m128i*)(values + i), v0);
+        _mm_storeu_si128((__m128i*)(values + i + 4), v1);
+        _mm_storeu_si128((__m128i*)(values + i + 8), v2);
+        _mm_storeu_si128((__m128i*)(values + i + 12), v3);
+        // Zero lanes become 0xFF bytes after packing, one movemask covers 16 coefficients
+        __m128i z01 = _mm_packs_epi32(_mm_cmpeq_epi32(v0, zero), _mm_cmpeq_epi32(v1, zero));
+        __m128i z23 = _mm_packs_epi32(_mm_cmpeq_epi32(v2, zero), _mm_cmpeq_epi32(v3, zero));
+        uint32_t zeros = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(z01, z23));
+        mask |= (uint64_t)(~zeros & 0xFFFF) << i;
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        values[i] = (int32_t)(block[i]+0.5f);
+        mask |= (uint64_t)(values[i] != 0) << i;
+    }
+#endif
+    return mask;
+}
+
 uint8_t fjpeg_generate_tables(fjpeg_huffman_table_t* output_table, const fjpeg_short_huffman_table_t* data);
 int fjpeg_entropy_encode_block(fjpeg_bitstream* stream, fjpeg_context* context, fjpeg_coeff_t* block, int channel, int last_dc);
+void fjpeg_entropy_encode_mcu_row(fjpeg_bitstream* stream, fjpeg_context* context, int y);
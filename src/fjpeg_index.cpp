@@ -0,0 +1,128 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "fjpeg.h"
+#include "fjpeg_index.h"
+
+static void fjpeg_index_put(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back((uint8_t)(value >> (8 * i)));
+    }
+}
+
+static uint64_t fjpeg_index_get(const uint8_t* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+bool fjpeg_write_row_index(const char* filename, const fjpeg_context* context) {
+    std::vector<uint8_t> out;
+
+    out.insert(out.end(), "FJIX", "FJIX" + 4);
+    fjpeg_index_put(out, FJPEG_INDEX_VERSION, 2);
+    fjpeg_index_put(out, (uint64_t)context->frameWidth(), 2);
+    fjpeg_index_put(out, (uint64_t)context->frameHeight(), 2);
+    fjpeg_index_put(out, (uint64_t)context->mcuSize(), 2);
+    fjpeg_index_put(out, (uint64_t)context->restart_rows, 2);
+    fjpeg_index_put(out, context->row_index.size(), 4);
+
+    for (size_t i = 0; i < context->row_index.size(); i++) {
+        const fjpeg_row_index_t& entry = context->row_index[i];
+        fjpeg_index_put(out, (uint64_t)entry.row, 4);
+        fjpeg_index_put(out, (uint64_t)entry.offset, 8);
+        fjpeg_index_put(out, (uint64_t)entry.bit, 1);
+        for (int c = 0; c < 3; c++) {
+            fjpeg_index_put(out, (uint16_t)(int16_t)entry.dc[c], 2);
+        }
+    }
+
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Unable to open index file %s\n", filename);
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Error: Unable to write index file %s\n", filename);
+    }
+    return ok;
+}
+
+bool fjpeg_load_row_index(const char* filename, fjpeg_row_index_file_t* index) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Unable to open index file %s\n", filename);
+        return false;
+    }
+
+    uint8_t header[18];
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) && memcmp(header, "FJIX", 4) == 0 &&
+              fjpeg_index_get(header + 4, 2) == FJPEG_INDEX_VERSION;
+
+    // The count is only trusted when the entries it promises are exactly what is left of the file
+    const uint32_t count = ok ? (uint32_t)fjpeg_index_get(header + 14, 4) : 0;
+    FJPEG_FSEEK(fp, 0, SEEK_END);
+    const int64_t remaining = FJPEG_FTELL(fp) - (int64_t)sizeof(header);
+    FJPEG_FSEEK(fp, (int64_t)sizeof(header), SEEK_SET);
+    ok = ok && remaining == (int64_t)count * 19;
+
+    std::vector<uint8_t> data(ok ? (size_t)count * 19 : 0);
+    ok = ok && fread(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+
+    if (!ok) {
+        fprintf(stderr, "Error: Invalid index file %s\n", filename);
+        return false;
+    }
+
+    index->width = (int)fjpeg_index_get(header + 6, 2);
+    index->height = (int)fjpeg_index_get(header + 8, 2);
+    index->mcu_size = (int)fjpeg_index_get(header + 10, 2);
+    index->restart_rows = (int)fjpeg_index_get(header + 12, 2);
+    index->entries.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* p = data.data() + (size_t)i * 19;
+        fjpeg_row_index_t& entry = index->entries[i];
+        entry.row = (int64_t)fjpeg_index_get(p, 4);
+        entry.offset = (int64_t)fjpeg_index_get(p + 4, 8);
+        entry.bit = p[12];
+        for (int c = 0; c < 3; c++) {
+            entry.dc[c] = (int16_t)fjpeg_index_get(p + 13 + 2 * c, 2);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,50 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "fjpeg.h"
+
+// Sidecar row index for random access into a scan, all values little endian:
+//   "FJIX", u16 version (1), u16 width, u16 height, u16 MCU size, u16 restart rows, u32 entries
+//   per entry: u32 MCU row, u64 byte offset in the JPEG file, u8 bits of that byte already
+//   used by the previous row, 3 x i16 DC predictors (Y, Cb, Cr)
+// A reader seeks to the offset, skips the bits and decodes with the given predictors
+#define FJPEG_INDEX_VERSION 1
+
+struct fjpeg_row_index_file_t {
+    int width;
+    int height;
+    int mcu_size;
+    int restart_rows;
+    std::vector<fjpeg_row_index_t> entries;
+};
+
+bool fjpeg_write_row_index(const char* filename, const fjpeg_context* context);
+bool fjpeg_load_row_index(const char* filename, fjpeg_row_index_file_t* index);
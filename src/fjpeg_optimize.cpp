@@ -0,0 +1,576 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "fjpeg.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_optimize.h"
+
+// Drop a coefficient when its squared error increase, in quantizer steps, is below
+// this many times the bits it saves, about 2 ln 2 / 12 from the high rate model
+#define FJPEG_QUANT_SEARCH_LAMBDA 0.12f
+
+// Blocks per component the quantization table fit models, spread evenly over the plane
+#define FJPEG_QUANT_FIT_SAMPLES 16384
+
+static const fjpeg_preset_t fjpeg_presets[] = {
+    { "ultrafast", FJPEG_DCT_FAST,      2,  false, 0 },
+    { "fast",      FJPEG_DCT_FAST,      0,  false, 0 },
+    { "medium",    FJPEG_DCT_SEPARABLE, 0,  true,  0 },
+    { "slow",      FJPEG_DCT_SEPARABLE, -1, true,  1 },
+    { "placebo",   FJPEG_DCT_REFERENCE, -1, true,  2 },
+};
+
+int fjpeg_preset_count() {
+    return (int)(sizeof(fjpeg_presets) / sizeof(fjpeg_presets[0]));
+}
+
+const fjpeg_preset_t* fjpeg_preset(int index) {
+    return index >= 0 && index < fjpeg_preset_count() ? &fjpeg_presets[index] : nullptr;
+}
+
+const fjpeg_preset_t* fjpeg_find_preset(const char* name) {
+    for (int i = 0; i < fjpeg_preset_count(); i++) {
+        if (strcmp(fjpeg_presets[i].name, name) == 0) {
+            return &fjpeg_presets[i];
+        }
+    }
+    return nullptr;
+}
+
+void fjpeg_apply_preset(fjpeg_context* context, const fjpeg_preset_t* preset) {
+    context->dct_method = preset->dct_method;
+    context->flat_threshold = preset->flat_threshold;
+    context->optimize_huffman = preset->optimize_huffman;
+    context->quant_search = preset->quant_search;
+}
+
+const char* fjpeg_dct_method_name(int method) {
+    return method == FJPEG_DCT_FAST ? "fast" : method == FJPEG_DCT_SEPARABLE ? "separable" : "reference";
+}
+
+bool fjpeg_optimal_huffman_table(const int64_t* freq_in, fjpeg_short_huffman_table_t* table) {
+    int64_t freq[257];
+    int codesize[257];
+    int others[257];
+    int bits[33];
+
+    memcpy(freq, freq_in, 256 * sizeof(int64_t));
+    // Reserved symbol so no code consists of all 1-bits
+    freq[256] = 1;
+    memset(codesize, 0, sizeof(codesize));
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i < 257; i++) {
+        others[i] = -1;
+    }
+
+    // Merge the two least frequent trees until one is left, ties take the larger symbol
+    for (;;) {
+        int c1 = -1;
+        int c2 = -1;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && (c1 < 0 || freq[i] <= freq[c1])) {
+                c1 = i;
+            }
+        }
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2])) {
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    int used = 0;
+    for (int i = 0; i <= 256; i++) {
+        if (codesize[i]) {
+            if (codesize[i] > 32) {
+                return false;
+            }
+            bits[codesize[i]]++;
+            used++;
+        }
+    }
+    if (used == 0) {
+        return false;
+    }
+
+    // Limit the code lengths to 16 bits
+    for (int i = 32; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // Drop the reserved symbol from the longest length
+    int longest = 16;
+    while (bits[longest] == 0) {
+        longest--;
+    }
+    bits[longest]--;
+
+    memset(table, 0, sizeof(fjpeg_short_huffman_table_t));
+    for (int i = 1; i <= 16; i++) {
+        table->bits[i - 1] = (uint8_t)bits[i];
+    }
+
+    // Symbols sorted by code length, 0xFF terminates the list
+    int count = 0;
+    for (int len = 1; len <= 32; len++) {
+        for (int s = 0; s < 256; s++) {
+            if (codesize[s] == len) {
+                table->val[count++] = (uint8_t)s;
+            }
+        }
+    }
+    table->val[count] = 0xFF;
+
+    return true;
+}
+
+// Symbol counts of one block, last_dc carries the DC prediction
+static inline void fjpeg_count_block(const fjpeg_coeff_t* block, int* last_dc, int64_t* freq_dc, int64_t* freq_ac) {
+    int32_t values[64];
+    const uint64_t nonzero = fjpeg_nonzero_mask(block, values);
+
+    const int diff = values[0] - *last_dc;
+    *last_dc = values[0];
+    freq_dc[fjpeg_bit_length(diff < 0 ? -diff : diff)]++;
+
+    uint64_t ac = nonzero & ~(uint64_t)1;
+    int last = 0;
+    while (ac) {
+        const int i = fjpeg_ctz64(ac);
+        ac &= ac - 1;
+
+        int run_length = i - last - 1;
+        while (run_length >= 16) {
+            freq_ac[0xF0]++;
+            run_length -= 16;
+        }
+        last = i;
+        freq_ac[(run_length << 4) + fjpeg_bit_length(values[i] < 0 ? -values[i] : values[i])]++;
+    }
+    if (last != 63) {
+        freq_ac[0x00]++;
+    }
+}
+
+// Symbol counts of one coefficient plane in coding order, the blocks of a plane
+// are stored in MCU order so a linear walk sees them in the order they are coded,
+// the DC prediction starts over every "interval" blocks when restart markers are written
+static void fjpeg_count_plane(const fjpeg_coeff_t* plane, int64_t blocks, int64_t interval, int64_t* freq_dc, int64_t* freq_ac) {
+    int last_dc = 0;
+
+    for (int64_t b = 0; b < blocks; b++) {
+        if (interval > 0 && b % interval == 0) {
+            last_dc = 0;
+        }
+        fjpeg_count_block(plane + (b << 6), &last_dc, freq_dc, freq_ac);
+    }
+}
+
+// Symbol counts of an oriented frame, the blocks are coded out of plane order so
+// this walks the MCUs of the written frame like the entropy coder does
+template <int CHANNELS>
+static void fjpeg_count_oriented_t(fjpeg_context* context, int64_t* freq) {
+    const int mcu = CHANNELS == 1 ? 8 : 16;
+    const int max_uv = CHANNELS == 1 ? 1 : 2;
+    const int64_t interval = context->restartInterval();
+    fjpeg_coeff_t tmp[64];
+    int last_dc[3] = { 0, 0, 0 };
+    int64_t mcus = 0;
+
+    for (int y = 0; y < context->paddedFrameHeight(); y += mcu) {
+        for (int x = 0; x < context->paddedFrameWidth(); x += mcu) {
+            if (interval > 0 && mcus % interval == 0) {
+                last_dc[0] = last_dc[1] = last_dc[2] = 0;
+            }
+            mcus++;
+
+            for (int v = 0; v < max_uv; v++) {
+                for (int u = 0; u < max_uv; u++) {
+                    fjpeg_count_block(fjpeg_oriented_block_t<0>(context, x + u * 8, y + v * 8, tmp), &last_dc[0], &freq[0], &freq[256]);
+                }
+            }
+            if (CHANNELS == 3) {
+                fjpeg_count_block(fjpeg_oriented_block_t<1>(context, x >> 1, y >> 1, tmp), &last_dc[1], &freq[512], &freq[768]);
+                fjpeg_count_block(fjpeg_oriented_block_t<2>(context, x >> 1, y >> 1, tmp), &last_dc[2], &freq[512], &freq[768]);
+            }
+        }
+    }
+}
+
+// Replace a pair of code tables with the optimal ones for the counts, kept when nothing was counted
+static void fjpeg_install_tables(const int64_t* freq_dc, const int64_t* freq_ac,
+                                 fjpeg_short_huffman_table_t* short_dc, fjpeg_short_huffman_table_t* short_ac,
+                                 fjpeg_huffman_table_t* huff_dc, fjpeg_huffman_table_t* huff_ac) {
+    fjpeg_huffman_table_t table[256];
+
+    if (fjpeg_optimal_huffman_table(freq_dc, short_dc)) {
+        // DC tables only have 12 symbols, generate into a full table and keep the front
+        fjpeg_generate_tables(table, short_dc);
+        memcpy(huff_dc, table, 16 * sizeof(fjpeg_huffman_table_t));
+    }
+    if (fjpeg_optimal_huffman_table(freq_ac, short_ac)) {
+        fjpeg_generate_tables(huff_ac, short_ac);
+    }
+}
+
+static void fjpeg_optimize_huffman(fjpeg_context* context) {
+    std::vector<int64_t> freq(4 * 256, 0);
+    const int64_t luma_blocks = (context->luma_stride * context->paddedHeight()) >> 6;
+
+    // 4:2:0 MCUs hold four luma blocks
+    const int64_t interval = context->restartInterval();
+    const int64_t luma_interval = context->channels == 3 ? interval << 2 : interval;
+
+    if (context->orientation != FJPEG_ORIENT_NORMAL) {
+        if (context->channels == 1) fjpeg_count_oriented_t<1>(context, &freq[0]);
+        else fjpeg_count_oriented_t<3>(context, &freq[0]);
+    } else {
+        fjpeg_count_plane(context->fjpeg_ydct, luma_blocks, luma_interval, &freq[0], &freq[256]);
+        if (context->channels == 3) {
+            fjpeg_count_plane(context->fjpeg_cbdct, luma_blocks >> 2, interval, &freq[512], &freq[768]);
+            fjpeg_count_plane(context->fjpeg_crdct, luma_blocks >> 2, interval, &freq[512], &freq[768]);
+        }
+    }
+
+    fjpeg_install_tables(&freq[0], &freq[256], &context->fjpeg_short_huffman_luma_dc, &context->fjpeg_short_huffman_luma_ac,
+                         context->fjpeg_huffman_luma_dc, context->fjpeg_huffman_luma_ac);
+    if (context->channels == 3) {
+        fjpeg_install_tables(&freq[512], &freq[768], &context->fjpeg_short_huffman_chroma_dc, &context->fjpeg_short_huffman_chroma_ac,
+                             context->fjpeg_huffman_chroma_dc, context->fjpeg_huffman_chroma_ac);
+    }
+}
+
+// Zero trailing +-1 coefficients of each block while the squared error they add costs
+// less than the bits they take with the current code tables, the added error goes into
+// the distortion estimate
+static void fjpeg_quant_search_plane(fjpeg_coeff_t* plane, int64_t blocks, const fjpeg_huffman_table_t* huff_ac,
+                                     const uint8_t* quant_table, std::atomic<int64_t>* distortion) {
+    int32_t values[64];
+    float step[64];
+    double added = 0.0;
+
+    for (int i = 0; i < 64; i++) {
+        step[fjpeg_zigzag_8x8[i]] = (float)quant_table[i];
+    }
+
+    for (int64_t b = 0; b < blocks; b++) {
+        fjpeg_coeff_t* block = plane + (b << 6);
+        uint64_t nonzero = fjpeg_nonzero_mask(block, values) & ~(uint64_t)1;
+
+        while (nonzero) {
+            const int last = 63 - fjpeg_clz64(nonzero);
+            if (values[last] != 1 && values[last] != -1) {
+                break;
+            }
+            const uint64_t rest = nonzero & ~((uint64_t)1 << last);
+            const int prev = rest ? 63 - fjpeg_clz64(rest) : 0;
+            const int run_length = last - prev - 1;
+
+            // Bits of the ZRLs, the run/size code and the sign bit, a block ending on
+            // coefficient 63 starts to need an EOB
+            int saved = (run_length >> 4) * huff_ac[0xF0].len + huff_ac[((run_length & 15) << 4) + 1].len + 1;
+            if (last == 63) {
+                if (huff_ac[0x00].len == 0) {
+                    break;
+                }
+                saved -= huff_ac[0x00].len;
+            }
+
+            // Both sides scale with the squared step, compare in quantizer steps
+            const float x = block[last];
+            const float error = x - (float)values[last];
+            if (x * x - error * error >= FJPEG_QUANT_SEARCH_LAMBDA * saved) {
+                break;
+            }
+
+            block[last] = 0.0f;
+            nonzero = rest;
+            added += (x * x - error * error) * step[last] * step[last];
+        }
+    }
+
+    *distortion += (int64_t)(added * 256.0 + 0.5);
+}
+
+static void fjpeg_quant_search(fjpeg_context* context) {
+    const int64_t luma_blocks = (context->luma_stride * context->paddedHeight()) >> 6;
+
+    fjpeg_quant_search_plane(context->fjpeg_ydct, luma_blocks, context->fjpeg_huffman_luma_ac,
+                             context->fjpeg_luminance_quantization_table, &context->distortion[0]);
+    if (context->channels == 3) {
+        fjpeg_quant_search_plane(context->fjpeg_cbdct, luma_blocks >> 2, context->fjpeg_huffman_chroma_ac,
+                                 context->fjpeg_chrominance_quantization_table, &context->distortion[1]);
+        fjpeg_quant_search_plane(context->fjpeg_crdct, luma_blocks >> 2, context->fjpeg_huffman_chroma_ac,
+                                 context->fjpeg_chrominance_quantization_table, &context->distortion[2]);
+    }
+}
+
+void fjpeg_optimize_frame(fjpeg_context* context) {
+    // Arithmetic coding adapts by itself, only the coefficient search applies there, and
+    // abbreviated frames have to keep the codes of the shared tables stream
+    const bool huffman = context->optimize_huffman && !context->arithmetic && !context->abbreviated;
+
+    // Every search pass after the first uses the code lengths fitted to the previous result
+    for (int pass = 0; pass < context->quant_search; pass++) {
+        if (pass > 0 && huffman) {
+            fjpeg_optimize_huffman(context);
+        }
+        fjpeg_quant_search(context);
+    }
+
+    if (huffman) {
+        fjpeg_optimize_huffman(context);
+    }
+}
+
+// Squared error and zeroth order entropy in bits of one frequency quantized with "step",
+// rounded the way the entropy coders round
+static void fjpeg_quant_fit_cost(const std::vector<float>& values, int step, std::vector<int>& histogram,
+                                 double* error, double* bits) {
+    const int offset = (int)histogram.size() / 2;
+    std::fill(histogram.begin(), histogram.end(), 0);
+
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); i++) {
+        const int level = (int)(values[i] / (float)step + 0.5f);
+        const double e = values[i] - (double)level * step;
+        sum += e * e;
+        histogram[FJPEG_CLAMP(level + offset, 0, (int)histogram.size() - 1)]++;
+    }
+
+    double entropy = values.empty() ? 0.0 : (double)values.size() * std::log2((double)values.size());
+    for (size_t i = 0; i < histogram.size(); i++) {
+        if (histogram[i] > 1) {
+            entropy -= histogram[i] * std::log2((double)histogram[i]);
+        }
+    }
+    *error = sum;
+    *bits = entropy;
+}
+
+// Every frequency of a table: the sampled coefficients and their cost at each candidate step
+struct fjpeg_quant_fit_t {
+    std::vector<float> values[64];
+    std::vector<double> error;
+    std::vector<double> bits;
+    int64_t blocks;
+};
+
+static void fjpeg_quant_fit_sample(const fjpeg_coeff_t* plane, int64_t blocks, fjpeg_quant_fit_t* fit) {
+    const int64_t interval = blocks > FJPEG_QUANT_FIT_SAMPLES ? blocks / FJPEG_QUANT_FIT_SAMPLES : 1;
+
+    for (int64_t b = 0; b < blocks; b += interval) {
+        const fjpeg_coeff_t* block = plane + (b << 6);
+        for (int k = 0; k < 64; k++) {
+            fit->values[k].push_back(block[k]);
+        }
+        fit->blocks++;
+    }
+}
+
+// Candidate steps get coarser as they grow, the error curve flattens out there
+static int fjpeg_quant_fit_steps(int* steps) {
+    int count = 0;
+    for (int step = 1; step <= 255;) {
+        steps[count++] = step;
+        step += step < 16 ? 1 : step < 32 ? 2 : step < 64 ? 4 : step < 128 ? 8 : 16;
+    }
+    return count;
+}
+
+static void fjpeg_quant_fit_model(fjpeg_quant_fit_t* fit, const int* steps, int count) {
+    std::vector<int> histogram(8192);
+    fit->error.resize(64 * count);
+    fit->bits.resize(64 * count);
+
+    for (int k = 0; k < 64; k++) {
+        for (int s = 0; s < count; s++) {
+            fjpeg_quant_fit_cost(fit->values[k], steps[s], histogram, &fit->error[k * count + s], &fit->bits[k * count + s]);
+        }
+    }
+}
+
+// Pick the step of every frequency minimizing error + lambda * bits, returns the error
+static double fjpeg_quant_fit_select(const fjpeg_quant_fit_t* fit, const int* steps, int count, double lambda,
+                                     uint8_t* table, double* bits) {
+    double error = 0.0;
+    for (int k = 0; k < 64; k++) {
+        int best = 0;
+        for (int s = 1; s < count; s++) {
+            if (fit->error[k * count + s] + lambda * fit->bits[k * count + s] <
+                fit->error[k * count + best] + lambda * fit->bits[k * count + best]) {
+                best = s;
+            }
+        }
+        table[k] = (uint8_t)steps[best];
+        error += fit->error[k * count + best];
+        *bits += fit->bits[k * count + best];
+    }
+    return error;
+}
+
+// Error and bits of a fixed table, for the comparison with the scaled Annex K tables
+static double fjpeg_quant_fit_table(const fjpeg_quant_fit_t* fit, const uint8_t* table, double* bits) {
+    std::vector<int> histogram(8192);
+    double error = 0.0;
+    for (int k = 0; k < 64; k++) {
+        double e, b;
+        fjpeg_quant_fit_cost(fit->values[k], table[k], histogram, &e, &b);
+        error += e;
+        *bits += b;
+    }
+    return error;
+}
+
+static void fjpeg_quant_fit_scale(const uint8_t* base, int quality, uint8_t* table) {
+    for (int i = 0; i < 64; i++) {
+        const int scaled = ((int32_t)base[i] * (100-quality) + FJPEG_Q_FACTOR_SCALE / 2) / FJPEG_Q_FACTOR_SCALE;
+        table[i] = (uint8_t)FJPEG_CLAMP(scaled, 1, 255);
+    }
+}
+
+bool fjpeg_optimize_quantization(fjpeg_context* context) {
+    const int64_t luma_blocks = (context->luma_stride * context->paddedHeight()) >> 6;
+
+    for (int y = 0; y < context->paddedHeight(); y += context->mcuSize()) {
+        fjpeg_dct_mcu_row(context, y);
+    }
+
+    // Cb and Cr share the chroma table, their samples are modelled together
+    fjpeg_quant_fit_t luma, chroma;
+    luma.blocks = chroma.blocks = 0;
+    fjpeg_quant_fit_sample(context->fjpeg_ydct, luma_blocks, &luma);
+    if (context->channels == 3) {
+        fjpeg_quant_fit_sample(context->fjpeg_cbdct, luma_blocks >> 2, &chroma);
+        fjpeg_quant_fit_sample(context->fjpeg_crdct, luma_blocks >> 2, &chroma);
+    }
+
+    int steps[64];
+    const int count = fjpeg_quant_fit_steps(steps);
+    fjpeg_quant_fit_model(&luma, steps, count);
+    fjpeg_quant_fit_model(&chroma, steps, count);
+
+    // Squared error budget of the luma samples, 255^2 / 10^(psnr / 10) per pixel
+    const double budget = 65025.0 / std::pow(10.0, context->target_psnr / 10.0) * (double)(luma.blocks * 64);
+
+    // The error grows with lambda, bisect it on a log scale for the largest one within budget,
+    // chroma uses the same lambda so both tables sit at the same slope
+    uint8_t luma_table[64], chroma_table[64];
+    double low = -10.0, high = 20.0;
+    for (int i = 0; i < 40; i++) {
+        const double mid = (low + high) / 2.0;
+        double bits = 0.0;
+        if (fjpeg_quant_fit_select(&luma, steps, count, std::exp2(mid), luma_table, &bits) <= budget) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    double bits = 0.0;
+    fjpeg_quant_fit_select(&luma, steps, count, std::exp2(low), luma_table, &bits);
+    if (context->channels == 3) {
+        fjpeg_quant_fit_select(&chroma, steps, count, std::exp2(low), chroma_table, &bits);
+    } else {
+        memcpy(chroma_table, context->fjpeg_chrominance_quantization_table, 64);
+    }
+
+    // Fall back to the lowest quality of the scaled Annex K tables that meets the target
+    // when the model expects those to be smaller, the fitted steps are not always better
+    // once the DC prediction and run lengths the model ignores come in
+    int quality = 100;
+    for (int lo = 1, hi = 100; lo <= hi;) {
+        const int mid = (lo + hi) / 2;
+        uint8_t table[64];
+        double ignored = 0.0;
+        fjpeg_quant_fit_scale(fjpeg_annexk_luma_quant_table, mid, table);
+        if (fjpeg_quant_fit_table(&luma, table, &ignored) <= budget) {
+            quality = mid;
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    uint8_t annexk_luma[64], annexk_chroma[64];
+    fjpeg_quant_fit_scale(fjpeg_annexk_luma_quant_table, quality, annexk_luma);
+    fjpeg_quant_fit_scale(fjpeg_default_chroma_quant_table, quality, annexk_chroma);
+    double annexk_bits = 0.0;
+    fjpeg_quant_fit_table(&luma, annexk_luma, &annexk_bits);
+    if (context->channels == 3) {
+        fjpeg_quant_fit_table(&chroma, annexk_chroma, &annexk_bits);
+    }
+
+    if (annexk_bits < bits) {
+        memcpy(luma_table, annexk_luma, 64);
+        if (context->channels == 3) {
+            memcpy(chroma_table, annexk_chroma, 64);
+        }
+    }
+
+    memcpy(context->fjpeg_luminance_quantization_table, luma_table, 64);
+    memcpy(context->fjpeg_chrominance_quantization_table, chroma_table, 64);
+
+    context->resetDistortion();
+    for (int y = 0; y < context->paddedHeight(); y += context->mcuSize()) {
+        fjpeg_quant_mcu_row(context, context, y);
+    }
+
+    return true;
+}
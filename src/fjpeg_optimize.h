@@ -0,0 +1,59 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+
+#include "fjpeg.h"
+
+// Named trade-offs between encode time and output size, from ultrafast to placebo
+typedef struct {
+    const char* name;
+    int dct_method;        // FJPEG_DCT_*
+    int flat_threshold;    // see fjpeg_context::flat_threshold
+    bool optimize_huffman;
+    int quant_search;      // rate-distortion passes
+} fjpeg_preset_t;
+
+int fjpeg_preset_count();
+const fjpeg_preset_t* fjpeg_preset(int index);
+const fjpeg_preset_t* fjpeg_find_preset(const char* name);
+void fjpeg_apply_preset(fjpeg_context* context, const fjpeg_preset_t* preset);
+const char* fjpeg_dct_method_name(int method);
+
+// Effort passes over the coefficients of a fully transformed frame before it is
+// entropy coded, a no-op unless optimize_huffman or quant_search is set
+void fjpeg_optimize_frame(fjpeg_context* context);
+
+// Build the optimal length limited code for the symbol counts (JPEG Annex K.2),
+// symbols with zero count get no code, returns false when no symbol is used
+bool fjpeg_optimal_huffman_table(const int64_t* freq, fjpeg_short_huffman_table_t* table);
+
+// Fit both quantization tables to the frame: transform it, model the squared error and
+// the bits of every frequency at each candidate step from the coefficients, pick the steps
+// with the smallest bits for context->target_psnr and quantize with them
+bool fjpeg_optimize_quantization(fjpeg_context* context);
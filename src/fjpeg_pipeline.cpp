@@ -0,0 +1,153 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_pipeline.h"
+
+static int64_t fjpeg_elapsed_us(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+bool fjpeg_pipeline::run(fjpeg_pipeline_read_t read, fjpeg_pipeline_write_t write, void* user) {
+
+    const int slot_count = FJPEG_MAX(buffers, encoders + 1);
+    std::vector<fjpeg_frame*> slots;
+    fjpeg_queue<fjpeg_frame*> free_queue(slot_count);
+    fjpeg_queue<fjpeg_frame*> encode_queue(slot_count);
+    fjpeg_queue<fjpeg_frame*> write_queue(slot_count);
+    std::atomic<int64_t> read_us(0);
+    std::atomic<int64_t> encode_us(0);
+    std::atomic<int> encoders_running(encoders);
+
+    // Frame buffers are allocated once and cycle through the stages
+    for (int i = 0; i < slot_count; i++) {
+        fjpeg_frame* frame = new fjpeg_frame();
+        frame->context.setQuality(quality);
+        frame->context.abbreviated = abbreviated;
+        frame->context.arithmetic = arithmetic;
+        frame->context.restart_rows = restart_rows;
+        if (preset) {
+            fjpeg_apply_preset(&frame->context, preset);
+        }
+        slots.push_back(frame);
+        free_queue.push(frame);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::thread reader([&] {
+        fjpeg_frame* frame;
+        int64_t index = 0;
+        while (free_queue.pop(frame)) {
+            auto t = std::chrono::high_resolution_clock::now();
+            bool ok = read(user, frame);
+            read_us += fjpeg_elapsed_us(t);
+            if (!ok) {
+                break;
+            }
+            frame->index = index++;
+            if (!encode_queue.push(frame)) {
+                break;
+            }
+        }
+        encode_queue.close();
+    });
+
+    std::vector<std::thread> encoder_threads;
+    for (int i = 0; i < encoders; i++) {
+        encoder_threads.push_back(std::thread([&] {
+            fjpeg_frame* frame;
+            while (encode_queue.pop(frame)) {
+                auto t = std::chrono::high_resolution_clock::now();
+                frame->jpeg.data.clear();
+                fjpeg_bitstream stream(&frame->jpeg);
+                frame->ok = fjpeg_encode_frame(&stream, &frame->context);
+                encode_us += fjpeg_elapsed_us(t);
+                if (!write_queue.push(frame)) {
+                    break;
+                }
+            }
+            if (--encoders_running == 0) {
+                write_queue.close();
+            }
+        }));
+    }
+
+    // Writer runs on the calling thread and restores the input order
+    std::map<int64_t, fjpeg_frame*> pending;
+    int64_t next = 0;
+    fjpeg_frame* frame;
+    while (!failed && write_queue.pop(frame)) {
+        pending[frame->index] = frame;
+        while (!pending.empty() && pending.begin()->first == next) {
+            fjpeg_frame* ready = pending.begin()->second;
+            pending.erase(pending.begin());
+
+            auto t = std::chrono::high_resolution_clock::now();
+            if (!ready->ok || !write(user, ready)) {
+                failed = true;
+            }
+            time_write_us += fjpeg_elapsed_us(t);
+
+            frames++;
+            bytes += (int64_t)ready->jpeg.data.size();
+            next++;
+            free_queue.push(ready);
+        }
+    }
+
+    if (failed) {
+        encode_queue.close();
+        write_queue.close();
+    }
+    free_queue.close();
+
+    reader.join();
+    for (size_t i = 0; i < encoder_threads.size(); i++) {
+        encoder_threads[i].join();
+    }
+
+    time_total_us = fjpeg_elapsed_us(start);
+    time_read_us = read_us;
+    time_encode_us = encode_us;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        delete slots[i];
+    }
+
+    return !failed;
+}
@@ -0,0 +1,80 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_thread.h"
+#include "fjpeg_optimize.h"
+
+// One recycled frame buffer, the context owns the planes and the sink collects the JPEG
+class fjpeg_frame {
+    public:
+    int64_t index;
+    fjpeg_context context;
+    fjpeg_memory_sink jpeg;
+    bool ok;
+
+    fjpeg_frame() : index(0), ok(false) {}
+};
+
+// Reader fills frame->context planes and returns false at the end of the input,
+// writer receives the finished frames in input order and returns false to abort
+typedef bool (*fjpeg_pipeline_read_t)(void* user, fjpeg_frame* frame);
+typedef bool (*fjpeg_pipeline_write_t)(void* user, fjpeg_frame* frame);
+
+// Read / encode / write stages on separate threads connected by bounded queues
+class fjpeg_pipeline {
+    public:
+    int quality;
+    int buffers;
+    int encoders;
+    // Frames leave their tables out, see fjpeg_context::abbreviated
+    bool abbreviated;
+    // Coding settings of every frame context, the preset is applied when set
+    bool arithmetic;
+    int restart_rows;
+    const fjpeg_preset_t* preset;
+
+    // Busy time per stage, the slowest one bounds the throughput
+    int64_t time_read_us;
+    int64_t time_encode_us;
+    int64_t time_write_us;
+    int64_t time_total_us;
+    int64_t frames;
+    int64_t bytes;
+    bool failed;
+
+    fjpeg_pipeline(int quality, int buffers, int encoders) : quality(quality), buffers(buffers), encoders(encoders), abbreviated(false),
+        arithmetic(false), restart_rows(0), preset(nullptr),
+        time_read_us(0), time_encode_us(0), time_write_us(0), time_total_us(0), frames(0), bytes(0), failed(false) {}
+
+    bool run(fjpeg_pipeline_read_t read, fjpeg_pipeline_write_t write, void* user);
+};
@@ -0,0 +1,199 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_scale.h"
+
+// Block mean from the quantized DC as a decoder would reconstruct it, DC = 8 * (mean - 128)
+static fjpeg_pixel_t fjpeg_dc_to_pixel(fjpeg_coeff_t dc, uint8_t quant) {
+    const int value = (int)(dc + 0.5f) * quant;
+    return (fjpeg_pixel_t)FJPEG_CLAMP((value + 4 * (value >= 0 ? 1 : -1)) / 8 + 128, 0, 255);
+}
+
+bool fjpeg_generate_thumbnail(fjpeg_context* context, int quality, std::vector<uint8_t>* jpeg) {
+    fjpeg_context thumb;
+    fjpeg_coeff_t block[64];
+
+    thumb.channels = context->channels;
+    const int width = (context->width + 7) / 8;
+    const int height = (context->height + 7) / 8;
+    const int chroma_width = (width + 1) >> 1;
+    const int chroma_height = (height + 1) >> 1;
+
+    std::vector<fjpeg_pixel_t> y((size_t)width * height);
+    std::vector<fjpeg_pixel_t> cb((size_t)chroma_width * chroma_height, 128);
+    std::vector<fjpeg_pixel_t> cr((size_t)chroma_width * chroma_height, 128);
+
+    for (int by = 0; by < height; by++) {
+        for (int bx = 0; bx < width; bx++) {
+            fjpeg_extract_coeff_8x8(context, block, bx * 8, by * 8, 0);
+            y[(size_t)by * width + bx] = fjpeg_dc_to_pixel(block[0], context->fjpeg_luminance_quantization_table[0]);
+        }
+    }
+
+    if (context->channels == 3) {
+        for (int by = 0; by < chroma_height; by++) {
+            for (int bx = 0; bx < chroma_width; bx++) {
+                fjpeg_extract_coeff_8x8(context, block, bx * 8, by * 8, 1);
+                cb[(size_t)by * chroma_width + bx] = fjpeg_dc_to_pixel(block[0], context->fjpeg_chrominance_quantization_table[0]);
+                fjpeg_extract_coeff_8x8(context, block, bx * 8, by * 8, 2);
+                cr[(size_t)by * chroma_width + bx] = fjpeg_dc_to_pixel(block[0], context->fjpeg_chrominance_quantization_table[0]);
+            }
+        }
+    }
+
+    if (!thumb.setQuality(quality) || !thumb.loadFrame(y.data(), cb.data(), cr.data(), width, height)) {
+        return false;
+    }
+
+    fjpeg_memory_sink sink;
+    fjpeg_bitstream stream(&sink);
+    if (!fjpeg_encode_frame(&stream, &thumb)) {
+        return false;
+    }
+
+    jpeg->swap(sink.data);
+    return true;
+}
+
+// Orthonormal n-point DCT-II basis, basis[u][x]
+static void fjpeg_dct_basis(int n, float basis[8][8]) {
+    for (int u = 0; u < n; u++) {
+        const float cu = u == 0 ? sqrtf(1.f / n) : sqrtf(2.f / n);
+        for (int x = 0; x < n; x++) {
+            basis[u][x] = cu * cosf((2.f * x + 1.f) * u * (float)M_PI / (2.f * n));
+        }
+    }
+}
+
+// Downscale one channel. Every output block is built from scale x scale source blocks,
+// each contributing its low n x n coefficients through
+//   out = sum T_j (L_ij / scale) T_i^T,  T_k = C8 * E_k * Cn^T
+// where E_k places the n pixels of an n-point IDCT at offset k*n inside the 8 pixel block
+static void fjpeg_downscale_channel(fjpeg_context* context, fjpeg_context* level, int channel, int scale) {
+    const int n = 8 / scale;
+    float c8[8][8];
+    float cn[8][8];
+    float t[8][8][8]; // t[k][u][m]
+    fjpeg_coeff_t block[64];
+    fjpeg_coeff_t raster[64];
+    fjpeg_coeff_t out[64];
+    fjpeg_coeff_t quant[64];
+
+    fjpeg_dct_basis(8, c8);
+    fjpeg_dct_basis(n, cn);
+    for (int k = 0; k < scale; k++) {
+        for (int u = 0; u < 8; u++) {
+            for (int m = 0; m < n; m++) {
+                float sum = 0.f;
+                for (int x = 0; x < n; x++) {
+                    sum += c8[u][k * n + x] * cn[m][x];
+                }
+                t[k][u][m] = sum;
+            }
+        }
+    }
+
+    const uint8_t* src_quant = channel == 0 ? context->fjpeg_luminance_quantization_table : context->fjpeg_chrominance_quantization_table;
+    const int src_blocks_x = (channel == 0 ? context->paddedWidth() : context->paddedWidth() / 2) / 8;
+    const int src_blocks_y = (channel == 0 ? context->paddedHeight() : context->paddedHeight() / 2) / 8;
+    const int blocks_x = (channel == 0 ? level->paddedWidth() : level->paddedWidth() / 2) / 8;
+    const int blocks_y = (channel == 0 ? level->paddedHeight() : level->paddedHeight() / 2) / 8;
+
+    for (int by = 0; by < blocks_y; by++) {
+        for (int bx = 0; bx < blocks_x; bx++) {
+            memset(out, 0, sizeof(out));
+
+            for (int j = 0; j < scale; j++) {
+                for (int i = 0; i < scale; i++) {
+                    // Edge blocks are replicated where the padded level extends past the source
+                    const int sx = FJPEG_MIN(bx * scale + i, src_blocks_x - 1);
+                    const int sy = FJPEG_MIN(by * scale + j, src_blocks_y - 1);
+                    fjpeg_extract_coeff_8x8(context, block, sx * 8, sy * 8, channel);
+                    fjpeg_izigzag8x8(block, raster);
+
+                    // tmp = T_j * L, 8 x n
+                    float tmp[8][8];
+                    for (int v = 0; v < 8; v++) {
+                        for (int b = 0; b < n; b++) {
+                            float sum = 0.f;
+                            for (int a = 0; a < n; a++) {
+                                sum += t[j][v][a] * (int)(raster[a * 8 + b] + 0.5f) * src_quant[a * 8 + b];
+                            }
+                            tmp[v][b] = sum / scale;
+                        }
+                    }
+
+                    // out += tmp * T_i^T
+                    for (int v = 0; v < 8; v++) {
+                        for (int u = 0; u < 8; u++) {
+                            float sum = 0.f;
+                            for (int b = 0; b < n; b++) {
+                                sum += tmp[v][b] * t[i][u][b];
+                            }
+                            out[v * 8 + u] += sum;
+                        }
+                    }
+                }
+            }
+
+            fjpeg_quant8x8(level, out, quant, channel);
+            fjpeg_zigzag8x8(quant, out);
+            fjpeg_store_coeff_8x8(level, out, bx * 8, by * 8, channel);
+        }
+    }
+}
+
+bool fjpeg_generate_downscaled(fjpeg_context* context, int scale, int quality, fjpeg_output_sink* sink) {
+    if (scale != 2 && scale != 4 && scale != 8) {
+        return false;
+    }
+
+    fjpeg_context level;
+    level.channels = context->channels;
+    level.width = (context->width + scale - 1) / scale;
+    level.height = (context->height + scale - 1) / scale;
+
+    if (!level.setQuality(quality) || !level.allocPlanes(level.paddedHeight(), false)) {
+        return false;
+    }
+
+    for (int channel = 0; channel < context->channels; channel++) {
+        fjpeg_downscale_channel(context, &level, channel, scale);
+    }
+
+    fjpeg_bitstream stream(sink);
+    return fjpeg_generate_header(&stream, &level) && !stream.failed;
+}
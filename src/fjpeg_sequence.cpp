@@ -0,0 +1,169 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_sequence.h"
+
+// Compare 64 bytes per step, bails out at the first differing step
+static bool fjpeg_planes_equal(const fjpeg_pixel_t* a, const fjpeg_pixel_t* b, size_t size) {
+#ifdef FJPEG_SSE2
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        const __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        const __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        const __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        const __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3))) != 0xFFFF) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, size - i) == 0;
+#else
+    return memcmp(a, b, size) == 0;
+#endif
+}
+
+void fjpeg_sequence_encoder::reset() {
+    segments.clear();
+    previous_y.clear();
+    previous_cb.clear();
+    previous_cr.clear();
+}
+
+bool fjpeg_sequence_encoder::encodeFrame(fjpeg_bitstream* stream, const fjpeg_rect_t* dirty, int dirty_count) {
+    // Cached bytes are only valid with the same tables, so no per frame Huffman optimization
+    if (context->restart_rows < 1) {
+        context->restart_rows = 1;
+    }
+    context->optimize_huffman = false;
+    context->quant_search = 0;
+
+    if (context->restartInterval() > 65535) {
+        fprintf(stderr, "Error: Restart interval of %lld MCUs is too long\n", (long long)context->restartInterval());
+        return false;
+    }
+
+    if (context->width != width || context->height != height || context->quality != quality ||
+        context->restart_rows != restart_rows || context->arithmetic != arithmetic) {
+        reset();
+        width = context->width;
+        height = context->height;
+        quality = context->quality;
+        restart_rows = context->restart_rows;
+        arithmetic = context->arithmetic;
+    }
+
+    const int mcu = context->mcuSize();
+    const int64_t lines = (int64_t)restart_rows * mcu;
+    const int64_t count = (context->paddedHeight() + lines - 1) / lines;
+    const int64_t luma_size = context->luma_stride * context->paddedHeight();
+    const int64_t chroma_size = context->channels == 3 ? context->chroma_stride * (context->paddedHeight() >> 1) : 0;
+
+    bool primed = !segments.empty();
+    if (!primed) {
+        segments.assign((size_t)count, std::vector<uint8_t>());
+        previous_y.resize((size_t)luma_size);
+        previous_cb.resize((size_t)chroma_size);
+        previous_cr.resize((size_t)chroma_size);
+    }
+
+    // Restart intervals touched by the caller's rectangles
+    std::vector<char> marked;
+    if (dirty_count >= 0) {
+        marked.assign((size_t)count, 0);
+        for (int i = 0; i < dirty_count; i++) {
+            if (dirty[i].width <= 0 || dirty[i].height <= 0) {
+                continue;
+            }
+            const int64_t first = FJPEG_MAX((int64_t)dirty[i].y, (int64_t)0) / lines;
+            const int64_t last = FJPEG_MIN((int64_t)dirty[i].y + dirty[i].height - 1, (int64_t)context->paddedHeight() - 1) / lines;
+            for (int64_t s = first; s <= last; s++) {
+                marked[(size_t)s] = 1;
+            }
+        }
+    }
+
+    fjpeg_write_headers(stream, context);
+    fjpeg_entropy_begin(stream, context);
+
+    for (int64_t s = 0; s < count; s++) {
+        const int64_t y0 = s * lines;
+        const int64_t y1 = FJPEG_MIN(y0 + lines, (int64_t)context->paddedHeight());
+        const int64_t luma_offset = y0 * context->luma_stride;
+        const int64_t luma_bytes = (y1 - y0) * context->luma_stride;
+        const int64_t chroma_offset = (y0 >> 1) * context->chroma_stride;
+        const int64_t chroma_bytes = context->channels == 3 ? ((y1 - y0) >> 1) * context->chroma_stride : 0;
+
+        std::vector<uint8_t>& segment = segments[(size_t)s];
+        bool changed = !primed || segment.empty();
+        if (!changed && dirty_count >= 0) {
+            changed = marked[(size_t)s] != 0;
+        } else if (!changed) {
+            changed = !fjpeg_planes_equal(context->fjpeg_y + luma_offset, &previous_y[(size_t)luma_offset], (size_t)luma_bytes) ||
+                      !fjpeg_planes_equal(context->fjpeg_cb + chroma_offset, previous_cb.data() + chroma_offset, (size_t)chroma_bytes) ||
+                      !fjpeg_planes_equal(context->fjpeg_cr + chroma_offset, previous_cr.data() + chroma_offset, (size_t)chroma_bytes);
+        }
+
+        if (changed) {
+            // Segments start on a byte boundary, so the coded bytes are the buffer tail
+            const size_t start = stream->buffer.size();
+            for (int64_t y = y0; y < y1; y += mcu) {
+                fjpeg_transquant_mcu_row(context, (int)y);
+                fjpeg_entropy_encode_mcu_row(stream, context, (int)y);
+            }
+            fjpeg_entropy_close_segment(stream, context);
+            segment.assign(stream->buffer.begin() + start, stream->buffer.end());
+
+            memcpy(&previous_y[(size_t)luma_offset], context->fjpeg_y + luma_offset, (size_t)luma_bytes);
+            memcpy(previous_cb.data() + chroma_offset, context->fjpeg_cb + chroma_offset, (size_t)chroma_bytes);
+            memcpy(previous_cr.data() + chroma_offset, context->fjpeg_cr + chroma_offset, (size_t)chroma_bytes);
+            segments_coded++;
+        } else {
+            stream->writeRawBytes(segment.data(), segment.size());
+            segments_reused++;
+        }
+
+        stream->avoidFF = false;
+        if (s + 1 < count) {
+            stream->writeBits(0xFFD0 + (uint32_t)(s & 7), 16);
+            fjpeg_entropy_begin(stream, context);
+        }
+    }
+
+    // The last interval is already closed, only EOI is left
+    stream->writeBits(0xFFD9, 16);
+    stream->flushToFile();
+
+    return !stream->failed;
+}
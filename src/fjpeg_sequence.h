@@ -0,0 +1,75 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+
+// Changed area of a frame in luma pixels
+struct fjpeg_rect_t {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Sequence encoder for screen capture and fixed cameras, the frame is coded in restart
+// intervals and an interval whose pixels did not change since the previous frame is
+// copied from that frame's entropy coded bytes instead of being transformed and coded again
+class fjpeg_sequence_encoder {
+    public:
+    fjpeg_context* context;
+
+    // Padded planes of the previous frame and the coded bytes of each restart interval
+    std::vector<fjpeg_pixel_t> previous_y;
+    std::vector<fjpeg_pixel_t> previous_cb;
+    std::vector<fjpeg_pixel_t> previous_cr;
+    std::vector<std::vector<uint8_t> > segments;
+
+    // Settings the cached segments were coded with
+    int width;
+    int height;
+    int quality;
+    int restart_rows;
+    bool arithmetic;
+
+    int64_t segments_reused;
+    int64_t segments_coded;
+
+    fjpeg_sequence_encoder(fjpeg_context* context) : context(context), width(0), height(0), quality(0), restart_rows(0),
+        arithmetic(false), segments_reused(0), segments_coded(0) {}
+
+    // Encode the frame loaded in the context planes, unchanged intervals are found by comparing
+    // against the previous frame unless the caller passes the dirty rectangles (dirty_count >= 0)
+    bool encodeFrame(fjpeg_bitstream* stream, const fjpeg_rect_t* dirty = nullptr, int dirty_count = -1);
+
+    // Drop the cached segments, the next frame is coded in full
+    void reset();
+};
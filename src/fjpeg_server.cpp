@@ -0,0 +1,450 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_thread.h"
+#include "fjpeg_server.h"
+#include "fjpeg_cache.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static volatile sig_atomic_t fjpeg_server_stop = 0;
+
+static void fjpeg_server_signal(int) {
+    fjpeg_server_stop = 1;
+}
+
+static bool fjpeg_recv_all(int fd, void* data, size_t size) {
+    uint8_t* ptr = (uint8_t*)data;
+    while (size > 0) {
+        ssize_t got = recv(fd, ptr, size, 0);
+        if (got <= 0) {
+            return false;
+        }
+        ptr += got;
+        size -= (size_t)got;
+    }
+    return true;
+}
+
+static bool fjpeg_send_all(int fd, const void* data, size_t size) {
+    const uint8_t* ptr = (const uint8_t*)data;
+    while (size > 0) {
+        ssize_t sent = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        ptr += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+// Receive the request header, a passed descriptor arrives with its first byte, only the
+// first one is kept and any others sent along are closed right away
+static bool fjpeg_recv_request(int fd, fjpeg_server_request_t* request, int* passed_fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = request;
+    iov.iov_len = sizeof(*request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *passed_fd = -1;
+    ssize_t got = recvmsg(fd, &msg, 0);
+    if (got <= 0) {
+        return false;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++) {
+                int received;
+                memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (*passed_fd < 0) {
+                    *passed_fd = received;
+                } else {
+                    close(received);
+                }
+            }
+        }
+    }
+
+    if (!fjpeg_recv_all(fd, (uint8_t*)request + got, sizeof(*request) - (size_t)got)) {
+        if (*passed_fd >= 0) {
+            close(*passed_fd);
+            *passed_fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool fjpeg_send_request(int fd, const fjpeg_server_request_t* request, int passed_fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = (void*)request;
+    iov.iov_len = sizeof(*request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (passed_fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+    }
+
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return false;
+    }
+    return fjpeg_send_all(fd, (const uint8_t*)request + sent, sizeof(*request) - (size_t)sent);
+}
+
+static bool fjpeg_server_valid_request(const fjpeg_server_request_t* request, uint64_t max_frame_bytes) {
+    return request->size <= max_frame_bytes &&
+           request->magic == FJPEG_SERVER_REQUEST_MAGIC &&
+           request->width >= 1 && request->width <= 65535 &&
+           request->height >= 1 && request->height <= 65535 &&
+           request->quality >= 1 && request->quality <= 100 &&
+           request->size == (uint64_t)fjpeg_context::frameSize(request->width, request->height);
+}
+
+class fjpeg_server_connection {
+    public:
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done;
+
+    fjpeg_server_connection(int fd) : fd(fd), done(false) {}
+};
+
+// Serve requests of one client until it disconnects
+static void fjpeg_server_client(fjpeg_server_connection* connection, fjpeg_queue<fjpeg_context*>* pool, fjpeg_cache* cache,
+                                uint64_t max_frame_bytes, std::atomic<int64_t>* request_count) {
+    const int fd = connection->fd;
+    fjpeg_server_request_t request;
+    int passed_fd;
+    std::vector<uint8_t> inline_frame;
+
+    while (fjpeg_recv_request(fd, &request, &passed_fd)) {
+        auto start = std::chrono::high_resolution_clock::now();
+        fjpeg_server_response_t response;
+        fjpeg_memory_sink jpeg;
+        const uint8_t* frame = nullptr;
+        void* mapping = MAP_FAILED;
+        bool cached = false;
+
+        memset(&response, 0, sizeof(response));
+        response.magic = FJPEG_SERVER_RESPONSE_MAGIC;
+        response.status = 1;
+
+        if (!fjpeg_server_valid_request(&request, max_frame_bytes)) {
+            if (passed_fd >= 0) close(passed_fd);
+            fjpeg_send_all(fd, &response, sizeof(response));
+            break;
+        }
+
+        if (request.flags & FJPEG_SERVER_FLAG_FD) {
+            if (passed_fd < 0) {
+                fjpeg_send_all(fd, &response, sizeof(response));
+                break;
+            }
+            // Touching a mapping past the end of a shorter file would SIGBUS the whole server
+            struct stat st;
+            if (fstat(passed_fd, &st) == 0 && st.st_size >= 0 && (uint64_t)st.st_size >= request.size) {
+                mapping = mmap(nullptr, (size_t)request.size, PROT_READ, MAP_SHARED, passed_fd, 0);
+            }
+            close(passed_fd);
+            if (mapping != MAP_FAILED) {
+                frame = (const uint8_t*)mapping;
+            }
+        } else {
+            // A descriptor sent along with an inline frame is not used
+            if (passed_fd >= 0) {
+                close(passed_fd);
+            }
+            inline_frame.resize((size_t)request.size);
+            if (!fjpeg_recv_all(fd, inline_frame.data(), inline_frame.size())) {
+                break;
+            }
+            frame = inline_frame.data();
+        }
+
+        if (frame) {
+            const int64_t luma = (int64_t)request.width * request.height;
+            const int64_t chroma = (int64_t)((request.width + 1) >> 1) * ((request.height + 1) >> 1);
+            fjpeg_context* context;
+
+            if (pool->pop(context)) {
+                fjpeg_bitstream stream(&jpeg);
+                if (context->setQuality(request.quality) &&
+                    context->loadFrame(frame, frame + luma, frame + luma + chroma, request.width, request.height)) {
+                    uint64_t key = cache ? fjpeg_cache_key(context, 0) : 0;
+                    if (cache && cache->lookup(key, &jpeg.data)) {
+                        cached = true;
+                        response.status = 0;
+                    } else if (fjpeg_encode_frame(&stream, context)) {
+                        response.status = 0;
+                        if (cache) {
+                            cache->store(key, jpeg.data);
+                        }
+                    }
+                }
+                pool->push(context);
+            }
+        }
+
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, (size_t)request.size);
+        }
+
+        if (response.status != 0) {
+            jpeg.data.clear();
+        }
+        response.size = jpeg.data.size();
+        response.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+        printf("Request %lld: %ux%u q%u %s, %llu bytes, %llu us\r\n", (long long)++(*request_count), request.width, request.height,
+               request.quality, response.status != 0 ? "failed" : cached ? "cached" : "ok", (unsigned long long)response.size, (unsigned long long)response.latency_us);
+        fflush(stdout);
+
+        if (!fjpeg_send_all(fd, &response, sizeof(response)) || !fjpeg_send_all(fd, jpeg.data.data(), jpeg.data.size())) {
+            break;
+        }
+    }
+
+    // The descriptor is closed by the accept loop after joining
+    connection->done = true;
+}
+
+bool fjpeg_server_run(const char* socket_path, int contexts, fjpeg_cache* cache, uint64_t max_frame_bytes) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long\n");
+        return false;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Unable to listen on %s\n", socket_path);
+        close(listen_fd);
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, fjpeg_server_signal);
+    signal(SIGTERM, fjpeg_server_signal);
+
+    // Contexts are constructed once, requests only set the quality and load the frame
+    fjpeg_queue<fjpeg_context*> pool(contexts);
+    for (int i = 0; i < contexts; i++) {
+        pool.push(new fjpeg_context());
+    }
+
+    std::list<fjpeg_server_connection*> connections;
+    std::atomic<int64_t> request_count(0);
+    const size_t max_connections = (size_t)contexts * FJPEG_SERVER_CONNECTIONS_PER_CONTEXT;
+
+    printf("Serving on %s with %d contexts, up to %d connections\r\n", socket_path, contexts, (int)max_connections);
+    fflush(stdout);
+
+    while (!fjpeg_server_stop) {
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        // At the limit new clients wait in the listen backlog until a connection finishes
+        if (connections.size() >= max_connections) {
+            poll(nullptr, 0, 20);
+        } else if (poll(&pfd, 1, 200) > 0) {
+            int client_fd = accept(listen_fd, nullptr, nullptr);
+            if (client_fd >= 0) {
+                fjpeg_server_connection* connection = new fjpeg_server_connection(client_fd);
+                connection->thread = std::thread(fjpeg_server_client, connection, &pool, cache, max_frame_bytes, &request_count);
+                connections.push_back(connection);
+            }
+        }
+
+        // Reap the connections that have finished
+        for (std::list<fjpeg_server_connection*>::iterator it = connections.begin(); it != connections.end();) {
+            if ((*it)->done) {
+                (*it)->thread.join();
+                close((*it)->fd);
+                delete *it;
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (std::list<fjpeg_server_connection*>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        shutdown((*it)->fd, SHUT_RDWR);
+        (*it)->thread.join();
+        close((*it)->fd);
+        delete *it;
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    fjpeg_context* context;
+    pool.close();
+    while (pool.pop(context)) {
+        delete context;
+    }
+
+    printf("Served %lld requests\r\n", (long long)request_count.load());
+    if (cache) {
+        printf("Cache: %lld hits, %lld misses, %lld evictions\r\n", (long long)cache->hits, (long long)cache->misses, (long long)cache->evictions);
+    }
+    return true;
+}
+
+bool fjpeg_client_encode(const char* socket_path, const uint8_t* frame, uint64_t size, int width, int height, int quality,
+                         bool use_fd, std::vector<uint8_t>* jpeg, uint64_t* latency_us) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    fjpeg_server_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.magic = FJPEG_SERVER_REQUEST_MAGIC;
+    request.width = width;
+    request.height = height;
+    request.quality = quality;
+    request.size = size;
+
+    // Pass the frame as a memfd so the server maps it instead of copying it through the socket
+    int frame_fd = -1;
+#ifdef __linux__
+    if (use_fd) {
+        frame_fd = memfd_create("fjpeg-frame", 0);
+        if (frame_fd >= 0 && write(frame_fd, frame, (size_t)size) != (ssize_t)size) {
+            close(frame_fd);
+            frame_fd = -1;
+        }
+    }
+#endif
+    if (frame_fd >= 0) {
+        request.flags |= FJPEG_SERVER_FLAG_FD;
+    }
+
+    bool ok = fjpeg_send_request(fd, &request, frame_fd);
+    if (frame_fd >= 0) {
+        close(frame_fd);
+    } else if (ok) {
+        ok = fjpeg_send_all(fd, frame, (size_t)size);
+    }
+
+    fjpeg_server_response_t response;
+    ok = ok && fjpeg_recv_all(fd, &response, sizeof(response)) && response.magic == FJPEG_SERVER_RESPONSE_MAGIC;
+    if (ok) {
+        jpeg->resize((size_t)response.size);
+        ok = fjpeg_recv_all(fd, jpeg->data(), jpeg->size()) && response.status == 0;
+        *latency_us = response.latency_us;
+    }
+
+    close(fd);
+    return ok;
+}
+
+#else
+
+bool fjpeg_server_run(const char* socket_path, int contexts, fjpeg_cache* cache, uint64_t max_frame_bytes) {
+    fprintf(stderr, "Error: Server mode is not supported on this platform\n");
+    return false;
+}
+
+bool fjpeg_client_encode(const char* socket_path, const uint8_t* frame, uint64_t size, int width, int height, int quality,
+                         bool use_fd, std::vector<uint8_t>* jpeg, uint64_t* latency_us) {
+    return false;
+}
+
+#endif
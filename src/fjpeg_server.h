@@ -0,0 +1,74 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Local encode daemon over a Unix domain socket, requests and responses are a fixed
+// header in host byte order followed by the frame or JPEG bytes
+#define FJPEG_SERVER_REQUEST_MAGIC 0x514A5046 // "FJPQ"
+#define FJPEG_SERVER_RESPONSE_MAGIC 0x524A5046 // "FJPR"
+
+// Largest frame a server accepts unless told otherwise, a 8192x8192 I420 frame
+#define FJPEG_SERVER_MAX_FRAME_DEFAULT (96 << 20)
+
+// Connections served at once per context, further clients wait in the listen backlog
+#define FJPEG_SERVER_CONNECTIONS_PER_CONTEXT 4
+
+// Frame is not inline but passed as a file descriptor (memfd) with SCM_RIGHTS
+#define FJPEG_SERVER_FLAG_FD 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t quality;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t size; // Planar I420 bytes, inline after the header unless FJPEG_SERVER_FLAG_FD
+} fjpeg_server_request_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t status; // 0 on success
+    uint64_t size; // JPEG bytes following the header
+    uint64_t latency_us; // Time from request received to encoded
+} fjpeg_server_response_t;
+
+class fjpeg_cache;
+
+// Serve until SIGINT / SIGTERM with a pool of "contexts" warm encoder contexts,
+// repeated frames are answered from "cache" when one is given, requests for frames
+// larger than max_frame_bytes are refused before anything is allocated for them,
+// at most contexts * FJPEG_SERVER_CONNECTIONS_PER_CONTEXT clients are served at once
+bool fjpeg_server_run(const char* socket_path, int contexts, fjpeg_cache* cache, uint64_t max_frame_bytes = FJPEG_SERVER_MAX_FRAME_DEFAULT);
+
+// Encode one I420 frame through a running server
+bool fjpeg_client_encode(const char* socket_path, const uint8_t* frame, uint64_t size, int width, int height, int quality,
+                         bool use_fd, std::vector<uint8_t>* jpeg, uint64_t* latency_us);
@@ -0,0 +1,423 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+#include "fjpeg.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_transcode.h"
+
+// Codes up to this length are resolved with one table lookup
+#define FJPEG_DECODE_LOOKAHEAD 9
+
+// Decoding form of a DHT table (JPEG F.2.2.3) with a lookahead table for short codes
+struct fjpeg_decode_table_t {
+    bool defined;
+    int32_t maxcode[18];
+    int32_t valoffset[18];
+    uint8_t values[256];
+    uint8_t look_len[1 << FJPEG_DECODE_LOOKAHEAD];
+    uint8_t look_value[1 << FJPEG_DECODE_LOOKAHEAD];
+};
+
+// Entropy coded segment reader, removes the stuffed zero bytes and stops at markers
+struct fjpeg_bitreader_t {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    uint64_t bits;
+    int count;
+    bool marker;
+};
+
+static bool fjpeg_build_decode_table(fjpeg_decode_table_t* table, const uint8_t* counts, const uint8_t* values, int total) {
+    if (total > 256) {
+        return false;
+    }
+    memset(table, 0, sizeof(fjpeg_decode_table_t));
+    memcpy(table->values, values, (size_t)total);
+
+    int code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        // More codes than the length has room for would fill past the lookahead table
+        if (code + counts[len - 1] > (1 << len)) {
+            return false;
+        }
+        table->valoffset[len] = k - code;
+        if (counts[len - 1]) {
+            // Fill every lookahead slot that starts with this code
+            for (int i = 0; i < counts[len - 1]; i++, k++, code++) {
+                if (len <= FJPEG_DECODE_LOOKAHEAD) {
+                    const int shift = FJPEG_DECODE_LOOKAHEAD - len;
+                    for (int j = 0; j < (1 << shift); j++) {
+                        table->look_len[(code << shift) | j] = (uint8_t)len;
+                        table->look_value[(code << shift) | j] = values[k];
+                    }
+                }
+            }
+            table->maxcode[len] = code - 1;
+        } else {
+            table->maxcode[len] = -1;
+        }
+        code <<= 1;
+    }
+    table->maxcode[17] = 0x7FFFFFFF;
+    table->defined = true;
+    return true;
+}
+
+static void fjpeg_bitreader_fill(fjpeg_bitreader_t* reader) {
+    while (reader->count <= 56) {
+        uint8_t byte = 0;
+        if (!reader->marker && reader->pos < reader->size) {
+            byte = reader->data[reader->pos];
+            if (byte == 0xFF) {
+                const uint8_t next = reader->pos + 1 < reader->size ? reader->data[reader->pos + 1] : 0xD9;
+                if (next == 0x00) {
+                    reader->pos += 2;
+                } else {
+                    // A marker ends the segment, the decoder sees zero bits from here
+                    reader->marker = true;
+                    byte = 0;
+                }
+            } else {
+                reader->pos++;
+            }
+        }
+        reader->bits |= (uint64_t)byte << (56 - reader->count);
+        reader->count += 8;
+    }
+}
+
+static inline uint32_t fjpeg_bitreader_get(fjpeg_bitreader_t* reader, int n) {
+    if (n == 0) {
+        return 0;
+    }
+    if (reader->count < n) {
+        fjpeg_bitreader_fill(reader);
+    }
+    const uint32_t value = (uint32_t)(reader->bits >> (64 - n));
+    reader->bits <<= n;
+    reader->count -= n;
+    return value;
+}
+
+static inline int fjpeg_decode_symbol(fjpeg_bitreader_t* reader, const fjpeg_decode_table_t* table) {
+    if (reader->count < 16) {
+        fjpeg_bitreader_fill(reader);
+    }
+    const uint32_t look = (uint32_t)(reader->bits >> (64 - FJPEG_DECODE_LOOKAHEAD));
+    const int len = table->look_len[look];
+    if (len) {
+        reader->bits <<= len;
+        reader->count -= len;
+        return table->look_value[look];
+    }
+
+    // Longer code, walk the lengths past the lookahead
+    int code = (int)fjpeg_bitreader_get(reader, FJPEG_DECODE_LOOKAHEAD);
+    int l = FJPEG_DECODE_LOOKAHEAD;
+    while (code > table->maxcode[l]) {
+        code = (code << 1) | (int)fjpeg_bitreader_get(reader, 1);
+        if (++l > 16) {
+            return -1;
+        }
+    }
+    return table->values[table->valoffset[l] + code];
+}
+
+// Magnitude category s and its s raw bits back to a signed value
+static inline int fjpeg_extend(uint32_t value, int s) {
+    return s == 0 ? 0 : (value < (1u << (s - 1)) ? (int)value - (1 << s) + 1 : (int)value);
+}
+
+static bool fjpeg_decode_block(fjpeg_bitreader_t* reader, const fjpeg_decode_table_t* dc, const fjpeg_decode_table_t* ac, int* pred, int* block) {
+    memset(block, 0, 64 * sizeof(int));
+
+    const int s = fjpeg_decode_symbol(reader, dc);
+    if (s < 0 || s > 11) {
+        return false;
+    }
+    *pred += fjpeg_extend(fjpeg_bitreader_get(reader, s), s);
+    block[0] = *pred;
+
+    for (int k = 1; k < 64; k++) {
+        const int rs = fjpeg_decode_symbol(reader, ac);
+        if (rs < 0) {
+            return false;
+        }
+        const int r = rs >> 4;
+        const int size = rs & 15;
+        if (size == 0) {
+            if (r != 15) {
+                break; // EOB
+            }
+            k += 15; // ZRL
+            continue;
+        }
+        k += r;
+        if (k > 63 || size > 10) {
+            return false;
+        }
+        block[k] = fjpeg_extend(fjpeg_bitreader_get(reader, size), size);
+    }
+    return true;
+}
+
+// Skip the rest of the interval's last byte and the RSTn marker that must follow
+static bool fjpeg_bitreader_restart(fjpeg_bitreader_t* reader, int expected) {
+    if (reader->pos + 1 >= reader->size || reader->data[reader->pos] != 0xFF ||
+        reader->data[reader->pos + 1] != 0xD0 + (expected & 7)) {
+        return false;
+    }
+    reader->pos += 2;
+    reader->bits = 0;
+    reader->count = 0;
+    reader->marker = false;
+    return true;
+}
+
+bool fjpeg_transcode_load(fjpeg_context* context, const uint8_t* data, size_t size, bool keep_quantization) {
+    fjpeg_decode_table_t tables[2][4];
+    uint16_t quant[4][64];
+    bool quant_defined[4] = { false, false, false, false };
+    int component_id[3];
+    int component_quant[3];
+    int component_dc[3];
+    int component_ac[3];
+    int components = 0;
+    int restart_interval = 0;
+    int width = 0;
+    int height = 0;
+    size_t pos = 2;
+
+    memset(tables, 0, sizeof(tables));
+
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        fprintf(stderr, "Error: Not a JPEG file\n");
+        return false;
+    }
+
+    // Marker segments up to and including SOS
+    for (;;) {
+        if (pos + 4 > size || data[pos] != 0xFF) {
+            fprintf(stderr, "Error: Truncated or invalid JPEG header\n");
+            return false;
+        }
+        const int marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++; // Fill byte
+            continue;
+        }
+        const size_t length = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+        const uint8_t* segment = data + pos + 4;
+        if (length < 2 || pos + 2 + length > size) {
+            fprintf(stderr, "Error: Truncated or invalid JPEG header\n");
+            return false;
+        }
+        const size_t end = length - 2;
+
+        if (marker == 0xC0) {
+            if (end < 6 || segment[0] != 8) {
+                fprintf(stderr, "Error: Only 8-bit baseline JPEG can be transcoded\n");
+                return false;
+            }
+            height = (segment[1] << 8) | segment[2];
+            width = (segment[3] << 8) | segment[4];
+            components = segment[5];
+            if ((components != 1 && components != 3) || end < 6 + 3 * (size_t)components || width == 0 || height == 0) {
+                fprintf(stderr, "Error: Only grayscale and 4:2:0 YCbCr JPEG can be transcoded\n");
+                return false;
+            }
+            for (int c = 0; c < components; c++) {
+                component_id[c] = segment[6 + c * 3];
+                const int sampling = segment[7 + c * 3];
+                component_quant[c] = segment[8 + c * 3] & 3;
+                if (components == 3 && sampling != (c == 0 ? 0x22 : 0x11)) {
+                    fprintf(stderr, "Error: Only 4:2:0 chroma subsampling can be transcoded\n");
+                    return false;
+                }
+            }
+        } else if (marker == 0xC1 || marker == 0xC2 || marker == 0xC3 || (marker >= 0xC5 && marker <= 0xCF && marker != 0xC8 && marker != 0xCC)) {
+            fprintf(stderr, "Error: Only baseline JPEG can be transcoded\n");
+            return false;
+        } else if (marker == 0xDB) {
+            size_t i = 0;
+            while (i < end) {
+                const int precision = segment[i] >> 4;
+                const int id = segment[i] & 3;
+                const size_t entry = precision ? 2 : 1;
+                if (i + 1 + 64 * entry > end) {
+                    fprintf(stderr, "Error: Invalid DQT segment\n");
+                    return false;
+                }
+                for (int k = 0; k < 64; k++) {
+                    quant[id][k] = precision ? (uint16_t)((segment[i + 1 + 2 * k] << 8) | segment[i + 2 + 2 * k]) : segment[i + 1 + k];
+                }
+                quant_defined[id] = true;
+                i += 1 + 64 * entry;
+            }
+        } else if (marker == 0xC4) {
+            size_t i = 0;
+            while (i + 17 <= end) {
+                const int table_class = segment[i] >> 4;
+                const int id = segment[i] & 3;
+                int total = 0;
+                for (int k = 0; k < 16; k++) {
+                    total += segment[i + 1 + k];
+                }
+                if (table_class > 1 || total > 256 || i + 17 + total > end ||
+                    !fjpeg_build_decode_table(&tables[table_class][id], segment + i + 1, segment + i + 17, total)) {
+                    fprintf(stderr, "Error: Invalid DHT segment\n");
+                    return false;
+                }
+                i += 17 + total;
+            }
+            // The counts have to account for the whole segment
+            if (i != end) {
+                fprintf(stderr, "Error: Invalid DHT segment\n");
+                return false;
+            }
+        } else if (marker == 0xDD) {
+            restart_interval = end >= 2 ? (segment[0] << 8) | segment[1] : 0;
+        } else if (marker == 0xDA) {
+            if (components == 0 || end < 1 || segment[0] != components || end < 4 + 2 * (size_t)components) {
+                fprintf(stderr, "Error: Only single scan interleaved JPEG can be transcoded\n");
+                return false;
+            }
+            for (int i = 0; i < components; i++) {
+                if (segment[1 + i * 2] != component_id[i]) {
+                    fprintf(stderr, "Error: Scan components out of order\n");
+                    return false;
+                }
+                component_dc[i] = segment[2 + i * 2] >> 4;
+                component_ac[i] = segment[2 + i * 2] & 3;
+                if (!tables[0][component_dc[i] & 3].defined || !tables[1][component_ac[i]].defined || !quant_defined[component_quant[i]]) {
+                    fprintf(stderr, "Error: Scan uses an undefined table\n");
+                    return false;
+                }
+            }
+            pos += 2 + length;
+            break;
+        }
+        pos += 2 + length;
+    }
+
+    if (keep_quantization) {
+        // The source steps become the destination steps, the coefficients pass through unchanged
+        if (components == 3 && component_quant[1] != component_quant[2]) {
+            fprintf(stderr, "Error: Chroma components with different quantization tables\n");
+            return false;
+        }
+        for (int c = 0; c < FJPEG_MIN(components, 2); c++) {
+            uint8_t* destination = c == 0 ? context->fjpeg_luminance_quantization_table : context->fjpeg_chrominance_quantization_table;
+            for (int i = 0; i < 64; i++) {
+                const uint16_t step = quant[component_quant[c]][fjpeg_zigzag_8x8[i]];
+                if (step == 0 || step > 255) {
+                    fprintf(stderr, "Error: Quantization table does not fit 8 bits\n");
+                    return false;
+                }
+                destination[i] = (uint8_t)step;
+            }
+        }
+    }
+
+    context->width = width;
+    context->height = height;
+    context->channels = components;
+    if (!context->allocPlanes(context->paddedHeight(), false)) {
+        fprintf(stderr, "Error: Unable to allocate coefficient planes\n");
+        return false;
+    }
+
+    // Requantization factors source step / destination step, both in zigzag order
+    float scale[3][64];
+    int dc_limit[3];
+    for (int c = 0; c < components; c++) {
+        const uint8_t* destination = c == 0 ? context->fjpeg_luminance_quantization_table : context->fjpeg_chrominance_quantization_table;
+        for (int i = 0; i < 64; i++) {
+            scale[c][fjpeg_zigzag_8x8[i]] = (float)quant[component_quant[c]][fjpeg_zigzag_8x8[i]] / destination[i];
+        }
+        // The DC of an 8-bit block stays within +-1024
+        dc_limit[c] = 1024 / destination[0];
+    }
+
+    fjpeg_bitreader_t reader;
+    reader.data = data;
+    reader.size = size;
+    reader.pos = pos;
+    reader.bits = 0;
+    reader.count = 0;
+    reader.marker = false;
+
+    int pred[3] = { 0, 0, 0 };
+    int block[64];
+    const int mcu = context->mcuSize();
+    const int blocks_per_mcu = components == 3 ? 6 : 1;
+    int64_t mcus = 0;
+    int restarts = 0;
+
+    for (int y = 0; y < context->paddedHeight(); y += mcu) {
+        for (int x = 0; x < context->paddedWidth(); x += mcu) {
+            if (restart_interval > 0 && mcus > 0 && mcus % restart_interval == 0) {
+                if (!fjpeg_bitreader_restart(&reader, restarts++)) {
+                    fprintf(stderr, "Error: Missing restart marker\n");
+                    return false;
+                }
+                memset(pred, 0, sizeof(pred));
+            }
+
+            for (int b = 0; b < blocks_per_mcu; b++) {
+                const int c = b < 4 ? 0 : b - 3;
+                const int bx = c == 0 ? x + (components == 3 ? (b & 1) * 8 : 0) : x >> 1;
+                const int by = c == 0 ? y + (components == 3 ? (b >> 1) * 8 : 0) : y >> 1;
+
+                if (!fjpeg_decode_block(&reader, &tables[0][component_dc[c] & 3], &tables[1][component_ac[c]], &pred[c], block)) {
+                    fprintf(stderr, "Error: Corrupt entropy coded data\n");
+                    return false;
+                }
+
+                fjpeg_coeff_t* out = fjpeg_coeff_block(context, bx, by, c);
+                for (int k = 0; k < 64; k++) {
+                    // Round half away from zero, the entropy coders get the integer back unchanged
+                    const float value = block[k] * scale[c][k];
+                    int rounded = (int)(value < 0 ? value - 0.5f : value + 0.5f);
+                    rounded = k == 0 ? FJPEG_CLAMP(rounded, -dc_limit[c], dc_limit[c]) : FJPEG_CLAMP(rounded, -1023, 1023);
+                    out[k] = fjpeg_coeff_from_int(rounded);
+                }
+            }
+            mcus++;
+        }
+    }
+
+    return true;
+}
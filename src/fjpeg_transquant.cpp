@@ -33,6 +33,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 
 #include "fjpeg.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_optimize.h"
 
 
 
@@ -54,42 +56,28 @@ fjpeg_coeff_t* fjpeg_izigzag8x8(fjpeg_coeff_t* block, fjpeg_coeff_t* out) {
     return out;
 }
 
-fjpeg_pixel_t* fjpeg_extract_8x8(fjpeg_context* context, fjpeg_pixel_t* output, int x, int y, int channel) {    
-
-    fjpeg_pixel_t* image = channel==0?context->fjpeg_y:channel==1?context->fjpeg_cb:context->fjpeg_cr;
-    const int input_width = channel==0?context->width:context->width/2;
-
-    for (int j = 0; j < 8; j++) {
-        for (int i = 0; i < 8; i++) {
-            output[j * 8 + i] = image[(y + j) * input_width  + (x + i)];
-        }
-    }
-    return output;
+fjpeg_pixel_t* fjpeg_extract_8x8(fjpeg_context* context, fjpeg_pixel_t* output, int x, int y, int channel) {
+    return channel==0?fjpeg_extract_8x8_t<0>(context, output, x, y):
+           channel==1?fjpeg_extract_8x8_t<1>(context, output, x, y):
+                      fjpeg_extract_8x8_t<2>(context, output, x, y);
 }
 
-fjpeg_coeff_t* fjpeg_extract_coeff_8x8(fjpeg_context* context, fjpeg_coeff_t* output, int x, int y, int channel) {    
-
-    fjpeg_coeff_t* image = channel==0?context->fjpeg_ydct:channel==1?context->fjpeg_cbdct:context->fjpeg_crdct;
-    const int input_width = channel==0?context->width:context->width/2;
+fjpeg_coeff_t* fjpeg_coeff_block(fjpeg_context* context, int x, int y, int channel) {
+    return channel==0?fjpeg_coeff_block_t<0>(context, x, y):
+           channel==1?fjpeg_coeff_block_t<1>(context, x, y):
+                      fjpeg_coeff_block_t<2>(context, x, y);
+}
 
-    for (int j = 0; j < 8; j++) {
-        for (int i = 0; i < 8; i++) {
-            output[j * 8 + i] = image[(y + j) * input_width  + (x + i)];
-        }
-    }
-    return output;
+fjpeg_coeff_t* fjpeg_extract_coeff_8x8(fjpeg_context* context, fjpeg_coeff_t* output, int x, int y, int channel) {
+    return channel==0?fjpeg_extract_coeff_8x8_t<0>(context, output, x, y):
+           channel==1?fjpeg_extract_coeff_8x8_t<1>(context, output, x, y):
+                      fjpeg_extract_coeff_8x8_t<2>(context, output, x, y);
 }
 
 bool fjpeg_store_coeff_8x8(fjpeg_context* context, fjpeg_coeff_t* input, int x, int y, int channel) {
-
-    fjpeg_coeff_t* image = channel==0?context->fjpeg_ydct:channel==1?context->fjpeg_cbdct:context->fjpeg_crdct;
-    const int input_width = channel==0?context->width:context->width/2;
-
-    for (int j = 0; j < 8; j++) {
-        for (int i = 0; i < 8; i++) {
-            image[(y + j) * input_width + (x + i)] = input[j * 8 + i];
-        }
-    }
+    if(channel == 0) fjpeg_store_coeff_8x8_t<0>(context, input, x, y);
+    else if(channel == 1) fjpeg_store_coeff_8x8_t<1>(context, input, x, y);
+    else fjpeg_store_coeff_8x8_t<2>(context, input, x, y);
     return true;
 }
 
@@ -111,6 +99,125 @@ fjpeg_coeff_t* fjpeg_dct8x8(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_
     return out;
 }
 
+// Same transform as fjpeg_dct8x8 as a row pass and a column pass, 1024 instead of 4096 multiplies
+fjpeg_coeff_t* fjpeg_dct8x8_separable(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out) {
+    float tmp[64];
+
+    for (int y = 0; y < FJPEG_BLOCK_SIZE; y++) {
+        for (int u = 0; u < FJPEG_BLOCK_SIZE; u++) {
+            float sum = 0.0f;
+            for (int x = 0; x < FJPEG_BLOCK_SIZE; x++) {
+                sum += (((float)block[y*FJPEG_BLOCK_SIZE+x])-128.f) * context->precalc_cos[x][u];
+            }
+            tmp[y*FJPEG_BLOCK_SIZE+u] = sum;
+        }
+    }
+
+    for (int v = 0; v < FJPEG_BLOCK_SIZE; v++) {
+        const float cv = (v == 0) ? 1.0f / sqrtf(2.f) : 1.0f;
+        for (int u = 0; u < FJPEG_BLOCK_SIZE; u++) {
+            const float cu = (u == 0) ? 1.0f / sqrtf(2.f) : 1.0f;
+            float sum = 0.0f;
+            for (int y = 0; y < FJPEG_BLOCK_SIZE; y++) {
+                sum += tmp[y*FJPEG_BLOCK_SIZE+u] * context->precalc_cos[y][v];
+            }
+            out[v*FJPEG_BLOCK_SIZE+u] = 0.25f * sum * cu * cv;
+        }
+    }
+    return out;
+}
+
+// One 8 point AAN butterfly (Arai, Agui and Nakajima), in place on every step'th value
+static inline void fjpeg_aan8(float* data, int step) {
+    const float tmp0 = data[0*step] + data[7*step];
+    const float tmp7 = data[0*step] - data[7*step];
+    const float tmp1 = data[1*step] + data[6*step];
+    const float tmp6 = data[1*step] - data[6*step];
+    const float tmp2 = data[2*step] + data[5*step];
+    const float tmp5 = data[2*step] - data[5*step];
+    const float tmp3 = data[3*step] + data[4*step];
+    const float tmp4 = data[3*step] - data[4*step];
+
+    // Even part
+    float tmp10 = tmp0 + tmp3;
+    const float tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2;
+    float tmp12 = tmp1 - tmp2;
+
+    data[0*step] = tmp10 + tmp11;
+    data[4*step] = tmp10 - tmp11;
+
+    const float z1 = (tmp12 + tmp13) * 0.707106781f;
+    data[2*step] = tmp13 + z1;
+    data[6*step] = tmp13 - z1;
+
+    // Odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+
+    const float z5 = (tmp10 - tmp12) * 0.382683433f;
+    const float z2 = 0.541196100f * tmp10 + z5;
+    const float z4 = 1.306562965f * tmp12 + z5;
+    const float z3 = tmp11 * 0.707106781f;
+
+    const float z11 = tmp7 + z3;
+    const float z13 = tmp7 - z3;
+
+    data[5*step] = z13 + z2;
+    data[3*step] = z13 - z2;
+    data[1*step] = z11 + z4;
+    data[7*step] = z11 - z4;
+}
+
+// Fast DCT, 5 multiplies per 8 point pass and one descaling multiply per coefficient
+fjpeg_coeff_t* fjpeg_dct8x8_fast(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out) {
+    float data[64];
+
+    for (int i = 0; i < 64; i++) {
+        data[i] = ((float)block[i]) - 128.f;
+    }
+    for (int y = 0; y < FJPEG_BLOCK_SIZE; y++) {
+        fjpeg_aan8(data + y*FJPEG_BLOCK_SIZE, 1);
+    }
+    for (int x = 0; x < FJPEG_BLOCK_SIZE; x++) {
+        fjpeg_aan8(data + x, FJPEG_BLOCK_SIZE);
+    }
+    for (int i = 0; i < 64; i++) {
+        out[i] = data[i] * context->aan_scale[i];
+    }
+    return out;
+}
+
+// Transform with the kernel the context asks for, blocks within flat_threshold of flat
+// only get their DC, which is the sum of the level shifted pixels divided by 8
+fjpeg_coeff_t* fjpeg_forward_dct(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out) {
+    if (context->flat_threshold >= 0) {
+        int min = block[0];
+        int max = block[0];
+        int sum = 0;
+        for (int i = 0; i < 64; i++) {
+            min = FJPEG_MIN(min, (int)block[i]);
+            max = FJPEG_MAX(max, (int)block[i]);
+            sum += block[i];
+        }
+        if (max - min <= context->flat_threshold) {
+            memset(out, 0, 64 * sizeof(fjpeg_coeff_t));
+            out[0] = (float)(sum - 64 * 128) * 0.125f;
+            return out;
+        }
+    }
+
+    switch (context->dct_method) {
+        case FJPEG_DCT_SEPARABLE:
+            return fjpeg_dct8x8_separable(context, block, out);
+        case FJPEG_DCT_FAST:
+            return fjpeg_dct8x8_fast(context, block, out);
+        default:
+            return fjpeg_dct8x8(context, block, out);
+    }
+}
+
 fjpeg_pixel_t* fjpeg_idct8x8(fjpeg_context* context, fjpeg_coeff_t* block, fjpeg_pixel_t* out) {
     for (int y = 0; y < FJPEG_BLOCK_SIZE; y++) {
         for (int x = 0; x < FJPEG_BLOCK_SIZE; x++) {
@@ -129,14 +236,7 @@ fjpeg_pixel_t* fjpeg_idct8x8(fjpeg_context* context, fjpeg_coeff_t* block, fjpeg
 }
 
 fjpeg_coeff_t* fjpeg_quant8x8(fjpeg_context* context, fjpeg_coeff_t* input, fjpeg_coeff_t *output, int table) {
-
-    uint8_t *quant_table = table == 0 ? context->fjpeg_luminance_quantization_table : context->fjpeg_chrominance_quantization_table;
-
-    for (int i = 0; i < 64; i++) {
-        output[i] = input[i] / (float)quant_table[i];
-    }
-
-    return output;
+    return table == 0 ? fjpeg_quant8x8_t<0>(context, input, output) : fjpeg_quant8x8_t<1>(context, input, output);
 }
 
 fjpeg_coeff_t* fjpeg_dequant8x8(fjpeg_context* context, fjpeg_coeff_t* input, fjpeg_coeff_t *output, int table) {
@@ -151,53 +251,162 @@ fjpeg_coeff_t* fjpeg_dequant8x8(fjpeg_context* context, fjpeg_coeff_t* input, fj
 }
 
 
-bool fjpeg_transquant_input(fjpeg_context* context) {
-    
+// Extract, transform, quantize and zigzag one block
+// Returns the squared quantization error of the block, see fjpeg_context::distortion
+template <int CHANNEL>
+static inline float fjpeg_transquant_block_t(fjpeg_context* context, int x, int y) {
     fjpeg_pixel_t cur_block[64];
     fjpeg_coeff_t dct_block[64];
     fjpeg_coeff_t dct_block2[64];
-    
-    for(int y = 0; y < context->height; y+=8) {
-        for(int x = 0; x < context->width; x+=8) {
-            fjpeg_extract_8x8(context, cur_block, x, y, 0);
-            fjpeg_dct8x8(context, cur_block, dct_block);
-            fjpeg_quant8x8(context, dct_block,dct_block2, 0);
-            fjpeg_zigzag8x8(dct_block2, dct_block);
-            fjpeg_store_coeff_8x8(context, dct_block, x, y, 0);
-            #ifdef FJPEG_DEBUG_DCT_BLOCK
-            fjpeg_izigzag8x8(dct_block, dct_block2);
-            fjpeg_dequant8x8(context, dct_block2, dct_block, 0);
-            fjpeg_idct8x8(context, dct_block, cur_block);
-            for (int j = 0; j < 8; j++) {
-                for (int i = 0; i < 8; i++) {
-                    image[(y + j) * context->width + (x + i)] = cur_block[j * 8 + i];
-                }
+
+    fjpeg_extract_8x8_t<CHANNEL>(context, cur_block, x, y);
+    fjpeg_forward_dct(context, cur_block, dct_block);
+    fjpeg_quant8x8_t<CHANNEL>(context, dct_block, dct_block2);
+    fjpeg_zigzag8x8(dct_block2, fjpeg_coeff_block_t<CHANNEL>(context, x, y));
+    #ifdef FJPEG_DEBUG_DCT_BLOCK
+    fjpeg_izigzag8x8(fjpeg_coeff_block_t<CHANNEL>(context, x, y), dct_block2);
+    fjpeg_dequant8x8(context, dct_block2, dct_block, CHANNEL);
+    fjpeg_idct8x8(context, dct_block, cur_block);
+    for (int j = 0; j < 8; j++) {
+        for (int i = 0; i < 8; i++) {
+            image[(y + j) * context->width + (x + i)] = cur_block[j * 8 + i];
+        }
+    }
+    #endif
+    return fjpeg_quant_error_t<CHANNEL>(context, dct_block2);
+}
+
+template <int CHANNEL>
+static inline void fjpeg_dct_block_t(fjpeg_context* context, int x, int y) {
+    fjpeg_pixel_t cur_block[64];
+
+    fjpeg_extract_8x8_t<CHANNEL>(context, cur_block, x, y);
+    fjpeg_forward_dct(context, cur_block, fjpeg_coeff_block_t<CHANNEL>(context, x, y));
+}
+
+// Source and destination may be the same context, the block is read before it is written
+template <int CHANNEL>
+static inline float fjpeg_quant_block_t(fjpeg_context* context, fjpeg_context* source, int x, int y) {
+    fjpeg_coeff_t dct_block[64];
+
+    fjpeg_quant8x8_t<CHANNEL>(context, fjpeg_coeff_block_t<CHANNEL>(source, x, y), dct_block);
+    fjpeg_zigzag8x8(dct_block, fjpeg_coeff_block_t<CHANNEL>(context, x, y));
+    return fjpeg_quant_error_t<CHANNEL>(context, dct_block);
+}
+
+// MCU row loops specialized on the component count, 3 is 4:2:0 with 16x16 MCUs
+// and 1 is grayscale with 8x8 MCUs
+template <int CHANNELS>
+static void fjpeg_transquant_mcu_row_t(fjpeg_context* context, int y) {
+    const int mcu = CHANNELS==1?8:16;
+    const int width = context->paddedWidth();
+    double error[3] = { 0.0, 0.0, 0.0 };
+
+    for(int x = 0; x < width; x+=mcu) {
+        for(int v = 0; v < mcu; v+=8) {
+            for(int u = 0; u < mcu; u+=8) {
+                error[0] += fjpeg_transquant_block_t<0>(context, x+u, y+v);
             }
-            #endif
         }
     }
 
-    if(context->channels == 3) {
-        for(int y = 0; y < context->height/2; y+=8) {
-            for(int x = 0; x < context->width/2; x+=8) {
-                fjpeg_extract_8x8(context, cur_block, x, y, 1);
-                fjpeg_dct8x8(context, cur_block, dct_block);
-                fjpeg_quant8x8(context, dct_block,dct_block2, 1);
-                fjpeg_zigzag8x8(dct_block2, dct_block);
-                fjpeg_store_coeff_8x8(context, dct_block, x, y, 1);
+    if(CHANNELS == 3) {
+        for(int x = 0; x < width/2; x+=8) {
+            error[1] += fjpeg_transquant_block_t<1>(context, x, y/2);
+        }
+        for(int x = 0; x < width/2; x+=8) {
+            error[2] += fjpeg_transquant_block_t<2>(context, x, y/2);
+        }
+    }
+
+    // One atomic add per component and row keeps the bands of other threads cheap
+    for(int c = 0; c < CHANNELS; c++) {
+        context->distortion[c] += (int64_t)(error[c] * 256.0 + 0.5);
+    }
+}
+
+template <int CHANNELS>
+static void fjpeg_dct_mcu_row_t(fjpeg_context* context, int y) {
+    const int mcu = CHANNELS==1?8:16;
+    const int width = context->paddedWidth();
+
+    for(int x = 0; x < width; x+=mcu) {
+        for(int v = 0; v < mcu; v+=8) {
+            for(int u = 0; u < mcu; u+=8) {
+                fjpeg_dct_block_t<0>(context, x+u, y+v);
             }
         }
+    }
+
+    if(CHANNELS == 3) {
+        for(int x = 0; x < width/2; x+=8) {
+            fjpeg_dct_block_t<1>(context, x, y/2);
+        }
+        for(int x = 0; x < width/2; x+=8) {
+            fjpeg_dct_block_t<2>(context, x, y/2);
+        }
+    }
+}
 
-        for(int y = 0; y < context->height/2; y+=8) {
-            for(int x = 0; x < context->width/2; x+=8) {
-                fjpeg_extract_8x8(context, cur_block, x, y, 2);
-                fjpeg_dct8x8(context, cur_block, dct_block);
-                fjpeg_quant8x8(context, dct_block,dct_block2, 2);
-                fjpeg_zigzag8x8(dct_block2, dct_block);
-                fjpeg_store_coeff_8x8(context, dct_block, x, y, 2);
+template <int CHANNELS>
+static void fjpeg_quant_mcu_row_t(fjpeg_context* context, fjpeg_context* source, int y) {
+    const int mcu = CHANNELS==1?8:16;
+    const int width = context->paddedWidth();
+    double error[3] = { 0.0, 0.0, 0.0 };
+
+    for(int x = 0; x < width; x+=mcu) {
+        for(int v = 0; v < mcu; v+=8) {
+            for(int u = 0; u < mcu; u+=8) {
+                error[0] += fjpeg_quant_block_t<0>(context, source, x+u, y+v);
             }
         }
     }
 
+    if(CHANNELS == 3) {
+        for(int x = 0; x < width/2; x+=8) {
+            error[1] += fjpeg_quant_block_t<1>(context, source, x, y/2);
+        }
+        for(int x = 0; x < width/2; x+=8) {
+            error[2] += fjpeg_quant_block_t<2>(context, source, x, y/2);
+        }
+    }
+
+    for(int c = 0; c < CHANNELS; c++) {
+        context->distortion[c] += (int64_t)(error[c] * 256.0 + 0.5);
+    }
+}
+
+// Transform and quantize one MCU row, y is the top luma line of the row in the planes
+bool fjpeg_transquant_mcu_row(fjpeg_context* context, int y) {
+    if(context->channels == 1) fjpeg_transquant_mcu_row_t<1>(context, y);
+    else fjpeg_transquant_mcu_row_t<3>(context, y);
+    return true;
+}
+
+// Forward DCT only, the unquantized blocks are stored in natural (non-zigzag) order
+bool fjpeg_dct_mcu_row(fjpeg_context* context, int y) {
+    if(context->channels == 1) fjpeg_dct_mcu_row_t<1>(context, y);
+    else fjpeg_dct_mcu_row_t<3>(context, y);
+    return true;
+}
+
+// Quantize and zigzag the unquantized blocks of "source" with the tables of "context"
+bool fjpeg_quant_mcu_row(fjpeg_context* context, fjpeg_context* source, int y) {
+    if(context->channels == 1) fjpeg_quant_mcu_row_t<1>(context, source, y);
+    else fjpeg_quant_mcu_row_t<3>(context, source, y);
+    return true;
+}
+
+bool fjpeg_transquant_input(fjpeg_context* context) {
+    if (context->target_psnr > 0.0f) {
+        return fjpeg_optimize_quantization(context);
+    }
+
+    context->resetDistortion();
+
+    for(int y = 0; y < context->paddedHeight(); y+=context->mcuSize()) {
+        fjpeg_transquant_mcu_row(context, y);
+    }
+
     return true;
-}
\ No newline at end of file
+}
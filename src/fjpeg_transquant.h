@@ -29,7 +29,122 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "fjpeg.h"
 
+// Stored value that the entropy coders, which round with (int)(x + 0.5f), turn back into value
+static inline fjpeg_coeff_t fjpeg_coeff_from_int(int value) {
+    return value < 0 ? (fjpeg_coeff_t)value - 0.5f : (fjpeg_coeff_t)value;
+}
+
+// Block accessors specialized on the channel at compile time, 0 is luma
+template <int CHANNEL>
+inline fjpeg_pixel_t* fjpeg_extract_8x8_t(fjpeg_context* context, fjpeg_pixel_t* output, int x, int y) {
+    const fjpeg_pixel_t* image = CHANNEL==0?context->fjpeg_y:CHANNEL==1?context->fjpeg_cb:context->fjpeg_cr;
+    int64_t input_width = CHANNEL==0?context->luma_stride:context->chroma_stride;
+
+    if (context->input_planes[CHANNEL]) {
+        // Caller planes are not padded, blocks over the right or bottom edge repeat the last
+        // column and line like storeLine does for the internal planes
+        image = context->input_planes[CHANNEL];
+        input_width = context->input_strides[CHANNEL];
+        const int plane_width = CHANNEL==0?context->width:context->chromaWidth();
+        const int plane_height = CHANNEL==0?context->height:context->chromaHeight();
+        if (x + 8 > plane_width || y + 8 > plane_height) {
+            for (int j = 0; j < 8; j++) {
+                const fjpeg_pixel_t* line = image + (int64_t)FJPEG_MIN(y + j, plane_height - 1) * input_width;
+                for (int i = 0; i < 8; i++) {
+                    output[j * 8 + i] = line[FJPEG_MIN(x + i, plane_width - 1)];
+                }
+            }
+            return output;
+        }
+    }
+
+    for (int j = 0; j < 8; j++) {
+        for (int i = 0; i < 8; i++) {
+            output[j * 8 + i] = image[(int64_t)(y + j) * input_width + (x + i)];
+        }
+    }
+    return output;
+}
+
+// Coefficient planes hold contiguous 64 entry blocks, see fjpeg_context::coeffBlockOffset
+template <int CHANNEL>
+inline fjpeg_coeff_t* fjpeg_coeff_block_t(fjpeg_context* context, int x, int y) {
+    fjpeg_coeff_t* image = CHANNEL==0?context->fjpeg_ydct:CHANNEL==1?context->fjpeg_cbdct:context->fjpeg_crdct;
+    return image + context->coeffBlockOffset(CHANNEL, x, y);
+}
+
+// Block at (x, y) of the written frame, for an oriented frame the source block is
+// permuted and sign flipped into tmp, signs flip on the rounded value so the result
+// codes exactly like the source block
+template <int CHANNEL>
+inline const fjpeg_coeff_t* fjpeg_oriented_block_t(fjpeg_context* context, int x, int y, fjpeg_coeff_t* tmp) {
+    if (context->orientation == FJPEG_ORIENT_NORMAL) {
+        return fjpeg_coeff_block_t<CHANNEL>(context, x, y);
+    }
+    int sx, sy;
+    context->orientedSource(CHANNEL, x, y, &sx, &sy);
+    const fjpeg_coeff_t* block = fjpeg_coeff_block_t<CHANNEL>(context, sx, sy);
+    for (int i = 0; i < 64; i++) {
+        const fjpeg_coeff_t value = block[context->orient_index[i]];
+        tmp[i] = context->orient_negate[i] ? fjpeg_coeff_from_int(-(int)(value + 0.5f)) : value;
+    }
+    return tmp;
+}
+
+template <int CHANNEL>
+inline fjpeg_coeff_t* fjpeg_extract_coeff_8x8_t(fjpeg_context* context, fjpeg_coeff_t* output, int x, int y) {
+    memcpy(output, fjpeg_coeff_block_t<CHANNEL>(context, x, y), 64 * sizeof(fjpeg_coeff_t));
+    return output;
+}
+
+template <int CHANNEL>
+inline void fjpeg_store_coeff_8x8_t(fjpeg_context* context, const fjpeg_coeff_t* input, int x, int y) {
+    memcpy(fjpeg_coeff_block_t<CHANNEL>(context, x, y), input, 64 * sizeof(fjpeg_coeff_t));
+}
+
+template <int CHANNEL>
+inline fjpeg_coeff_t* fjpeg_quant8x8_t(fjpeg_context* context, const fjpeg_coeff_t* input, fjpeg_coeff_t* output) {
+    const uint8_t *quant_table = CHANNEL == 0 ? context->fjpeg_luminance_quantization_table : context->fjpeg_chrominance_quantization_table;
+
+    for (int i = 0; i < 64; i++) {
+        output[i] = input[i] / (float)quant_table[i];
+    }
+    return output;
+}
+
+// Squared error of one quantized block (natural order, in steps) once the entropy coder
+// rounds it with (int)(x + 0.5f), scaled back to DCT units by the step
+template <int CHANNEL>
+inline float fjpeg_quant_error_t(const fjpeg_context* context, const fjpeg_coeff_t* block) {
+    const uint8_t *quant_table = CHANNEL == 0 ? context->fjpeg_luminance_quantization_table : context->fjpeg_chrominance_quantization_table;
+
+#ifdef FJPEG_SSE2
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < 64; i += 4) {
+        const __m128 value = _mm_loadu_ps(block + i);
+        int32_t steps;
+        memcpy(&steps, quant_table + i, 4);
+        const __m128 step = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(steps), zero), zero));
+        const __m128 error = _mm_mul_ps(_mm_sub_ps(value, _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_add_ps(value, half)))), step);
+        sum = _mm_add_ps(sum, _mm_mul_ps(error, error));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, sum);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+    float sum = 0.0f;
+    for (int i = 0; i < 64; i++) {
+        const float error = (block[i] - (float)(int)(block[i] + 0.5f)) * (float)quant_table[i];
+        sum += error * error;
+    }
+    return sum;
+#endif
+}
+
 bool fjpeg_store_coeff_8x8(fjpeg_context* context, fjpeg_coeff_t* input, int x, int y, int channel);
+fjpeg_coeff_t* fjpeg_coeff_block(fjpeg_context* context, int x, int y, int channel);
 fjpeg_coeff_t* fjpeg_extract_coeff_8x8(fjpeg_context* context, fjpeg_coeff_t* output, int x, int y, int channel);
 fjpeg_pixel_t* fjpeg_extract_8x8(fjpeg_context* context, fjpeg_pixel_t* output, int x, int y, int channel);
 fjpeg_coeff_t* fjpeg_izigzag8x8(fjpeg_coeff_t* block, fjpeg_coeff_t* out);
@@ -39,5 +154,11 @@ fjpeg_coeff_t* fjpeg_dequant8x8(fjpeg_context* context, fjpeg_coeff_t* input, fj
 fjpeg_coeff_t* fjpeg_quant8x8(fjpeg_context* context, fjpeg_coeff_t* input, fjpeg_coeff_t *output, int table);
 fjpeg_pixel_t* fjpeg_idct8x8(fjpeg_context* context, fjpeg_coeff_t* block, fjpeg_pixel_t* out);
 fjpeg_coeff_t* fjpeg_dct8x8(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out);
+fjpeg_coeff_t* fjpeg_dct8x8_separable(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out);
+fjpeg_coeff_t* fjpeg_dct8x8_fast(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out);
+fjpeg_coeff_t* fjpeg_forward_dct(fjpeg_context* context, fjpeg_pixel_t* block, fjpeg_coeff_t* out);
 
-bool fjpeg_transquant_input(fjpeg_context* context);
\ No newline at end of file
+bool fjpeg_transquant_mcu_row(fjpeg_context* context, int y);
+bool fjpeg_dct_mcu_row(fjpeg_context* context, int y);
+bool fjpeg_quant_mcu_row(fjpeg_context* context, fjpeg_context* source, int y);
+bool fjpeg_transquant_input(fjpeg_context* context);
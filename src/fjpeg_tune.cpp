@@ -0,0 +1,256 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include "fjpeg.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_pipeline.h"
+#include "fjpeg_batch.h"
+#include "fjpeg_optimize.h"
+#include "fjpeg_tune.h"
+
+// Every trial is repeated and the fastest run counts, the others are disturbed by something else
+#define FJPEG_TUNE_REPEATS 3
+
+static void fjpeg_tuning_reset(fjpeg_tuning_t* tuning) {
+    memset(tuning, 0, sizeof(fjpeg_tuning_t));
+}
+
+bool fjpeg_load_tuning(const char* filename, fjpeg_tuning_t* tuning) {
+    fjpeg_tuning_reset(tuning);
+
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    // "key value" lines, unknown keys are skipped so newer profiles still load, and so are
+    // the resolution and dct_method lines older profiles have
+    char line[256];
+    char key[64];
+    char value[64];
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || sscanf(line, "%63s %63s", key, value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "threads") == 0) {
+            tuning->threads = FJPEG_MAX(atoi(value), 0);
+        } else if (strcmp(key, "band_rows") == 0) {
+            tuning->band_rows = FJPEG_MAX(atoi(value), 0);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+bool fjpeg_save_tuning(const char* filename, const fjpeg_tuning_t* tuning) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "# fjpeg autotune profile, loaded from the file named by FJPEG_PROFILE\n");
+    fprintf(fp, "threads %d\n", tuning->threads);
+    fprintf(fp, "band_rows %d\n", tuning->band_rows);
+    return fclose(fp) == 0;
+}
+
+static fjpeg_tuning_t fjpeg_load_default_tuning() {
+    fjpeg_tuning_t tuning;
+    const char* filename = getenv("FJPEG_PROFILE");
+    if (!filename || !fjpeg_load_tuning(filename, &tuning)) {
+        fjpeg_tuning_reset(&tuning);
+    }
+    return tuning;
+}
+
+const fjpeg_tuning_t* fjpeg_tuning() {
+    // Thread-safe one time initialization
+    static const fjpeg_tuning_t tuning = fjpeg_load_default_tuning();
+    return &tuning;
+}
+
+static double fjpeg_tune_elapsed_ms(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.0;
+}
+
+// Smooth gradients with a texture of pseudo random noise on top, enough nonzero
+// coefficients that the entropy coder gets a realistic share of the time
+static void fjpeg_tune_synthetic_frame(int width, int height, std::vector<fjpeg_pixel_t>& frame) {
+    frame.resize((size_t)fjpeg_context::frameSize(width, height));
+    uint32_t seed = 0x12345678;
+    fjpeg_pixel_t* p = frame.data();
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1664525u + 1013904223u;
+            *p++ = (fjpeg_pixel_t)FJPEG_CLAMP((x * 255) / width / 2 + (y * 255) / height / 2 + (int)(seed >> 28) - 8, 0, 255);
+        }
+    }
+    const int chroma_width = (width + 1) >> 1;
+    const int chroma_height = (height + 1) >> 1;
+    for (int c = 0; c < 2; c++) {
+        for (int y = 0; y < chroma_height; y++) {
+            for (int x = 0; x < chroma_width; x++) {
+                *p++ = (fjpeg_pixel_t)(128 + (c ? x : y) * 64 / (c ? chroma_width : chroma_height) - 32);
+            }
+        }
+    }
+}
+
+struct fjpeg_tune_source {
+    const fjpeg_pixel_t* frame;
+    int width;
+    int height;
+    int dct_method;
+    int64_t frames_left;
+};
+
+static bool fjpeg_tune_read(void* user, fjpeg_frame* frame) {
+    fjpeg_tune_source* source = (fjpeg_tune_source*)user;
+    if (source->frames_left-- <= 0) {
+        return false;
+    }
+    const int64_t luma = (int64_t)source->width * source->height;
+    const int64_t chroma = (int64_t)((source->width + 1) >> 1) * ((source->height + 1) >> 1);
+    frame->context.dct_method = source->dct_method;
+    return frame->context.loadFrame(source->frame, source->frame + luma, source->frame + luma + chroma, source->width, source->height);
+}
+
+static bool fjpeg_tune_discard(void* user, fjpeg_frame* frame) {
+    (void)user;
+    (void)frame;
+    return true;
+}
+
+bool fjpeg_autotune(int width, int height, const fjpeg_pixel_t* frame, int quality, const char* scratch,
+                    fjpeg_tuning_t* tuning, std::vector<fjpeg_tune_trial_t>* trials) {
+    fjpeg_tuning_reset(tuning);
+
+    std::vector<fjpeg_pixel_t> synthetic;
+    if (!frame) {
+        fjpeg_tune_synthetic_frame(width, height, synthetic);
+        frame = synthetic.data();
+    }
+    const int64_t luma = (int64_t)width * height;
+    const int64_t chroma = (int64_t)((width + 1) >> 1) * ((height + 1) >> 1);
+
+    // DCT kernels on one frame, transform and quantization only
+    fjpeg_context context;
+    if (!context.setQuality(quality) || !context.loadFrame(frame, frame + luma, frame + luma + chroma, width, height)) {
+        return false;
+    }
+    for (int method = FJPEG_DCT_REFERENCE; method <= FJPEG_DCT_FAST; method++) {
+        context.dct_method = method;
+        double fastest = 0.0;
+        for (int r = 0; r < FJPEG_TUNE_REPEATS; r++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            fjpeg_transquant_input(&context);
+            const double ms = fjpeg_tune_elapsed_ms(start);
+            fastest = r == 0 ? ms : FJPEG_MIN(fastest, ms);
+        }
+        trials->push_back(fjpeg_tune_trial_t{ "dct_method", method, fastest });
+    }
+
+    // Encoder threads, doubling up to the core count, time per frame of a pipelined sequence
+    // with the default DCT the encoder runs without a preset
+    double best = 0.0;
+    const int cores = FJPEG_MAX((int)std::thread::hardware_concurrency(), 1);
+    std::vector<int> counts;
+    for (int n = 1; n < cores; n <<= 1) {
+        counts.push_back(n);
+    }
+    counts.push_back(cores);
+    const int64_t frames = FJPEG_MAX(2 * cores, 8);
+    for (size_t i = 0; i < counts.size(); i++) {
+        double fastest = 0.0;
+        for (int r = 0; r < FJPEG_TUNE_REPEATS; r++) {
+            fjpeg_tune_source source = { frame, width, height, FJPEG_DCT_REFERENCE, frames };
+            fjpeg_pipeline pipeline(quality, 3, counts[i]);
+            if (!pipeline.run(fjpeg_tune_read, fjpeg_tune_discard, &source)) {
+                return false;
+            }
+            const double ms = pipeline.time_total_us / 1000.0 / frames;
+            fastest = r == 0 ? ms : FJPEG_MIN(fastest, ms);
+        }
+        trials->push_back(fjpeg_tune_trial_t{ "threads", counts[i], fastest });
+        if (i == 0 || fastest < best) {
+            tuning->threads = counts[i];
+            best = fastest;
+        }
+    }
+
+    // Band height of a frame split across the batch workers, only matters with more than one
+    tuning->band_rows = 16;
+    const int rows = (height + 15) / 16;
+    if (tuning->threads > 1 && rows > 1) {
+        const std::string input = std::string(scratch) + ".yuv";
+        const std::string output = std::string(scratch) + ".jpg";
+        FILE* fp = fopen(input.c_str(), "wb");
+        const bool written = fp && fwrite(frame, 1, (size_t)(luma + 2 * chroma), fp) == (size_t)(luma + 2 * chroma);
+        if (fp) {
+            fclose(fp);
+        }
+        bool ok = written;
+        bool first = true;
+        for (int band_rows = 4; ok && band_rows <= 64 && (band_rows == 4 || band_rows < rows); band_rows <<= 1) {
+            double fastest = 0.0;
+            for (int r = 0; ok && r < FJPEG_TUNE_REPEATS; r++) {
+                fjpeg_batch batch(tuning->threads);
+                batch.band_pixels = 0;
+                batch.band_rows = band_rows;
+                fjpeg_batch_job_t job = { input, output, width, height, quality, 1 };
+                batch.jobs.push_back(job);
+                ok = batch.run() && batch.failures.empty();
+                const double ms = batch.time_total_us / 1000.0;
+                fastest = r == 0 ? ms : FJPEG_MIN(fastest, ms);
+            }
+            if (!ok) {
+                break;
+            }
+            trials->push_back(fjpeg_tune_trial_t{ "band_rows", band_rows, fastest });
+            if (first || fastest < best) {
+                tuning->band_rows = band_rows;
+                best = fastest;
+                first = false;
+            }
+        }
+        remove(input.c_str());
+        remove(output.c_str());
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,63 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fjpeg_global.h"
+
+// Machine specific settings found by fjpeg --autotune, a field is unset (0) when the
+// profile does not have it and the built-in default applies. Only settings that leave the
+// output bytes unchanged belong here: the DCT kernels round differently, so the DCT method
+// is timed for the report but never taken from a profile. The settings apply to every
+// frame size, whatever resolution the trials ran at
+typedef struct {
+    int threads;      // Encoder threads, batch workers and server contexts
+    int band_rows;    // MCU rows per stealable band of a large batch frame
+} fjpeg_tuning_t;
+
+// One timed configuration of an autotune run
+typedef struct {
+    std::string setting;
+    int value;
+    double ms;
+} fjpeg_tune_trial_t;
+
+// Profile named by the FJPEG_PROFILE environment variable, read once per process on
+// first use, the CLI's default --threads and fjpeg_batch::band_rows come from it
+const fjpeg_tuning_t* fjpeg_tuning();
+
+bool fjpeg_load_tuning(const char* filename, fjpeg_tuning_t* tuning);
+bool fjpeg_save_tuning(const char* filename, const fjpeg_tuning_t* tuning);
+
+// Time the DCT kernels (reported in trials only), then the encoder thread count and the
+// batch band height, the band trial uses the winning thread count, frame is a packed I420
+// frame or null for a synthetic one, scratch is a file name prefix for the batch trial files
+bool fjpeg_autotune(int width, int height, const fjpeg_pixel_t* frame, int quality, const char* scratch,
+                    fjpeg_tuning_t* tuning, std::vector<fjpeg_tune_trial_t>* trials);
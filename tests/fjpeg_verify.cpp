@@ -0,0 +1,632 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "fjpeg.h"
+#include "fjpeg_bitstream.h"
+#include "fjpeg_transquant.h"
+#include "fjpeg_huffman.h"
+#include "fjpeg_pipeline.h"
+#include "fjpeg_batch.h"
+#include "fjpeg_optimize.h"
+#include "fjpeg_hash.h"
+#include "fjpeg_transcode.h"
+#include "fjpeg_cache.h"
+#include "fjpeg_index.h"
+#include "fjpeg_verify.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+// Single pixel, below one block, exact MCU multiples, odd remainders on either axis
+// and frames tall enough to be split into several batch bands
+static const int fjpeg_verify_sizes[][2] = {
+    { 1, 1 }, { 7, 5 }, { 8, 8 }, { 16, 16 }, { 17, 9 }, { 33, 47 },
+    { 64, 48 }, { 101, 37 }, { 96, 200 }, { 320, 240 },
+};
+static const int fjpeg_verify_qualities[] = { 1, 50, 90, 100 };
+
+// Entropy coder settings every DCT method is checked with
+#define FJPEG_VERIFY_HUFFMAN 0
+#define FJPEG_VERIFY_ARITHMETIC 1
+#define FJPEG_VERIFY_RESTART 2
+static const char* fjpeg_verify_coder_names[] = { "huffman", "arithmetic", "restart" };
+
+#define FJPEG_VERIFY_SIZE_COUNT (int)(sizeof(fjpeg_verify_sizes) / sizeof(fjpeg_verify_sizes[0]))
+#define FJPEG_VERIFY_QUALITY_COUNT (int)(sizeof(fjpeg_verify_qualities) / sizeof(fjpeg_verify_qualities[0]))
+
+// Gradients, pseudo random noise of full amplitude in one quarter and hard black and
+// white bars, so the frames reach the extreme coefficients and the saturated pixels
+static void fjpeg_verify_frame(int width, int height, std::vector<fjpeg_pixel_t>& frame) {
+    frame.resize((size_t)fjpeg_context::frameSize(width, height));
+    uint32_t seed = 0x9E3779B9u ^ (uint32_t)(width * 65536 + height);
+    fjpeg_pixel_t* p = frame.data();
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1664525u + 1013904223u;
+            int value = (x * 255) / width / 2 + (y * 255) / height / 2;
+            if (x >= width / 2 && y >= height / 2) {
+                value = (int)(seed >> 24);
+            } else if (x < width / 4) {
+                value = (x / 3) & 1 ? 255 : 0;
+            }
+            *p++ = (fjpeg_pixel_t)FJPEG_CLAMP(value, 0, 255);
+        }
+    }
+    const int chroma_width = (width + 1) >> 1;
+    const int chroma_height = (height + 1) >> 1;
+    for (int c = 0; c < 2; c++) {
+        for (int y = 0; y < chroma_height; y++) {
+            for (int x = 0; x < chroma_width; x++) {
+                seed = seed * 1664525u + 1013904223u;
+                *p++ = (fjpeg_pixel_t)(c ? (x * 255) / chroma_width : (int)(seed >> 30) * 85);
+            }
+        }
+    }
+}
+
+static std::string fjpeg_verify_key(int size, int quality, int dct_method, int coder) {
+    char key[96];
+    snprintf(key, sizeof(key), "%dx%d q%d %s %s", fjpeg_verify_sizes[size][0], fjpeg_verify_sizes[size][1], quality,
+             fjpeg_dct_method_name(dct_method), fjpeg_verify_coder_names[coder]);
+    return key;
+}
+
+static void fjpeg_verify_configure(fjpeg_context* context, int quality, int dct_method, int coder) {
+    context->setQuality(quality);
+    context->dct_method = dct_method;
+    context->arithmetic = coder == FJPEG_VERIFY_ARITHMETIC;
+    context->restart_rows = coder == FJPEG_VERIFY_RESTART ? 1 : 0;
+    context->flush_rows = 0;
+}
+
+static bool fjpeg_verify_load(fjpeg_context* context, const std::vector<fjpeg_pixel_t>& frame, int width, int height) {
+    const int64_t luma = (int64_t)width * height;
+    const int64_t chroma = (int64_t)((width + 1) >> 1) * ((height + 1) >> 1);
+    return context->loadFrame(frame.data(), frame.data() + luma, frame.data() + luma + chroma, width, height);
+}
+
+// Push the frame in MCU row strips the way a capture callback would
+static bool fjpeg_verify_stream(fjpeg_bitstream* stream, fjpeg_context* context, const std::vector<fjpeg_pixel_t>& frame, int width, int height) {
+    const int64_t luma = (int64_t)width * height;
+    const int64_t chroma_width = (width + 1) >> 1;
+    const int64_t chroma = chroma_width * ((height + 1) >> 1);
+    if (!fjpeg_stream_begin(stream, context, width, height)) {
+        return false;
+    }
+    for (int y = 0; y < height; y += context->mcuSize()) {
+        const fjpeg_pixel_t* cb = frame.data() + luma + (y / 2) * chroma_width;
+        if (!fjpeg_stream_push(stream, context, frame.data() + (int64_t)y * width, cb, cb + chroma,
+                               FJPEG_MIN(context->mcuSize(), height - y))) {
+            return false;
+        }
+    }
+    return fjpeg_stream_end(stream, context);
+}
+
+// Encode paths that take the same settings as the single pass one
+#define FJPEG_VERIFY_SINGLE 0
+#define FJPEG_VERIFY_TWO_PASS 1
+#define FJPEG_VERIFY_STREAM 2
+#define FJPEG_VERIFY_FLUSH 3
+#define FJPEG_VERIFY_PATHS 4
+static const char* fjpeg_verify_path_names[] = { "single", "two-pass", "stream", "flush" };
+
+static bool fjpeg_verify_encode(int path, fjpeg_context* context, const std::vector<fjpeg_pixel_t>& frame, int width, int height,
+                                std::vector<uint8_t>* output) {
+    fjpeg_memory_sink sink;
+    bool ok;
+    {
+        fjpeg_bitstream stream(&sink);
+        if (path == FJPEG_VERIFY_STREAM) {
+            ok = fjpeg_verify_stream(&stream, context, frame, width, height);
+        } else if (!fjpeg_verify_load(context, frame, width, height)) {
+            ok = false;
+        } else if (path == FJPEG_VERIFY_TWO_PASS) {
+            ok = fjpeg_transquant_input(context) && fjpeg_generate_header(&stream, context);
+        } else {
+            context->flush_rows = path == FJPEG_VERIFY_FLUSH ? 1 : 0;
+            ok = fjpeg_encode_frame(&stream, context);
+        }
+    }
+    output->swap(sink.data);
+    return ok;
+}
+
+static int64_t fjpeg_verify_elapsed_us(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static fjpeg_verify_backend_t fjpeg_verify_backend(const std::string& name) {
+    fjpeg_verify_backend_t backend = { name, 0, 0, 0, 0 };
+    return backend;
+}
+
+// Quantized levels of every block, rounded the way the entropy coders round them
+static void fjpeg_verify_levels(const fjpeg_context* context, std::vector<int>& levels) {
+    const int64_t luma = (context->luma_stride * context->paddedHeight());
+    levels.clear();
+    for (int64_t i = 0; i < luma; i++) {
+        levels.push_back((int)(context->fjpeg_ydct[i] + 0.5f));
+    }
+    for (int64_t i = 0; i < luma >> 2; i++) {
+        levels.push_back((int)(context->fjpeg_cbdct[i] + 0.5f));
+        levels.push_back((int)(context->fjpeg_crdct[i] + 0.5f));
+    }
+}
+
+static bool fjpeg_verify_load_golden(const char* filename, std::map<std::string, uint64_t>* hashes) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+    // "WxH qN dct coder hash" lines
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char size[32], quality[16], dct[32], coder[32];
+        unsigned long long hash;
+        if (line[0] == '#' || sscanf(line, "%31s %15s %31s %31s %llx", size, quality, dct, coder, &hash) != 5) {
+            continue;
+        }
+        (*hashes)[std::string(size) + " " + quality + " " + dct + " " + coder] = (uint64_t)hash;
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool fjpeg_verify_save_golden(const char* filename, const std::vector<std::pair<std::string, uint64_t> >& hashes) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "# fjpeg-verify golden hashes (XXH64 of the single pass JPEG), recorded by fjpeg " FJPEG_VERSION "\n");
+    for (size_t i = 0; i < hashes.size(); i++) {
+        fprintf(fp, "%s %016llx\n", hashes[i].first.c_str(), (unsigned long long)hashes[i].second);
+    }
+    return fclose(fp) == 0;
+}
+
+struct fjpeg_verify_sequence {
+    const std::vector<fjpeg_pixel_t>* frames;
+    std::vector<int> sizes;
+    std::vector<int> dct_methods;
+    std::vector<uint64_t> expected;
+    size_t next;
+    int64_t mismatches;
+    int64_t bytes_in;
+    std::vector<std::string>* failures;
+    std::string label;
+};
+
+static bool fjpeg_verify_sequence_read(void* user, fjpeg_frame* frame) {
+    fjpeg_verify_sequence* seq = (fjpeg_verify_sequence*)user;
+    if (seq->next >= seq->sizes.size()) {
+        return false;
+    }
+    const int size = seq->sizes[seq->next];
+    frame->context.dct_method = seq->dct_methods[seq->next];
+    seq->next++;
+    seq->bytes_in += (int64_t)seq->frames[size].size();
+    return fjpeg_verify_load(&frame->context, seq->frames[size], fjpeg_verify_sizes[size][0], fjpeg_verify_sizes[size][1]);
+}
+
+static bool fjpeg_verify_sequence_write(void* user, fjpeg_frame* frame) {
+    fjpeg_verify_sequence* seq = (fjpeg_verify_sequence*)user;
+    const std::vector<uint8_t>& data = frame->jpeg.data;
+    if (fjpeg_xxh64(data.data(), data.size(), 0) != seq->expected[(size_t)frame->index]) {
+        seq->mismatches++;
+        char message[160];
+        snprintf(message, sizeof(message), "%s frame %lld: differs from the single pass encode", seq->label.c_str(), (long long)frame->index);
+        seq->failures->push_back(message);
+    }
+    return true;
+}
+
+// Pipelined encoder threads, one run per quality over every size and DCT method
+static void fjpeg_verify_pipeline(int threads, const std::vector<fjpeg_pixel_t>* frames, std::map<std::string, uint64_t>& reference,
+                                  fjpeg_verify_result_t* result) {
+    fjpeg_verify_backend_t pipelined = fjpeg_verify_backend("pipeline-" + std::to_string(threads));
+    for (int q = 0; q < FJPEG_VERIFY_QUALITY_COUNT; q++) {
+        fjpeg_verify_sequence seq;
+        seq.frames = frames;
+        seq.next = 0;
+        seq.mismatches = 0;
+        seq.bytes_in = 0;
+        seq.failures = &result->failures;
+        seq.label = pipelined.name + " q" + std::to_string(fjpeg_verify_qualities[q]);
+        for (int s = 0; s < FJPEG_VERIFY_SIZE_COUNT; s++) {
+            for (int method = FJPEG_DCT_REFERENCE; method <= FJPEG_DCT_FAST; method++) {
+                seq.sizes.push_back(s);
+                seq.dct_methods.push_back(method);
+                seq.expected.push_back(reference[fjpeg_verify_key(s, fjpeg_verify_qualities[q], method, FJPEG_VERIFY_HUFFMAN)]);
+            }
+        }
+        fjpeg_pipeline pipeline(fjpeg_verify_qualities[q], threads + 1, threads);
+        if (!pipeline.run(fjpeg_verify_sequence_read, fjpeg_verify_sequence_write, &seq) || pipeline.frames != (int64_t)seq.sizes.size()) {
+            result->failures.push_back(seq.label + ": pipeline failed");
+            seq.mismatches++;
+        }
+        pipelined.encodes += pipeline.frames;
+        pipelined.mismatches += seq.mismatches;
+        pipelined.bytes_in += seq.bytes_in;
+        pipelined.time_us += pipeline.time_total_us;
+    }
+    result->backends.push_back(pipelined);
+}
+
+// Batch workers with every frame split into two row bands, so with more than one worker
+// bands of one frame are transformed on different threads, the workers use the default DCT method
+static void fjpeg_verify_batch(int threads, const std::vector<fjpeg_pixel_t>* frames, const char* scratch,
+                               std::map<std::string, uint64_t>& reference, fjpeg_verify_result_t* result) {
+    fjpeg_verify_backend_t banded = fjpeg_verify_backend("batch-" + std::to_string(threads));
+    fjpeg_batch batch(threads);
+    batch.band_pixels = 0;
+    batch.band_rows = 2;
+    const int batch_method = fjpeg_context().dct_method;
+    std::vector<std::string> keys;
+    bool written = true;
+    for (int s = 0; s < FJPEG_VERIFY_SIZE_COUNT; s++) {
+        char name[64];
+        snprintf(name, sizeof(name), "_%dx%d", fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1]);
+        const std::string input = std::string(scratch) + name + ".yuv";
+        FILE* fp = fopen(input.c_str(), "wb");
+        written = written && fp && fwrite(frames[s].data(), 1, frames[s].size(), fp) == frames[s].size();
+        if (fp) {
+            fclose(fp);
+        }
+        for (int q = 0; q < FJPEG_VERIFY_QUALITY_COUNT; q++) {
+            fjpeg_batch_job_t job = { input, std::string(scratch) + name + "_q" + std::to_string(fjpeg_verify_qualities[q]) + ".jpg",
+                                      fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1], fjpeg_verify_qualities[q], (int)batch.jobs.size() + 1 };
+            batch.jobs.push_back(job);
+            keys.push_back(fjpeg_verify_key(s, fjpeg_verify_qualities[q], batch_method, FJPEG_VERIFY_HUFFMAN));
+        }
+    }
+    if (!written || !batch.run()) {
+        result->failures.push_back(banded.name + ": batch failed");
+        banded.mismatches++;
+    }
+    for (size_t i = 0; i < batch.jobs.size(); i++) {
+        const fjpeg_batch_job_t& job = batch.jobs[i];
+        FILE* fp = fopen(job.output.c_str(), "rb");
+        std::vector<uint8_t> data;
+        if (fp) {
+            uint8_t buffer[4096];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+                data.insert(data.end(), buffer, buffer + n);
+            }
+            fclose(fp);
+        }
+        if (!fp || fjpeg_xxh64(data.data(), data.size(), 0) != reference[keys[i]]) {
+            banded.mismatches++;
+            result->failures.push_back(banded.name + " " + keys[i] + ": differs from the single pass encode");
+        }
+        banded.encodes++;
+        banded.bytes_in += fjpeg_context::frameSize(job.width, job.height);
+        remove(job.output.c_str());
+        if (i + 1 == batch.jobs.size() || batch.jobs[i + 1].input != job.input) {
+            remove(job.input.c_str());
+        }
+    }
+    banded.time_us = batch.time_total_us;
+    result->backends.push_back(banded);
+}
+
+// A context that streamed a frame holds planes for one MCU row, loading or reading a whole
+// frame of the same size into it afterwards has to reallocate them rather than write past the end
+static void fjpeg_verify_plane_reuse(const std::vector<fjpeg_pixel_t>* frames, const char* scratch,
+                                     std::map<std::string, uint64_t>& reference, fjpeg_verify_result_t* result) {
+    const int s = FJPEG_VERIFY_SIZE_COUNT - 1;
+    const std::string key = fjpeg_verify_key(s, fjpeg_verify_qualities[1], FJPEG_DCT_REFERENCE, FJPEG_VERIFY_HUFFMAN);
+    fjpeg_context context;
+    fjpeg_verify_configure(&context, fjpeg_verify_qualities[1], FJPEG_DCT_REFERENCE, FJPEG_VERIFY_HUFFMAN);
+    std::vector<uint8_t> output;
+    const int paths[] = { FJPEG_VERIFY_STREAM, FJPEG_VERIFY_SINGLE };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        const int path = paths[i];
+        if (!fjpeg_verify_encode(path, &context, frames[s], fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1], &output) ||
+            fjpeg_xxh64(output.data(), output.size(), 0) != reference[key]) {
+            result->failures.push_back(std::string(fjpeg_verify_path_names[path]) + " after stream " + key + ": differs from the single pass encode");
+        }
+    }
+
+    const std::string input = std::string(scratch) + "_reuse.yuv";
+    FILE* fp = fopen(input.c_str(), "wb");
+    bool ok = fp && fwrite(frames[s].data(), 1, frames[s].size(), fp) == frames[s].size();
+    if (fp) {
+        ok = fclose(fp) == 0 && ok;
+    }
+    fp = ok ? fopen(input.c_str(), "rb") : nullptr;
+    ok = fjpeg_verify_encode(FJPEG_VERIFY_STREAM, &context, frames[s], fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1], &output) &&
+         fp && context.readFrame(fp, fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1]);
+    if (fp) {
+        fclose(fp);
+    }
+    fjpeg_memory_sink sink;
+    {
+        fjpeg_bitstream stream(&sink);
+        ok = ok && fjpeg_encode_frame(&stream, &context);
+    }
+    output.swap(sink.data);
+    if (!ok || fjpeg_xxh64(output.data(), output.size(), 0) != reference[key]) {
+        result->failures.push_back("read after stream " + key + ": differs from the single pass encode");
+    }
+    remove(input.c_str());
+}
+
+// DHT segments the transcoder has to reject before it builds a decode table from them:
+// more codes than a length has room for, and counts that do not match the segment length
+static void fjpeg_verify_malformed_dht(fjpeg_verify_result_t* result) {
+    static const struct { const char* name; int counts[16]; int extra; } cases[] = {
+        { "three 1 bit codes", { 3 }, 0 },
+        { "five 2 bit codes", { 1, 5 }, 0 },
+        { "sixteen 4 bit codes after a 1 bit code", { 1, 0, 0, 16 }, 0 },
+        { "trailing bytes", { 1 }, 5 },
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int total = 0;
+        for (int k = 0; k < 16; k++) {
+            total += cases[c].counts[k];
+        }
+        const int length = 2 + 17 + total + cases[c].extra;
+
+        // AC table 3 is the last one the transcoder keeps, an overrun leaves its storage
+        std::vector<uint8_t> data = { 0xFF, 0xD8, 0xFF, 0xC4, (uint8_t)(length >> 8), (uint8_t)length, 0x13 };
+        for (int k = 0; k < 16; k++) {
+            data.push_back((uint8_t)cases[c].counts[k]);
+        }
+        data.resize(data.size() + (size_t)(total + cases[c].extra), 0);
+        data.push_back(0xFF);
+        data.push_back(0xD9);
+
+        fjpeg_context context;
+        if (fjpeg_transcode_load(&context, data.data(), data.size())) {
+            result->failures.push_back(std::string("transcode DHT with ") + cases[c].name + ": accepted");
+        } else {
+            result->malformed_rejected++;
+        }
+    }
+}
+
+// A row index written for a frame loads back, one whose entry count does not match the
+// rest of the file, as a forged or truncated one does, is rejected before it is allocated
+static void fjpeg_verify_row_index(const char* scratch, const std::vector<fjpeg_pixel_t>& frame, int width, int height,
+                                   fjpeg_verify_result_t* result) {
+    const std::string filename = std::string(scratch) + ".fjix";
+    fjpeg_context context;
+    context.record_row_index = true;
+    std::vector<uint8_t> output;
+    fjpeg_row_index_file_t index;
+    if (!fjpeg_verify_encode(FJPEG_VERIFY_SINGLE, &context, frame, width, height, &output) ||
+        !fjpeg_write_row_index(filename.c_str(), &context) || !fjpeg_load_row_index(filename.c_str(), &index) ||
+        index.entries.size() != context.row_index.size()) {
+        result->failures.push_back("row index: does not load back");
+    }
+
+    const struct { const char* name; uint32_t count; } cases[] = {
+        { "count of 2^32 - 1", 0xFFFFFFFFu },
+        { "one entry more than written", (uint32_t)context.row_index.size() + 1 },
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        FILE* fp = fopen(filename.c_str(), "r+b");
+        const uint8_t count[4] = { (uint8_t)cases[c].count, (uint8_t)(cases[c].count >> 8), (uint8_t)(cases[c].count >> 16), (uint8_t)(cases[c].count >> 24) };
+        const bool written = fp && fseek(fp, 14, SEEK_SET) == 0 && fwrite(count, 1, 4, fp) == 4;
+        if (fp) {
+            fclose(fp);
+        }
+        if (!written || fjpeg_load_row_index(filename.c_str(), &index)) {
+            result->failures.push_back(std::string("row index with a ") + cases[c].name + ": accepted");
+        } else {
+            result->malformed_rejected++;
+        }
+    }
+    remove(filename.c_str());
+}
+
+// A disk cache opened on a directory an earlier run filled has to count those files, every
+// run stores more entries, the last one with a smaller capacity, and what is left on disk
+// must fit the capacity of the run that wrote it
+static void fjpeg_verify_cache_reopen(const char* scratch, fjpeg_verify_result_t* result) {
+#ifndef _WIN32
+    const std::string directory = std::string(scratch) + "_cache";
+    mkdir(directory.c_str(), 0755);
+    const int64_t capacities[] = { 4096, 4096, 2048 };
+    const std::vector<uint8_t> data(1500, 0);
+    uint64_t key = 0;
+    for (int run = 0; run < 3; run++) {
+        fjpeg_cache cache(capacities[run], directory);
+        for (int i = 0; i < 3; i++) {
+            cache.store(++key, data);
+        }
+
+        int64_t on_disk = 0;
+        for (uint64_t k = 1; k <= key; k++) {
+            char name[32];
+            snprintf(name, sizeof(name), "/%016llx.jpg", (unsigned long long)k);
+            struct stat st;
+            if (stat((directory + name).c_str(), &st) == 0) {
+                on_disk += (int64_t)st.st_size;
+            }
+        }
+        result->cache_reopened_bytes = on_disk;
+        if (on_disk > capacities[run] || on_disk != cache.used) {
+            char message[160];
+            snprintf(message, sizeof(message), "cache run %d: %lld bytes on disk, %lld counted, capacity %lld", run + 1,
+                     (long long)on_disk, (long long)cache.used, (long long)capacities[run]);
+            result->failures.push_back(message);
+        }
+    }
+    for (uint64_t k = 1; k <= key; k++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.jpg", (unsigned long long)k);
+        remove((directory + name).c_str());
+    }
+    remove(directory.c_str());
+#endif
+}
+
+bool fjpeg_verify(const char* golden, bool record, const char* scratch, int threads, fjpeg_verify_result_t* result) {
+    result->backends.clear();
+    result->failures.clear();
+    result->golden_checked = 0;
+    result->malformed_rejected = 0;
+    result->cache_reopened_bytes = 0;
+    result->golden_written = false;
+#ifdef FJPEG_SSE2
+    result->simd = true;
+#else
+    result->simd = false;
+#endif
+    memset(result->max_level_diff, 0, sizeof(result->max_level_diff));
+
+    std::vector<fjpeg_pixel_t> frames[FJPEG_VERIFY_SIZE_COUNT];
+    for (int s = 0; s < FJPEG_VERIFY_SIZE_COUNT; s++) {
+        fjpeg_verify_frame(fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1], frames[s]);
+    }
+
+    // Every path keeps its own context across all encodes, like a long running encoder,
+    // so state left over from the previous frame shows up as a mismatch
+    std::vector<fjpeg_context*> contexts;
+    for (int path = 0; path < FJPEG_VERIFY_PATHS; path++) {
+        contexts.push_back(new fjpeg_context());
+        result->backends.push_back(fjpeg_verify_backend(fjpeg_verify_path_names[path]));
+    }
+
+    std::map<std::string, uint64_t> reference;
+    std::vector<std::pair<std::string, uint64_t> > ordered;
+    std::vector<uint8_t> output;
+    for (int s = 0; s < FJPEG_VERIFY_SIZE_COUNT; s++) {
+        const int width = fjpeg_verify_sizes[s][0];
+        const int height = fjpeg_verify_sizes[s][1];
+        for (int q = 0; q < FJPEG_VERIFY_QUALITY_COUNT; q++) {
+            for (int method = FJPEG_DCT_REFERENCE; method <= FJPEG_DCT_FAST; method++) {
+                for (int coder = FJPEG_VERIFY_HUFFMAN; coder <= FJPEG_VERIFY_RESTART; coder++) {
+                    const std::string key = fjpeg_verify_key(s, fjpeg_verify_qualities[q], method, coder);
+                    for (int path = 0; path < FJPEG_VERIFY_PATHS; path++) {
+                        fjpeg_verify_backend_t& backend = result->backends[path];
+                        fjpeg_verify_configure(contexts[path], fjpeg_verify_qualities[q], method, coder);
+                        auto start = std::chrono::high_resolution_clock::now();
+                        const bool ok = fjpeg_verify_encode(path, contexts[path], frames[s], width, height, &output);
+                        backend.time_us += fjpeg_verify_elapsed_us(start);
+                        backend.encodes++;
+                        backend.bytes_in += (int64_t)frames[s].size();
+
+                        const uint64_t hash = fjpeg_xxh64(output.data(), output.size(), 0);
+                        if (path == FJPEG_VERIFY_SINGLE) {
+                            reference[key] = hash;
+                            ordered.push_back(std::make_pair(key, hash));
+                        }
+                        if (!ok || hash != reference[key]) {
+                            backend.mismatches++;
+                            result->failures.push_back(backend.name + " " + key + (ok ? ": differs from the single pass encode" : ": encode failed"));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < contexts.size(); i++) {
+        delete contexts[i];
+    }
+
+    // The faster DCT methods round differently, their levels are held to a bound instead
+    fjpeg_context transform;
+    std::vector<int> levels[FJPEG_DCT_FAST + 1];
+    for (int s = 0; s < FJPEG_VERIFY_SIZE_COUNT; s++) {
+        for (int q = 0; q < FJPEG_VERIFY_QUALITY_COUNT; q++) {
+            for (int method = FJPEG_DCT_REFERENCE; method <= FJPEG_DCT_FAST; method++) {
+                fjpeg_verify_configure(&transform, fjpeg_verify_qualities[q], method, FJPEG_VERIFY_HUFFMAN);
+                fjpeg_verify_load(&transform, frames[s], fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1]);
+                fjpeg_transquant_input(&transform);
+                fjpeg_verify_levels(&transform, levels[method]);
+                int diff = 0;
+                for (size_t i = 0; i < levels[method].size(); i++) {
+                    diff = FJPEG_MAX(diff, abs(levels[method][i] - levels[FJPEG_DCT_REFERENCE][i]));
+                }
+                result->max_level_diff[method] = FJPEG_MAX(result->max_level_diff[method], diff);
+                if (diff > FJPEG_VERIFY_MAX_LEVEL_DIFF) {
+                    char message[160];
+                    snprintf(message, sizeof(message), "%s DCT %dx%d q%d: quantized levels differ by %d from the reference DCT",
+                             fjpeg_dct_method_name(method), fjpeg_verify_sizes[s][0], fjpeg_verify_sizes[s][1], fjpeg_verify_qualities[q], diff);
+                    result->failures.push_back(message);
+                }
+            }
+        }
+    }
+
+    fjpeg_verify_plane_reuse(frames, scratch, reference, result);
+    fjpeg_verify_malformed_dht(result);
+    fjpeg_verify_row_index(scratch, frames[FJPEG_VERIFY_SIZE_COUNT - 1], fjpeg_verify_sizes[FJPEG_VERIFY_SIZE_COUNT - 1][0],
+                           fjpeg_verify_sizes[FJPEG_VERIFY_SIZE_COUNT - 1][1], result);
+    fjpeg_verify_cache_reopen(scratch, result);
+
+    // One worker, two, and the requested count, each path must not depend on the split
+    std::vector<int> counts;
+    counts.push_back(1);
+    counts.push_back(2);
+    if (threads > 2) {
+        counts.push_back(threads);
+    }
+    for (size_t i = 0; i < counts.size(); i++) {
+        fjpeg_verify_pipeline(counts[i], frames, reference, result);
+    }
+    for (size_t i = 0; i < counts.size(); i++) {
+        fjpeg_verify_batch(counts[i], frames, scratch, reference, result);
+    }
+
+    // The golden file pins the single pass output across builds, compilers and SIMD paths,
+    // a missing one is a failure so a fresh checkout can not pass without it
+    std::map<std::string, uint64_t> expected;
+    if (record) {
+        if (!fjpeg_verify_save_golden(golden, ordered)) {
+            result->failures.push_back(std::string("unable to write golden file ") + golden);
+        }
+        result->golden_written = true;
+    } else if (!fjpeg_verify_load_golden(golden, &expected)) {
+        result->failures.push_back(std::string("unable to read golden file ") + golden + ", record it with --record");
+    } else {
+        for (size_t i = 0; i < ordered.size(); i++) {
+            std::map<std::string, uint64_t>::const_iterator it = expected.find(ordered[i].first);
+            if (it == expected.end()) {
+                result->failures.push_back("golden " + ordered[i].first + ": missing from the golden file");
+            } else if (it->second != ordered[i].second) {
+                result->failures.push_back("golden " + ordered[i].first + ": differs from the golden hash");
+            }
+            result->golden_checked++;
+        }
+    }
+
+    return result->failures.empty();
+}
@@ -0,0 +1,68 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fjpeg_global.h"
+
+// The DCT methods compute the same transform with different rounding, a quantized level
+// may move by this much between them
+#define FJPEG_VERIFY_MAX_LEVEL_DIFF 1
+
+// One encoder path of a verify run, every output it produced is compared byte for byte
+// with the single pass encode of the same frame and settings
+typedef struct {
+    std::string name;
+    int64_t encodes;
+    int64_t mismatches;
+    int64_t bytes_in;   // YUV bytes encoded, for the throughput
+    int64_t time_us;
+} fjpeg_verify_backend_t;
+
+typedef struct {
+    std::vector<fjpeg_verify_backend_t> backends;
+    std::vector<std::string> failures;
+    int64_t golden_checked;         // Single pass hashes compared with the golden file
+    bool golden_written;            // The golden file was recorded instead of compared
+    bool simd;                      // Built with the SSE2 entropy coder and quantization paths
+    int malformed_rejected;         // Malformed DHT segments and row index files that were rejected, as they should be
+    int64_t cache_reopened_bytes;   // Size of the cache directory after a reopen and more stores
+    int max_level_diff[3];          // Largest quantized level difference to the reference DCT, per FJPEG_DCT_*
+} fjpeg_verify_result_t;
+
+// Encode generated frames at edge case sizes and qualities with every DCT method and
+// entropy coder, check that the two pass, streaming, flushing, pipelined and batch banded
+// paths (with 1, 2 and threads workers) write the same bytes as the single pass encode,
+// that the faster DCT methods stay within FJPEG_VERIFY_MAX_LEVEL_DIFF of the reference one,
+// that malformed DHT segments and row index files are rejected, that a reopened disk cache
+// stays within its capacity, and compare the single pass hashes with the golden file, or
+// write it when record is set.
+// scratch is a file name prefix for the batch files, the row index and the cache directory
+bool fjpeg_verify(const char* golden, bool record, const char* scratch, int threads, fjpeg_verify_result_t* result);
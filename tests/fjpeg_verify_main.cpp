@@ -0,0 +1,108 @@
+/*
+FJPEG
+BSD 2-Clause License
+
+Copyright (c) 2024, Marko Viitanen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "fjpeg.h"
+#include "fjpeg_optimize.h"
+#include "fjpeg_verify.h"
+
+static void fjpeg_verify_usage() {
+    printf("Usage: fjpeg-verify <golden_file> [options]\r\n");
+    printf("Check every encode path on generated frames against each other and the golden hashes in golden_file\r\n");
+    printf("Options:\r\n");
+    printf("  --threads <n>  Largest worker count of the pipeline and batch checks, 1 and 2 always run (default 4)\r\n");
+    printf("  --record  Write the golden hashes of this build to golden_file instead of checking them\r\n");
+}
+
+// Scratch files are written to the current directory and removed again
+int main(int argc, char** argv) {
+    printf("FJPEG %s\n", fjpeg_version());
+
+    std::string golden_filename;
+    bool record = false;
+    int threads = 4;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--threads") == 0) {
+            if(i+1 < argc && atoi(argv[i+1]) > 0) {
+                threads = atoi(argv[i+1]);
+            } else {
+                fprintf(stderr, "Error: Invalid thread count\n");
+                return 1;
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--record") == 0) {
+            record = true;
+        }
+        else if(argv[i][0] != '-' && golden_filename.empty()) {
+            golden_filename = argv[i];
+        }
+        else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            fjpeg_verify_usage();
+            return 1;
+        }
+    }
+    if(golden_filename.empty()) {
+        fprintf(stderr, "Error: Missing golden filename\n");
+        fjpeg_verify_usage();
+        return 1;
+    }
+
+    fjpeg_verify_result_t result;
+    const bool ok = fjpeg_verify(golden_filename.c_str(), record, "fjpeg_verify", threads, &result);
+
+    printf("%-12s %8s %10s %10s %10s\r\n", "backend", "encodes", "mismatches", "ms", "MB/s");
+    for(size_t i = 0; i < result.backends.size(); i++) {
+        const fjpeg_verify_backend_t& backend = result.backends[i];
+        printf("%-12s %8lld %10lld %10.1f %10.2f\r\n", backend.name.c_str(), (long long)backend.encodes, (long long)backend.mismatches,
+               backend.time_us / 1000.0, backend.time_us > 0 ? (double)backend.bytes_in / backend.time_us : 0.0);
+    }
+    for(int method = FJPEG_DCT_SEPARABLE; method <= FJPEG_DCT_FAST; method++) {
+        printf("DCT %s: quantized levels within %d of the reference (limit %d)\r\n", fjpeg_dct_method_name(method),
+               result.max_level_diff[method], FJPEG_VERIFY_MAX_LEVEL_DIFF);
+    }
+    printf("Malformed: %d DHT segments and row index files rejected, their errors above are expected\r\n", result.malformed_rejected);
+    printf("Cache: %lld bytes on disk after reopening it three times\r\n", (long long)result.cache_reopened_bytes);
+    const char* entropy = result.simd ? "SSE2" : "scalar";
+    if(result.golden_written) {
+        printf("Golden: recorded %s with the %s entropy coder build\r\n", golden_filename.c_str(), entropy);
+    } else {
+        printf("Golden: %lld hashes checked against %s with the %s entropy coder build\r\n", (long long)result.golden_checked,
+               golden_filename.c_str(), entropy);
+    }
+
+    for(size_t i = 0; i < result.failures.size(); i++) {
+        fprintf(stderr, "Error: %s\n", result.failures[i].c_str());
+    }
+    printf("Verify: %s\r\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}